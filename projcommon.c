@@ -9,19 +9,336 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <omp.h>
 #include "projcommon.h"
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+/* 
+// The widest non-temporal stores the compiler targets, for FLPTs: 
+// STREAMBYTES is their width (and the alignment they need), STREAMVECT 
+// their type, and the others set, load (unaligned) and store them.
+*/
+
+#if defined(__AVX512F__)
+    #define STREAMBYTES 64
+    #ifdef BIGFLOAT
+        #define STREAMVECT __m512d
+        #define STREAMSET _mm512_set1_pd
+        #define STREAMLOAD _mm512_loadu_pd
+        #define STREAMSTORE _mm512_stream_pd
+    #else
+        #define STREAMVECT __m512
+        #define STREAMSET _mm512_set1_ps
+        #define STREAMLOAD _mm512_loadu_ps
+        #define STREAMSTORE _mm512_stream_ps
+    #endif
+#elif defined(__AVX__)
+    #define STREAMBYTES 32
+    #ifdef BIGFLOAT
+        #define STREAMVECT __m256d
+        #define STREAMSET _mm256_set1_pd
+        #define STREAMLOAD _mm256_loadu_pd
+        #define STREAMSTORE _mm256_stream_pd
+    #else
+        #define STREAMVECT __m256
+        #define STREAMSET _mm256_set1_ps
+        #define STREAMLOAD _mm256_loadu_ps
+        #define STREAMSTORE _mm256_stream_ps
+    #endif
+#elif defined(__SSE2__)
+    #define STREAMBYTES 16
+    #ifdef BIGFLOAT
+        #define STREAMVECT __m128d
+        #define STREAMSET _mm_set1_pd
+        #define STREAMLOAD _mm_loadu_pd
+        #define STREAMSTORE _mm_stream_pd
+    #else
+        #define STREAMVECT __m128
+        #define STREAMSET _mm_set1_ps
+        #define STREAMLOAD _mm_loadu_ps
+        #define STREAMSTORE _mm_stream_ps
+    #endif
+#endif
 
 /* Function implementations. */
 
+/* Whether vassign advises huge pages for large blocks. */
+
+static INTG bhugepages = 1;
+
+void sethugepages(const INTG bhuge)
+{
+    bhugepages = (bhuge != 0);
+}
+
+INTG gethugepages(void)
+{
+    return bhugepages;
+}
+
+void * vassign(const size_t lbytes)
+{
+    void * pmemory = NULL; /* Return value. */
+    const INTG bhuge = (lbytes >= HUGEPAGESIZE); /* A large block? */
+    
+/* 
+// Rounding the size up to whole huge pages keeps the end of the block
+// from sharing a huge page with some other allocation.
+*/    
+    
+    const size_t lalloc = bhuge ? 
+        ((lbytes + HUGEPAGESIZE - 1) / HUGEPAGESIZE) * HUGEPAGESIZE : lbytes;
+    if (posix_memalign(&pmemory, bhuge ? HUGEPAGESIZE : ASSIGNALIGN, 
+        max(lalloc, 1)) != 0)
+    {
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if (bhuge && bhugepages)
+    {
+        madvise(pmemory, lalloc, MADV_HUGEPAGE); /* Only advice. */
+    }
+#endif
+    return pmemory;
+}
+
+void vunassign(void * pmemory)
+{
+    free(pmemory);
+}
+
 FLPT * dassign(const INTG isize)
 {
-    return (FLPT *)malloc(isize * sizeof(FLPT));
+    return (FLPT *) vassign(max(isize, 0) * sizeof(FLPT));
 }
 
 INTG * iassign(const INTG isize)
 {
-    return (INTG *)malloc(isize * sizeof(INTG));
+    return (INTG *) vassign(max(isize, 0) * sizeof(INTG));
+}
+
+FLPT * dassignlocal(const INTG isize)
+{
+    FLPT * dret = dassign(isize); /* Return value. */
+    INTG i; /* Iteration variable. */
+    if (dret == NULL)
+    {
+        return NULL;
+    }
+    #pragma omp parallel for schedule(static)
+    for (i = 0; i < isize; i++)
+    {
+        dret[i] = 0.0;
+    }
+    return dret;
+}
+
+/* The size from which vectors are streamed (0 for the LLC default). */
+
+static size_t lstreambytes = 0;
+
+void setstreamthreshold(const size_t lbytes)
+{
+    lstreambytes = lbytes;
+}
+
+size_t getstreamthreshold(void)
+{
+    return (lstreambytes > 0) ? lstreambytes : (size_t) icachesize(3);
+}
+
+INTG bstreamvector(const INTG isize)
+{
+    return (isize > 0) && 
+        (((size_t) isize * sizeof(FLPT)) >= getstreamthreshold());
+}
+
+/*
+// The streamfillrange and streamcopyrange functions do the work of 
+// dstreamfill and dstreamcopy for elements [lfrom, lto). Ordinary stores
+// are used up to the first element aligned to STREAMBYTES, and for the 
+// elements left over at the end. The fence makes the streaming stores 
+// visible to other threads before this one goes on.
+*/
+
+static void streamfillrange(FLPT * dret, const FLPT dvalue, INTG lfrom, 
+    const INTG lto)
+{
+#ifdef STREAMBYTES
+    const INTG lwidth = STREAMBYTES / sizeof(FLPT); /* FLPTs per store. */
+    const STREAMVECT vvalue = STREAMSET(dvalue);
+    while ((lfrom < lto) && (((uintptr_t) &(dret[lfrom])) % STREAMBYTES != 0))
+    {
+        dret[lfrom++] = dvalue;
+    }
+    for (; lfrom + lwidth <= lto; lfrom += lwidth)
+    {
+        STREAMSTORE(&(dret[lfrom]), vvalue);
+    }
+    _mm_sfence();
+#endif
+    for (; lfrom < lto; lfrom++)
+    {
+        dret[lfrom] = dvalue;
+    }
+}
+
+static void streamcopyrange(FLPT * ddest, const FLPT * dsource, INTG lfrom, 
+    const INTG lto)
+{
+#ifdef STREAMBYTES
+    const INTG lwidth = STREAMBYTES / sizeof(FLPT); /* FLPTs per store. */
+    while ((lfrom < lto) && (((uintptr_t) &(ddest[lfrom])) % STREAMBYTES != 0))
+    {
+        ddest[lfrom] = dsource[lfrom];
+        lfrom++;
+    }
+    for (; lfrom + lwidth <= lto; lfrom += lwidth)
+    {
+        STREAMSTORE(&(ddest[lfrom]), STREAMLOAD(&(dsource[lfrom])));
+    }
+    _mm_sfence();
+#endif
+    for (; lfrom < lto; lfrom++)
+    {
+        ddest[lfrom] = dsource[lfrom];
+    }
+}
+
+FLPT * dstreamfill(const INTG isize, const FLPT dvalue, FLPT * dret)
+{
+    #pragma omp parallel
+    {
+        INTG lstart, lend; /* The block of elements this thread owns. */
+        rowblock(isize, &lstart, &lend);
+        streamfillrange(dret, dvalue, lstart, lend);
+    }
+    return dret;
+}
+
+FLPT * dstreamcopy(const INTG isize, FLPT * ddest, const FLPT * dsource)
+{
+    #pragma omp parallel
+    {
+        INTG lstart, lend; /* The block of elements this thread owns. */
+        rowblock(isize, &lstart, &lend);
+        streamcopyrange(ddest, dsource, lstart, lend);
+    }
+    return ddest;
+}
+
+void rowblock(const INTG isize, INTG * istart, INTG * iend)
+{
+#ifdef _OPENMP
+    INTG inothreads = omp_get_num_threads(); /* Threads in the team. */
+    INTG ithread = omp_get_thread_num(); /* This thread. */
+    INTG iquot = isize / inothreads; /* Rows every thread gets. */
+    INTG irem = isize % inothreads; /* The first irem get one more. */
+    if (ithread < irem)
+    {
+        *istart = ithread * (iquot + 1);
+        *iend = *istart + iquot + 1;
+    }
+    else
+    {
+        *istart = (ithread * iquot) + irem;
+        *iend = *istart + iquot;
+    }
+#else
+    *istart = 0;
+    *iend = isize;
+#endif
+}
+
+/*
+// The isysfscache function looks for the size of the level ilevel data
+// (or unified) cache under /sys. It returns 0 if it cannot find it.
+*/
+
+static INTG isysfscache(const INTG ilevel)
+{
+    char spath[128]; /* The path of the file being read. */
+    char stype[32]; /* The type of the cache. */
+    INTG ifilelevel; /* The level of the cache. */
+    INTG isize; /* The size, in KiB. */
+    INTG iindex; /* Over the caches. */
+    FILE * pfile;
+    for (iindex = 0; iindex < 10; iindex++)
+    {
+        sprintf(spath, "/sys/devices/system/cpu/cpu0/cache/index%d/level", 
+            iindex);
+        pfile = fopen(spath, "r");
+        if (pfile == NULL)
+        {
+            break;
+        }
+        if ((fscanf(pfile, "%d", &ifilelevel) != 1) || (ifilelevel != ilevel))
+        {
+            fclose(pfile);
+            continue;
+        }
+        fclose(pfile);
+        sprintf(spath, "/sys/devices/system/cpu/cpu0/cache/index%d/type", 
+            iindex);
+        pfile = fopen(spath, "r");
+        if ((pfile == NULL) || (fscanf(pfile, "%31s", stype) != 1) || 
+            (stype[0] == 'I')) /* Skip instruction caches. */
+        {
+            if (pfile != NULL)
+            {
+                fclose(pfile);
+            }
+            continue;
+        }
+        fclose(pfile);
+        sprintf(spath, "/sys/devices/system/cpu/cpu0/cache/index%d/size", 
+            iindex);
+        pfile = fopen(spath, "r");
+        if ((pfile != NULL) && (fscanf(pfile, "%dK", &isize) == 1))
+        {
+            fclose(pfile);
+            return isize * 1024;
+        }
+        if (pfile != NULL)
+        {
+            fclose(pfile);
+        }
+    }
+    return 0;
+}
+
+INTG icachesize(const INTG ilevel)
+{
+    static INTG icaches[3] = {0, 0, 0}; /* Sizes found so far. */
+    const INTG idefaults[3] = {DEFL1CACHE, DEFL2CACHE, DEFL3CACHE};
+    INTG isize = 0; /* The size found. */
+    if ((ilevel < 1) || (ilevel > 3))
+    {
+        return 0;
+    }
+    if (icaches[ilevel - 1] > 0)
+    {
+        return icaches[ilevel - 1];
+    }
+#if defined(_SC_LEVEL1_DCACHE_SIZE) && defined(_SC_LEVEL3_CACHE_SIZE)
+    const int inames[3] = {_SC_LEVEL1_DCACHE_SIZE, _SC_LEVEL2_CACHE_SIZE,
+        _SC_LEVEL3_CACHE_SIZE};
+    isize = (INTG) sysconf(inames[ilevel - 1]);
+#endif
+    if (isize <= 0)
+    {
+        isize = isysfscache(ilevel);
+    }
+    if (isize <= 0)
+    {
+        isize = idefaults[ilevel - 1];
+    }
+    icaches[ilevel - 1] = isize;
+    return isize;
 }
 
 /*
@@ -58,6 +375,10 @@ INTG * SetNull(INTG iSize, INTG * iItem)
 FLPT * SetFValue(int iSize, FLPT fVal, FLPT * fItem)
 {
     INTG i;
+    if (bstreamvector(iSize))
+    {
+        return dstreamfill(iSize, fVal, fItem);
+    }
     for (i = 0; i < iSize; i++)
     {
         fItem[i] = fVal;
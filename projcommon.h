@@ -55,12 +55,36 @@ typedef uint64_t TLEN;
 
 TLEN timespecDiff(struct timespec *ptime1, struct timespec *ptime2);
 
+/* 
+// The vassign function assigns lbytes of memory, aligned to ASSIGNALIGN
+// bytes (a cache line, and the width of the widest vector registers).
+// Blocks of at least HUGEPAGESIZE bytes are aligned to HUGEPAGESIZE, and
+// where Linux has transparent huge pages, they are marked (by madvise)
+// to be backed by huge pages, so large vectors take fewer TLB misses.
+// The return value is the memory, or NULL if it could not be assigned.
+// The vunassign function frees memory from vassign (free also works). 
+//
+// The sethugepages function turns the huge page advice on (bhuge 
+// nonzero, the default) or off, and gethugepages returns the setting.
+*/
+
+#define ASSIGNALIGN 64
+#define HUGEPAGESIZE 2097152
+
+void * vassign(const size_t lbytes);
+
+void vunassign(void * pmemory);
+
+void sethugepages(const INTG bhuge);
+
+INTG gethugepages(void);
+
 /* 
 // The dassign function assigns memory for a FLPT vector. The argument:
 // - isize: the number of elements in the vector.
-// The return value is the vector.
+// The return value is the vector, aligned as for vassign.
 // Note: the space for the vector should be deallocated after use using
-// the free function or similar. 
+// the vunassign or free function. 
 */
 
 FLPT * dassign(const INTG isize);
@@ -68,13 +92,77 @@ FLPT * dassign(const INTG isize);
 /* 
 // The iassign function assigns memory for a INTG vector. The argument:
 // - isize: the number of elements in the vector.
-// The return value is the vector.
+// The return value is the vector, aligned as for vassign.
 // Note: the space for the vector should be deallocated after use using
-// the free function or similar. 
+// the vunassign or free function. 
 */
 
 INTG * iassign(const INTG isize);
 
+/* 
+// The dassignlocal function does the same as dassign, but then sets
+// every element to zero with the static row split of rowblock. Under
+// first-touch page placement, each page then lives next to the thread
+// that works on those rows in the multiplication and vector routines,
+// rather than all on the node of the allocating thread. Use it for
+// vectors that are not filled in by one of those routines first.
+*/
+
+FLPT * dassignlocal(const INTG isize);
+
+/*
+// The dstreamfill function sets the isize elements of dret to dvalue, 
+// and dstreamcopy copies the isize elements of dsource to ddest; both 
+// return the vector written to, and split the work with rowblock. They
+// use non-temporal ("streaming") stores where the compiler targets SSE2
+// or later, which write around the caches: the lines are not read from
+// memory first (to gain ownership) and they do not push other data out
+// of the cache. That pays for vectors too big to stay in the cache, but
+// not for small ones that are read again straight away.
+//
+// The getstreamthreshold function returns the size (in bytes) from 
+// which the vector routines use these, rather than ordinary stores. 
+// Unless setstreamthreshold has set it (to a positive size; 0 restores
+// the default), it is the size of the last level cache (see icachesize).
+// The bstreamvector function tells whether a vector of isize FLPTs is at 
+// or above the threshold.
+*/
+
+FLPT * dstreamfill(const INTG isize, const FLPT dvalue, FLPT * dret);
+
+FLPT * dstreamcopy(const INTG isize, FLPT * ddest, const FLPT * dsource);
+
+void setstreamthreshold(const size_t lbytes);
+
+size_t getstreamthreshold(void);
+
+INTG bstreamvector(const INTG isize);
+
+/*
+// The rowblock function works out the contiguous block of rows that the
+// calling OpenMP thread owns when isize rows are split by a static
+// schedule. The block is [*istart, *iend). It gives the same split as
+// "#pragma omp for schedule(static)", so loops written either way touch
+// the same rows on the same threads. Outside a parallel region (or
+// without OpenMP) the block is the whole range.
+*/
+
+void rowblock(const INTG isize, INTG * istart, INTG * iend);
+
+/*
+// The icachesize function returns the size (in bytes) of the level ilevel
+// data cache (1, 2 or 3) of the CPU we are running on. It asks sysconf,
+// then Linux's /sys/devices/system/cpu/cpu0/cache, and otherwise falls
+// back on the guesses DEFL1CACHE, DEFL2CACHE and DEFL3CACHE. Answers are
+// remembered after the first call.
+*/
+
+#define DEFL1CACHE 32768
+#define DEFL2CACHE 262144
+#define DEFL3CACHE 8388608
+
+INTG icachesize(const INTG ilevel);
+
 // Sets a vector fItem of floats of size iSize to 0.0. Returns it as well.
 
 FLPT * SetFNull(INTG iSize, FLPT * fItem);
@@ -16,17 +16,23 @@ int main(int argc, char *argv[])
 // matrices used for testing. The second is the number of repetitions
 // of matrix multiplication. Both these arguments are necessary, and 
 // there are also lower bounds on acceptable values. The following 
-// code does validation on this.
+// code does validation on this. An optional third argument of 1 turns
+// on deterministic reductions (see setdeterministic), and an optional
+// fourth argument of 1 solves with dconjgradpar rather than dconjgradws,
+// of 2 with dconjgradpipe, and of 3 with dconjgradsstep (4 steps at once).
 */    
 
     const INTG iminmatsize = MINDIAGT27;
     
     if (argc < 3)
     {
-        printf("To execute this, type:\n\n[exec] n m\n\nWhere:\nn (>= ");
+        printf("To execute this, type:\n\n[exec] n m [d [p]]\n\nWhere:\nn (>= ");
         printf("%d) ", iminmatsize);
         printf("is the size of the matrices to be multiplied and tested;");
-        printf("\nm (>= 1) is the number of repetitions.\n\n");
+        printf("\nm (>= 1) is the number of repetitions;");
+        printf("\nd (optional) is 1 for deterministic reductions;");
+        printf("\np (optional) is 1 to solve in one parallel region, 2 ");
+        printf("to do so with pipelined CG, or 3 for s-step CG.\n\n");
         return(0);
     }
     const INTG imatsize = atoi(argv[1]);
@@ -42,19 +48,25 @@ int main(int argc, char *argv[])
         printf("Please pass a number of repetitions greater or equal to 1.\n");
         return(0);
     }    
+    if (argc > 3)
+    {
+        setdeterministic(atoi(argv[3]) == 1);
+    }
+    const INTG boneregion = (argc > 4) ? atoi(argv[4]) : 0;
     
     
 /* 
 // Some useful variables:
 // - i, j: general purpose iteration variables.
-// - start, end: contains start and end times.
+// - ourws: the workspace for every solve, which also times them.
 // - dvector: a test vector; consists solely of 1.0s.
 */
     
     INTG i, j;
-    struct timespec start, end;
+    cgworkspace * ourws = create_cgworkspacebasis(imatsize, 
+        (boneregion == 3) ? ((2 * 4) + 1) : 0);
     FLPT *didentvector = dsetvector(imatsize, 1.0);
-    if (didentvector == NULL)
+    if ((didentvector == NULL) || (ourws == NULL))
     {
         printf("The function is unable to allocate a simple vector.\n"); 
         return (0);
@@ -142,18 +154,38 @@ int main(int argc, char *argv[])
         if (immindices[i] < iminisize)
         {
     //        printf ("%d\n", i);
-            clock_gettime(CLOCK_MONOTONIC, &start);
+            ourtestbed[i].testlen = 0;
             for (j = 0; j < inoreps; j++)
             {
-                dconjgrad(ourtestbed[i].ourucds,
-                    didentvector, dzerovector, ourtestbed[i].dret,
-                    ourtestbed[i].thefp, dvectnorm, 2, 0.1, &icount); /* &istore */
+                if (boneregion == 3)
+                {
+                    dconjgradsstep(ourws, ourtestbed[i].ourucds,
+                        didentvector, dzerovector, ourtestbed[i].dret,
+                        4, 0.1, &icount);
+                }
+                else if (boneregion == 2)
+                {
+                    dconjgradpipe(ourws, ourtestbed[i].ourucds,
+                        didentvector, dzerovector, ourtestbed[i].dret,
+                        0.1, &icount);
+                }
+                else if (boneregion == 1)
+                {
+                    dconjgradpar(ourws, ourtestbed[i].ourucds,
+                        didentvector, dzerovector, ourtestbed[i].dret,
+                        0.1, &icount);
+                }
+                else
+                {
+                    dconjgradws(ourws, ourtestbed[i].ourucds,
+                        didentvector, dzerovector, ourtestbed[i].dret,
+                        ourtestbed[i].thefp, dvectnorm, 2, 0.1, &icount); /* &istore */
+                }
        //         printf("%d, %d \n", icount, ourtestbed[i].inoreps);
                 ourtestbed[i].inoreps += icount;
+                ourtestbed[i].testlen += ourws->tlastsolve;
               //  printf("icount: %d\n", icount);
             } 
-            clock_gettime(CLOCK_MONOTONIC, &end);
-            ourtestbed[i].testlen = timespecDiff(&end, &start);
         } 
     }
 
@@ -176,6 +208,7 @@ int main(int argc, char *argv[])
     }        
 
     free(dzerovector); 
+    destroy_cgworkspace(ourws);
 //    printf("Made it!\n");
     return 0;
 }
@@ -20,6 +20,15 @@ else:
     MAXMATSIZE = 4194304 #16384 2097152;
     NOITERS = "20";
 
+# A fourth argument of 1 times the 27 point 3D stencil instead, 2 times
+# multiplying by several vectors at once, and 3 times narrow storage of
+# the matrix (see runucds.c).
+
+if len(sys.argv) >= 5:
+    RUNMODE = [str(int(sys.argv[4]))];
+else:
+    RUNMODE = [];
+
 # Now we try out the executables.
 
 for k in ["0", "3"]: #EFF_OPTIONS:
@@ -28,6 +37,6 @@ for k in ["0", "3"]: #EFF_OPTIONS:
         i = MINMATSIZE; # The minimum iteration amount
         print ourFile;
         while i <= MAXMATSIZE:
-            subprocess.call([ourFile, str(i), NOITERS]);
+            subprocess.call([ourFile, str(i), NOITERS] + RUNMODE);
             i *= 2;
 
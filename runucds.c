@@ -9,6 +9,180 @@
 #include "projcommon.h"
 #include "ucds.h"
 
+/*
+// The runstencil function is the second mode of this program. It times
+// multiplication by the matrix of a 27 point 3D stencil on a grid of
+// about imatsize points (a cube, as near as possible), where diagonals are
+// spread nx*ny + nx + 1 either side of the main one. Each multiplication
+// function is run inoreps times. The MFLOP/s of multiply_ucds, 
+// multiply_ucdsalt, multiply_ucdsrow, best_multiply_ucds(), the fixed 27
+// diagonal function and multiply_ucdstiled are printed, then the size.
+*/
+
+INTG runstencil(const INTG imatsize, const INTG inoreps)
+{
+    INTG i, j;
+    struct timespec start, end;
+    INTG inx = (INTG) cbrt((double) imatsize); /* The side of the grid. */
+    while (((inx + 1) * (inx + 1) * (inx + 1)) <= imatsize)
+    {
+        inx++;
+    }
+    while ((inx * inx * inx) > imatsize)
+    {
+        inx--;
+    }
+    INTG ldiagindices[LARGEDIAG];
+    FLPT ddiagvals[LARGEDIAG];
+    if (!create3dstencil(inx, inx, LARGEDIAG, ldiagindices, ddiagvals))
+    {
+        printf("Please pass a matrix size greater or equal to 27.\n");
+        return 0;
+    }
+    ucds * ourucds = mmatrix_ucds(imatsize, ldiagindices, ddiagvals, 
+        LARGEDIAG);
+    FLPT * didentvector = dsetvector(imatsize, 1.0);
+    FLPT * dvectout = dsetvector(imatsize, 0.0);
+    if ((ourucds == NULL) || (didentvector == NULL) || (dvectout == NULL))
+    {
+        printf("The function is unable to allocate the stencil.\n"); 
+        return 0;
+    }
+    SetFIncrease(imatsize, didentvector);
+    
+    fpmult fpmults[] = {&multiply_ucds, &multiply_ucdsalt, &multiply_ucdsrow, 
+        best_multiply_ucds(), fixed_multiply_ucds(LARGEDIAG), 
+        &multiply_ucdstiled};
+    const INTG inomults = sizeof(fpmults) / sizeof(fpmult);
+    TLEN testlen;
+    
+    for (i = 0; i < inomults; i++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start); 
+        for (j = 0; j < inoreps; j++)
+        {
+            (* fpmults[i])(ourucds, didentvector, dvectout);
+        } 
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        testlen = timespecDiff(&end, &start);
+        printf("%f - ", (FLPT)((1.0 * TLPERS * imatsize * inoreps * 
+            LARGEDIAG)/(MEGAHERTZ * testlen)));
+    }
+    printf("%d\n", imatsize);
+    
+    free(didentvector);
+    free(dvectout);    
+    destroy_ucds(ourucds);
+    return 1;
+}
+
+/*
+// The runmulti function is the third mode of this program. For 1, 2, 4,
+// 8 and 16 vectors, it times multiplying a 27 diagonal matrix by each
+// vector in turn with multiply_ucdsrow, and by all of them at once with
+// multiply_ucds_multi, inoreps times. It prints the MFLOP/s of each pair
+// (counting every vector), then the size.
+*/
+
+INTG runmulti(const INTG imatsize, const INTG inoreps)
+{
+    INTG i, j, k;
+    struct timespec start, end;
+    const INTG inomax = 16; /* The most vectors tried. */
+    mmtestbed ourtestbed;
+    mmsetup(LARGEDIAG, imatsize, &ourtestbed);
+    FLPT * dvectors = drandomvector(imatsize * inomax);
+    FLPT * drets = dsetvector(imatsize * inomax, 0.0);
+    if ((ourtestbed.ourucds == NULL) || (dvectors == NULL) || (drets == NULL))
+    {
+        printf("The function is unable to allocate the vectors.\n"); 
+        return 0;
+    }
+    TLEN testlen;
+    
+    for (k = 1; k <= inomax; k *= 2)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start); 
+        for (j = 0; j < inoreps; j++)
+        {
+            for (i = 0; i < k; i++)
+            {
+                multiply_ucdsrow(ourtestbed.ourucds, &(dvectors[i*imatsize]),
+                    &(drets[i*imatsize]));
+            }
+        } 
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        testlen = timespecDiff(&end, &start);
+        printf("%f - ", (FLPT)((1.0 * TLPERS * imatsize * inoreps * k *
+            LARGEDIAG)/(MEGAHERTZ * testlen)));
+        clock_gettime(CLOCK_MONOTONIC, &start); 
+        for (j = 0; j < inoreps; j++)
+        {
+            multiply_ucds_multi(ourtestbed.ourucds, k, dvectors, drets);
+        } 
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        testlen = timespecDiff(&end, &start);
+        printf("%f - ", (FLPT)((1.0 * TLPERS * imatsize * inoreps * k *
+            LARGEDIAG)/(MEGAHERTZ * testlen)));
+    }
+    printf("%d\n", imatsize);
+    
+    free(dvectors);
+    free(drets);    
+    mmdestroy(&ourtestbed);
+    return 1;
+}
+
+/*
+// The runnarrow function is the fourth mode of this program. It times
+// multiplying a 27 diagonal matrix by a vector inoreps times, with the
+// matrix held as FLPT (multiply_ucdsrow), as float (multiply_ucdssingle)
+// and as bfloat16 (multiply_ucdsbf16). It prints the MFLOP/s of each, 
+// then the size.
+*/
+
+INTG runnarrow(const INTG imatsize, const INTG inoreps)
+{
+    INTG i, j;
+    struct timespec start, end;
+    mmtestbed ourtestbed;
+    mmsetup(LARGEDIAG, imatsize, &ourtestbed);
+    ucds * ourucdss[3]; /* The same matrix in each storage. */
+    ourucdss[0] = ourtestbed.ourucds;
+    ourucdss[1] = narrow_ucds(ourtestbed.ourucds, UCDSSINGLE);
+    ourucdss[2] = narrow_ucds(ourtestbed.ourucds, UCDSBF16);
+    fpmult fpmults[3] = {&multiply_ucdsrow, &multiply_ucdssingle, 
+        &multiply_ucdsbf16};
+    FLPT * dvector = drandomvector(imatsize);
+    if ((ourucdss[0] == NULL) || (ourucdss[1] == NULL) || 
+        (ourucdss[2] == NULL) || (dvector == NULL))
+    {
+        printf("The function is unable to allocate the matrices.\n"); 
+        return 0;
+    }
+    TLEN testlen;
+    
+    for (i = 0; i < 3; i++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start); 
+        for (j = 0; j < inoreps; j++)
+        {
+            (* fpmults[i])(ourucdss[i], dvector, ourtestbed.dret);
+        } 
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        testlen = timespecDiff(&end, &start);
+        printf("%f - ", (FLPT)((1.0 * TLPERS * imatsize * inoreps * 
+            LARGEDIAG)/(MEGAHERTZ * testlen)));
+    }
+    printf("%d\n", imatsize);
+    
+    free(dvector);
+    destroy_ucds(ourucdss[1]);
+    destroy_ucds(ourucdss[2]);
+    mmdestroy(&ourtestbed);
+    return 1;
+}
+
 int main(int argc, char *argv[])
 {
     
@@ -27,7 +201,11 @@ int main(int argc, char *argv[])
         printf("To execute this, type:\n\n[exec] n m\n\nWhere:\nn (>= ");
         printf("%d) ", iminmatsize);
         printf("is the size of the matrices to be multiplied and tested;");
-        printf("\nm (>= 1) is the number of repetitions.\n\n");
+        printf("\nm (>= 1) is the number of repetitions.\n");
+        printf("An optional third argument of 1 times a 27 point 3D ");
+        printf("stencil instead;\n2 times multiplying by several vectors ");
+        printf("at once;\n3 times a matrix held as FLPT, float and ");
+        printf("bfloat16.\n\n");
         return(0);
     }
     const INTG imatsize = atoi(argv[1]);
@@ -43,6 +221,21 @@ int main(int argc, char *argv[])
         printf("Please pass a number of repetitions greater or equal to 1.\n");
         return(0);
     }    
+    if ((argc > 3) && (atoi(argv[3]) == 1))
+    {
+        runstencil(imatsize, inoreps);
+        return(0);
+    }
+    if ((argc > 3) && (atoi(argv[3]) == 2))
+    {
+        runmulti(imatsize, inoreps);
+        return(0);
+    }
+    if ((argc > 3) && (atoi(argv[3]) == 3))
+    {
+        runnarrow(imatsize, inoreps);
+        return(0);
+    }
 
 /* 
 // Some useful variables:
@@ -65,15 +258,16 @@ int main(int argc, char *argv[])
 /* Now this is an attempt to set up a test environment. */
 
 //    FLPT *dzerovector = dsetvector(imatsize, 0.0); 
-    const INTG inotests = 20;
+    const INTG inotests = 36;
 //    INTG icount;
     
 /* The test bed itself. */    
     
     mmtestbed ourtestbed[inotests];
 //    INTG iminisize = (imatsize * 2) - 1; /* Number of diagonals. */
-    INTG immindices[20] = {5, 5, 5, 5, 5, 5, 9, 9, 15, 15, 27, 27, 27, 27, 27, 27, 
-        45, 45, 81, 81};    
+    INTG immindices[36] = {5, 5, 5, 5, 5, 5, 9, 9, 15, 15, 27, 27, 27, 27, 27, 27, 
+        45, 45, 81, 81, 5, 27, 45, 81, 5, 27, 45, 81, 5, 27, 45, 81, 
+        5, 27, 45, 81};    
     
     for (i = 0; i < inotests; i++)
     {
@@ -113,6 +307,26 @@ int main(int argc, char *argv[])
             {
                 ourtestbed[i].thefp = &multiply_ucdsd5;
             }            
+            else if (i >= 32)
+            {
+                ourtestbed[i].thefp = fixed_multiply_ucds(immindices[i]);
+            }
+            else if (i >= 28)
+            {
+                destroy_ucds(ourtestbed[i].ourucds); /* Swap in a stencil. */
+                ourtestbed[i].ourucds = mmatrix_ucdsconst(imatsize, 
+                    ourtestbed[i].ldiagindices, ourtestbed[i].ddiagelems,
+                    immindices[i]);
+                ourtestbed[i].thefp = &multiply_ucdsconst;
+            }
+            else if (i >= 24)
+            {
+                ourtestbed[i].thefp = best_multiply_ucds();
+            }
+            else if (i >= 20)
+            {
+                ourtestbed[i].thefp = &multiply_ucdsrow;
+            }
             else if ((i % 2) == 1)
             { 
                 ourtestbed[i].thefp = &multiply_ucdsalt;
@@ -154,6 +368,10 @@ int main(int argc, char *argv[])
     FLPT taltnorm1;
     FLPT taltnorm2;
     FLPT taltnorminf;
+    FLPT treducenorm1;
+    FLPT treducenorm2;
+    FLPT treducenorminf;
+    FLPT tscalednorm;
 
 /* These are dummy variables for taking the outputs of functions. */
 
@@ -266,10 +484,48 @@ int main(int argc, char *argv[])
     taltnorminf = (1.0 * TLPERS * inoreps * imatsize) /
         (MEGAHERTZ * timespecDiff(&end, &start));
 
+    clock_gettime(CLOCK_MONOTONIC, &start); 
+    for (j = 0; j < inoreps; j++)
+    {
+        ddummy = dreducenorm(imatsize, 1, didentvector);
+    } 
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    treducenorm1 = (1.0 * TLPERS * inoreps * imatsize) /
+        (MEGAHERTZ * timespecDiff(&end, &start));     
+    
+    clock_gettime(CLOCK_MONOTONIC, &start); 
+    for (j = 0; j < inoreps; j++)
+    {
+        ddummy = dreducenorm(imatsize, 2, didentvector);
+    } 
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    treducenorm2 = (1.0 * TLPERS * inoreps * imatsize) /
+        (MEGAHERTZ * timespecDiff(&end, &start));  
+
+    clock_gettime(CLOCK_MONOTONIC, &start); 
+    for (j = 0; j < inoreps; j++)
+    {
+        ddummy = dreducenorm(imatsize, 3, didentvector);
+    } 
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    treducenorminf = (1.0 * TLPERS * inoreps * imatsize) /
+        (MEGAHERTZ * timespecDiff(&end, &start));
+
+    clock_gettime(CLOCK_MONOTONIC, &start); 
+    for (j = 0; j < inoreps; j++)
+    {
+        ddummy = dscalednorm(imatsize, didentvector);
+    } 
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    tscalednorm = (1.0 * TLPERS * inoreps * imatsize) /
+        (MEGAHERTZ * timespecDiff(&end, &start));
+
 /* Then we print the tests. */    
 
-    printf("%f, %f, %f, %f, %f, %f, %f, %f, %f, %f, %f; ", tsaxpy, tdotprod, tscalprod, tvectadd,
+    printf("%f, %f, %f, %f, %f, %f, %f, %f, %f, %f, %f, ", tsaxpy, tdotprod, tscalprod, tvectadd,
         tvectsub, tnorm1, tnorm2, tnorminf, taltnorm1, taltnorm2, taltnorminf);
+    printf("%f, %f, %f, %f; ", treducenorm1, treducenorm2, treducenorminf,
+        tscalednorm);
     
     
     for (i = 0; i < inotests; i++)
@@ -6,6 +6,7 @@
 // Written by Peter Murphy. (c) 2013
 */
 
+#include <float.h>
 #include "projcommon.h"
 #include "ucds.h"
 
@@ -53,7 +54,8 @@ INTG bisallvalues(const INTG ivectsize, const FLPT dvalue,
 
 /*
 // This tests the multiplication functions to see if they are equal to 
-// each other.
+// each other. Every function in fpaltmults is checked against
+// multiply_ucds.
 */
 
 INTG btestmult(const INTG ivectsize, const ucds * ucdsa, const INTG inoreps)
@@ -68,24 +70,37 @@ INTG btestmult(const INTG ivectsize, const ucds * ucdsa, const INTG inoreps)
     INTG i, j; /* Iteration variables. */
     INTG ifailurecount = 0; /* This stores how many failures. */
     FLPT dnorm; /* To store the norm. */
+    fpmult fpaltmults[] = {&multiply_ucdsalt, &multiply_ucdsrow, 
+        &multiply_ucdssse, &multiply_ucdsavx2, &multiply_ucdsavx512, 
+        &multiply_ucdstiled,
+        fixed_multiply_ucds(ucdsa->lnumdiag), select_multiply_ucds(ucdsa)};
+    const INTG inoaltmults = sizeof(fpaltmults) / sizeof(fpmult);
+    INTG k; /* Over the alternative functions. */
     
     for (i = 0; i < inoreps; i++) /* Over norm modes. */
     {
         doverwriterandom(ivectsize, dvectorb);
         multiply_ucds(ucdsa, dvectorb, dmultresult);
-        multiply_ucdsalt(ucdsa, dvectorb, daltmultresult);
-        dvectsub (ivectsize, dmultresult, daltmultresult, ddifference);
-        for (j = 0; j < 3; j++)
+        for (k = 0; k < inoaltmults; k++)
         {
-            dnorm = dvectnorm(ivectsize, j, ddifference);
-            if (dnorm > 0.1)
+            if ((fpaltmults[k] == NULL) || 
+                (fpaltmults[k](ucdsa, dvectorb, daltmultresult) == NULL))
             {
-                ifailurecount++;
+                continue; /* Not supported on this CPU, or no such kernel. */
             }
-            dnorm = daltnorm(ivectsize, j, ddifference);
-            if (dnorm > 0.1)
+            dvectsub (ivectsize, dmultresult, daltmultresult, ddifference);
+            for (j = 0; j < 3; j++)
             {
-                ifailurecount++;
+                dnorm = dvectnorm(ivectsize, j, ddifference);
+                if (dnorm > 0.1)
+                {
+                    ifailurecount++;
+                }
+                dnorm = daltnorm(ivectsize, j, ddifference);
+                if (dnorm > 0.1)
+                {
+                    ifailurecount++;
+                }
             }
         }
     }
@@ -96,6 +111,218 @@ INTG btestmult(const INTG ivectsize, const ucds * ucdsa, const INTG inoreps)
     return ifailurecount;
 }
 
+/*
+// This tests that a matrix kept with UCDSCONST storage multiplies the same
+// way as the full ucds in the test bed mmref, and that multiplication
+// functions refuse storage they do not handle.
+*/
+
+INTG btestconst(const INTG ivectsize, const mmtestbed * mmref)
+{
+    FLPT * dmultresult = dassign(ivectsize); /* Full storage result. */
+    FLPT * dconstresult = dassign(ivectsize); /* Constant storage result. */
+    FLPT * ddifference = dassign(ivectsize); /* The difference between them. */
+    FLPT * dvectorb = dassign(ivectsize);
+    INTG ifailurecount = 0; /* This stores how many failures. */
+    ucds * ucdsconst = mmatrix_ucdsconst(ivectsize, mmref->ldiagindices,
+        mmref->ddiagelems, mmref->lnumdiag);
+    
+    doverwriterandom(ivectsize, dvectorb);
+    multiply_ucds(mmref->ourucds, dvectorb, dmultresult);
+    multiply_ucdsconst(ucdsconst, dvectorb, dconstresult);
+    dvectsub (ivectsize, dmultresult, dconstresult, ddifference);
+    if (dvectnorm(ivectsize, 3, ddifference) > 0.1)
+    {
+        ifailurecount++;
+    }
+    if ((multiply_ucds(ucdsconst, dvectorb, dconstresult) != NULL) ||
+        (multiply_ucdsconst(mmref->ourucds, dvectorb, dconstresult) != NULL))
+    {
+        ifailurecount++;
+    }
+    destroy_ucds(ucdsconst);
+    free(dvectorb);
+    free(dconstresult);
+    free(dmultresult);
+    free(ddifference);
+    return ifailurecount;
+}
+
+/*
+// This tests narrow storage (UCDSSINGLE and UCDSBF16) against full 
+// storage. The test bed matrix is scaled row by row by values that 
+// neither format holds exactly, so the rounding of the elements shows.
+// Row j of the error is compared with row j of |A||x|, which bounds it
+// by the unit roundoff of the format plus the rounding of the sums. The
+// worst such ratio for each format is kept in dworst[0] (float) and 
+// dworst[1] (bfloat16), for the report at the end.
+*/
+
+INTG btestnarrow(const INTG ivectsize, const mmtestbed * mmref, 
+    FLPT * dworst)
+{
+    const FLPT deps = (sizeof(FLPT) == sizeof(float)) ? FLT_EPSILON : 
+        DBL_EPSILON; /* The unit roundoff of FLPT, doubled. */
+    const FLPT dunits[2] = {FLT_EPSILON / 2.0, 1.0 / 256.0}; /* Of each. */
+    const INTG istorages[2] = {UCDSSINGLE, UCDSBF16};
+    fpmult fpmults[2] = {&multiply_ucdssingle, &multiply_ucdsbf16};
+    ucds * ucdsa = create_ucds(ivectsize, mmref->ldiagindices, 
+        mmref->lnumdiag);
+    ucds * ucdsabs = create_ucds(ivectsize, mmref->ldiagindices, 
+        mmref->lnumdiag);
+    FLPT * dvector = drandomvector(ivectsize);
+    FLPT * dfullresult = dassign(ivectsize);
+    FLPT * dabsresult = dassign(ivectsize);
+    FLPT * dnarrowresult = dassign(ivectsize);
+    INTG ifailurecount = 0; /* This stores how many failures. */
+    INTG i, j; /* Iteration variables. */
+    FLPT dratio; /* The error of a row over its bound. */
+    
+    for (i = 0; i < mmref->lnumdiag; i++)
+    {
+        for (j = 0; j < ivectsize; j++)
+        {
+            ucdsa->ddiagelems[i*ivectsize + j] = mmref->ddiagelems[i] * 
+                (1.0 + 1.0 / (3.0 + (j % 7)));
+            ucdsabs->ddiagelems[i*ivectsize + j] = 
+                fabs(ucdsa->ddiagelems[i*ivectsize + j]);
+        }
+    }
+    multiply_ucds(ucdsa, dvector, dfullresult);
+    multiply_ucds(ucdsabs, dvector, dabsresult);
+    for (i = 0; i < 2; i++)
+    {
+        ucds * ucdsnarrow = narrow_ucds(ucdsa, istorages[i]);
+        if ((ucdsnarrow == NULL) || 
+            (fpmults[i](ucdsnarrow, dvector, dnarrowresult) == NULL) ||
+            (multiply_ucds(ucdsnarrow, dvector, dnarrowresult) != NULL))
+        {
+            ifailurecount++;
+            destroy_ucds(ucdsnarrow);
+            continue;
+        }
+        for (j = 0; j < ivectsize; j++)
+        {
+            if (dabsresult[j] > 0.0)
+            {
+                dratio = fabs(dnarrowresult[j] - dfullresult[j]) / 
+                    dabsresult[j];
+                dworst[i] = max(dworst[i], dratio);
+                if (dratio > dunits[i] + (2 * mmref->lnumdiag * deps))
+                {
+                    ifailurecount++;
+                }
+            }
+        }
+        destroy_ucds(ucdsnarrow);
+    }
+    destroy_ucds(ucdsa);
+    destroy_ucds(ucdsabs);
+    free(dvector);
+    free(dfullresult);
+    free(dabsresult);
+    free(dnarrowresult);
+    return ifailurecount;
+}
+
+/*
+// This tests the fused multiplication and dot product functions against
+// multiply_ucds followed by ddotprod. The sums are added in a different
+// order, so the dot products only have to agree to a relative 1e-4.
+*/
+
+INTG btestmultdot(const INTG ivectsize, const ucds * ucdsa)
+{
+    FLPT * dvector = drandomvector(ivectsize);
+    FLPT * dmultresult = dassign(ivectsize); /* Separate result. */
+    FLPT * dfusedresult = dassign(ivectsize); /* Fused result. */
+    FLPT * ddifference = dassign(ivectsize);
+    fpmult fpmults[2] = {&multiply_ucdsrow, &multiply_ucdstiled};
+    fpmultdot fpfused;
+    INTG ifailurecount = 0; /* This stores how many failures. */
+    INTG i; /* Iteration variable. */
+    FLPT ddot, dfuseddot; /* The dot products. */
+    
+    multiply_ucds(ucdsa, dvector, dmultresult);
+    ddot = ddotprod(ivectsize, dvector, dmultresult);
+    for (i = 0; i < 2; i++)
+    {
+        fpfused = fused_multiply_ucds(fpmults[i]);
+        if ((fpfused == NULL) || 
+            (fpfused(ucdsa, dvector, dfusedresult, &dfuseddot) == NULL))
+        {
+            ifailurecount++;
+            continue;
+        }
+        dvectsub (ivectsize, dmultresult, dfusedresult, ddifference);
+        if ((dvectnorm(ivectsize, 3, ddifference) > 0.1) || 
+            (fabs(dfuseddot - ddot) > 1e-4 * fabs(ddot)))
+        {
+            ifailurecount++;
+        }
+    }
+    if (fused_multiply_ucds(&multiply_ucds) != NULL)
+    {
+        ifailurecount++;
+    }
+    free(dvector);
+    free(dmultresult);
+    free(dfusedresult);
+    free(ddifference);
+    return ifailurecount;
+}
+
+/*
+// This tests multiply_ucds_multi on 1 to inomaxvects random vectors
+// against multiplying each vector by itself with multiply_ucds.
+*/
+
+INTG btestmulti(const INTG ivectsize, const ucds * ucdsa, 
+    const INTG inomaxvects)
+{
+    FLPT * dvectors[UCDSMAXRHS]; /* The vectors to multiply. */
+    FLPT * dresults[UCDSMAXRHS]; /* Their products, one at a time. */
+    FLPT * dproducts[UCDSMAXRHS]; /* Their products, all at once. */
+    FLPT * dinterleaved = dassign(ivectsize * inomaxvects);
+    FLPT * dmultiresult = dassign(ivectsize * inomaxvects);
+    FLPT * ddifference = dassign(ivectsize);
+    INTG ifailurecount = 0; /* This stores how many failures. */
+    INTG i; /* Over the number of vectors. */
+    INTG j; /* Over the vectors. */
+    
+    for (j = 0; j < inomaxvects; j++)
+    {
+        dvectors[j] = drandomvector(ivectsize);
+        dresults[j] = dassign(ivectsize);
+        dproducts[j] = dassign(ivectsize);
+        multiply_ucds(ucdsa, dvectors[j], dresults[j]);
+    }
+    for (i = 1; i <= inomaxvects; i++)
+    {
+        dinterleave(ivectsize, i, dvectors, dinterleaved);
+        multiply_ucds_multi(ucdsa, i, dinterleaved, dmultiresult);
+        ddeinterleave(ivectsize, i, dmultiresult, dproducts);
+        for (j = 0; j < i; j++)
+        {
+            dvectsub (ivectsize, dresults[j], dproducts[j], ddifference);
+            if (dvectnorm(ivectsize, 3, ddifference) > 0.1)
+            {
+                ifailurecount++;
+            }
+        }
+    }
+    for (j = 0; j < inomaxvects; j++)
+    {
+        free(dvectors[j]);
+        free(dresults[j]);
+        free(dproducts[j]);
+    }
+    free(dinterleaved);
+    free(dmultiresult);
+    free(ddifference);
+    return ifailurecount;
+}
+
 /* 
 // This tests the conjugate gradient vector function by passing in an ucds, A,
 // and a vector b, and seeing that the conjugate gradient function returns x,
@@ -171,6 +398,55 @@ INTG btestconggrad(const INTG ivectsize, const ucds * ucdsa,
     return itotalfailures;
 }
 
+/*
+// This solves ucdsa x = 1 with dconjgradsstep, isteps at a time, and 
+// checks the true residual r = b - Ax: if the solve stopped before its 
+// limit of n + 1 iterations, r.r must pass the test it stopped on. Its
+// x is built up from the basis coordinates, so a step that is left out
+// shows here, even when x is within a percent or so of the solution.
+// It returns the number of failures (0 or 1).
+*/
+
+INTG btestsstep(const INTG ivectsize, const ucds * ucdsa, 
+    const INTG isteps, const FLPT derror)
+{
+    cgworkspace * ourws = create_cgworkspacebasis(ivectsize, 
+        (2 * isteps) + 1);
+    FLPT * dvectorb = dsetvector(ivectsize, 1.0);
+    FLPT * dvect0 = dsetvector(ivectsize, 0.0);
+    FLPT * dsresult = dassign(ivectsize); /* The result of the solve. */
+    FLPT * dmultresult = dassign(ivectsize); /* Multiply above with ucdsa. */
+    INTG icount = 0; /* How many iterations. */
+    INTG ifailurecount = 0;
+    FLPT drtr; /* The true r.r. */
+    
+    if (dconjgradsstep(ourws, ucdsa, dvectorb, dvect0, dsresult, isteps, 
+        derror, &icount) == NULL)
+    {
+        printf("CG (%d steps at once): the solve fails!\n", isteps);
+        ifailurecount++;
+    }
+    else
+    {
+        multiply_ucdsrow(ucdsa, dsresult, dmultresult);
+        dvectsub (ivectsize, dvectorb, dmultresult, dmultresult);
+        drtr = dselfdprod(ivectsize, dmultresult);
+        if ((icount <= ivectsize) && ((drtr > derror) || 
+            (drtr > pow(derror, 4) * ivectsize)))
+        {
+            printf("CG (%d steps at once): r.r is %e after %d iterations!\n",
+                isteps, drtr, icount);
+            ifailurecount++;
+        }
+    }
+    destroy_cgworkspace(ourws);
+    free(dvectorb);
+    free(dvect0);
+    free(dsresult);
+    free(dmultresult);
+    return ifailurecount;
+}
+
 
 int main(int argc, char *argv[])
 {
@@ -227,6 +503,69 @@ int main(int argc, char *argv[])
     dscalarprod (imatsize, 2.0, didentvector, dvectout);
     dvectadd(imatsize, didentvector, didentvector, dvectout);
     dvectsub(imatsize, didentvector, didentvector, dvectout);
+    
+/* Vectors, small or large, should be aligned. */    
+    
+    FLPT * dsmallvector = dassign(3);
+    FLPT * dlargevector = dassign(HUGEPAGESIZE / sizeof(FLPT) + 1);
+    if ((dsmallvector == NULL) || (dlargevector == NULL) ||
+        (((uintptr_t) dsmallvector) % ASSIGNALIGN != 0) ||
+        (((uintptr_t) dlargevector) % ASSIGNALIGN != 0))
+    {
+        printf("Vector assignment's broken!\n");
+    }
+    vunassign(dsmallvector);
+    vunassign(dlargevector);
+    
+/* Streamed fills and copies (forced on), from an unaligned start. */    
+    
+    setstreamthreshold(1);
+    FLPT * dstreamvector = dsetvector(imatsize, 3.0);
+    doverwritevector(imatsize - 1, 2.0, &(dstreamvector[1]));
+    FLPT * dstreamcopied = dsetvector(imatsize, 0.0);
+    dveccopy(imatsize - 1, &(dstreamcopied[1]), &(dstreamvector[1]));
+    setstreamthreshold(0);
+    if ((dstreamvector[0] != 3.0) || (dstreamcopied[0] != 0.0) ||
+        !bisallvalues(imatsize - 1, 2.0, &(dstreamcopied[1])))
+    {
+        printf("Streamed fills or copies are broken!\n");
+    }
+    free(dstreamvector);
+    free(dstreamcopied);
+    
+/* The squares of 1e30 overflow a float, but the scaled 2-norm should not. */    
+    
+    FLPT * dhugevector = dsetvector(imatsize, 1e30);
+    ddummy = dscalednorm(imatsize, dhugevector);
+    dexpect = expectedvaluenorm(imatsize, 2, 1e30);
+    if (!(fabs(ddummy - dexpect) <= 1e-4 * dexpect))
+    {
+        printf("Scaled Norm: ddummy: %e; expected: %e\n", ddummy, dexpect);
+    }
+    free(dhugevector);
+    
+/* Nor should it for subnormals, whose reciprocal overflows. */    
+    
+    const FLPT dtinyvalue = 0.125 * ((sizeof(FLPT) == sizeof(float)) ? 
+        FLT_MIN : DBL_MIN);
+    FLPT * dtinyvector = dsetvector(imatsize, dtinyvalue);
+    ddummy = dscalednorm(imatsize, dtinyvector);
+    dexpect = dtinyvalue * sqrt(imatsize * 1.0);
+    if (!(fabs(ddummy - dexpect) <= 1e-4 * dexpect))
+    {
+        printf("Scaled Norm: ddummy: %e; expected: %e\n", ddummy, dexpect);
+    }
+    free(dtinyvector);
+    FLPT * dcgx = dsetvector(imatsize, 1.0);
+    FLPT * dcgr = dsetvector(imatsize, 1.0);
+    ddummy = dcgupdate(imatsize, 0.5, didentvector, didentvector, dcgx, dcgr);
+    if ((ddummy != (imatsize * 0.25)) || !bisallvalues(imatsize, 1.5, dcgx) ||
+        !bisallvalues(imatsize, 0.5, dcgr))
+    {
+        printf("CG update's broken!\n");
+    }
+    free(dcgx);
+    free(dcgr);
     for (i = 0; i < 3; i++)
     {
         ddummy = dvectnorm(imatsize, i, didentvector);
@@ -241,7 +580,87 @@ int main(int argc, char *argv[])
         {
             printf("Alt Norm: %d, ddummy: %f; expected: %f\n", i, ddummy, dexpect);
         }
+        setpairwiseleaf(3); /* A deep tree, with uneven halves. */
+        ddummy = daltnorm(imatsize, i, didentvector);
+        setpairwiseleaf(UCDSPAIRLEAF);
+        if (fabs(ddummy - dexpect) > 0.01)
+        {
+            printf("Alt Norm (leaf 3): %d, ddummy: %f; expected: %f\n", i, 
+                ddummy, dexpect);
+        }
+        ddummy = dreducenorm(imatsize, i, didentvector);
+        dexpect = expectedvaluenorm(imatsize, i, 1.0);
+        if (fabs(ddummy - dexpect) > 0.01)
+        {
+            printf("Reduce Norm: %d, ddummy: %f; expected: %f\n", i, ddummy, dexpect);
+        }
+    }
+
+/* 
+// In deterministic mode, sums must be the same (bit for bit) whatever
+// the number of threads, and close to those of the usual mode.
+*/    
+
+    FLPT * drandvector = drandomvector(imatsize);
+    FLPT ddetsums[2][3];
+    const FLPT dusualsum = ddotprod(imatsize, drandvector, didentvector);
+    setdeterministic(1);
+    for (j = 0; j < 2; j++)
+    {
+#ifdef _OPENMP
+        INTG ithreads = omp_get_max_threads();
+        omp_set_num_threads((j == 0) ? 1 : max(3, ithreads));
+#endif
+        ddetsums[j][0] = ddotprod(imatsize, drandvector, didentvector);
+        ddetsums[j][1] = dreducenorm(imatsize, 2, drandvector);
+        ddetsums[j][2] = dvectnorm(imatsize, 1, drandvector);
+#ifdef _OPENMP
+        omp_set_num_threads(ithreads);
+#endif
     }
+    setdeterministic(0);
+    for (i = 0; i < 3; i++)
+    {
+        if (ddetsums[0][i] != ddetsums[1][i])
+        {
+            printf("Deterministic sum %d: %e differs from %e\n", i, 
+                ddetsums[0][i], ddetsums[1][i]);
+        }
+    }
+    if (fabs(ddetsums[0][0] - dusualsum) > 1e-4 * fabs(dusualsum))
+    {
+        printf("Deterministic dot product: %e; expected: %e\n", 
+            ddetsums[0][0], dusualsum);
+    }
+    free(drandvector);
+
+/* Random vectors from the same seed must match, for any number of threads. */    
+
+    FLPT * drandtwice[2];
+    for (j = 0; j < 2; j++)
+    {
+#ifdef _OPENMP
+        INTG ithreads = omp_get_max_threads();
+        omp_set_num_threads((j == 0) ? 1 : max(3, ithreads));
+#endif
+        setrandomseed(2014);
+        drandtwice[j] = drandomvector(imatsize);
+#ifdef _OPENMP
+        omp_set_num_threads(ithreads);
+#endif
+    }
+    for (i = 0; i < imatsize; i++)
+    {
+        if ((drandtwice[0][i] != drandtwice[1][i]) || 
+            (drandtwice[0][i] < 0.0) || (drandtwice[0][i] > 9.0))
+        {
+            printf("Random vectors differ at %d: %f and %f\n", i, 
+                drandtwice[0][i], drandtwice[1][i]);
+            break;
+        }
+    }
+    free(drandtwice[0]);
+    free(drandtwice[1]);
 
 
 /* Now this is an attempt to set up a test environment. */
@@ -254,6 +673,7 @@ int main(int argc, char *argv[])
     const FLPT dmaxerror = 0.001;
     const INTG inotests = 10;
     INTG icount;    
+    FLPT dnarrowworst[2] = {0.0, 0.0}; /* See btestnarrow. */
     
    
 /* 
@@ -312,6 +732,28 @@ int main(int argc, char *argv[])
                 {
                     printf("Multiplication errors: %d\n", inoerrors);
                 }
+                inoerrors = btestmulti(imatsize, ourtestbed[i].ourucds, 
+                    UCDSMAXRHS);
+                if (inoerrors != 0)
+                {
+                    printf("Multi-vector errors: %d\n", inoerrors);
+                }
+                inoerrors = btestmultdot(imatsize, ourtestbed[i].ourucds);
+                if (inoerrors != 0)
+                {
+                    printf("Fused multiplication errors: %d\n", inoerrors);
+                }
+                inoerrors = btestconst(imatsize, &(ourtestbed[i]));
+                if (inoerrors != 0)
+                {
+                    printf("Constant storage errors: %d\n", inoerrors);
+                }
+                inoerrors = btestnarrow(imatsize, &(ourtestbed[i]), 
+                    dnarrowworst);
+                if (inoerrors != 0)
+                {
+                    printf("Narrow storage errors: %d\n", inoerrors);
+                }
                 
                 
                 
@@ -338,7 +780,7 @@ int main(int argc, char *argv[])
  
     if (imatsize >= 7)
     {
-        srand (time(NULL));
+        setrandomseed(time(NULL));
         INTG tldiagindices[5] = {-3, -1, 0, 1, 3};
         FLPT tddiagvals[5] = {-1.0, -1.0, 4.0, -1.0, -1.0};
        
@@ -372,6 +814,406 @@ int main(int argc, char *argv[])
                  -2, dnorm, dmaxerror, icount);                    
         }
         
+/* 
+// A workspace used for two solves should give what dconjgrad gives (the
+// sums are made deterministic so that the results can be compared).
+*/        
+        
+        cgworkspace * ourws = create_cgworkspacebasis(imatsize, 
+            (2 * 4) + 1);
+        setdeterministic(1);
+        INTG iwsiter = 0;
+        dconjgrad(ucdsa, didentvector, dzerovector, dresultvector,
+            &multiply_ucdsrow, dvectnorm, 2, dmaxerror, &icount);
+        for (j = 0; j < 2; j++)
+        {
+            dconjgradws(ourws, ucdsa, didentvector, dzerovector, ddifvector,
+                &multiply_ucdsrow, dvectnorm, 2, dmaxerror, &iwsiter);
+        }
+        setdeterministic(0);
+        dvectsub (imatsize, dresultvector, ddifvector, dmultvector);
+        if ((ourws == NULL) || (ourws->inosolves != 2) || 
+            (iwsiter != icount) || (ourws->ilastiter != icount) ||
+            (dvectnorm(imatsize, 0, dmultvector) != 0.0))
+        {
+            printf("CG workspace: solves differ from dconjgrad!\n");
+        }
+        
+/* The single region solve should reach (about) the same solution. */        
+        
+        dconjgradpar(ourws, ucdsa, didentvector, dzerovector, ddifvector,
+            dmaxerror, &iwsiter);
+        dvectsub (imatsize, dresultvector, ddifvector, dmultvector);
+        dnorm = dvectnorm(imatsize, 0, dmultvector);
+        if ((ourws->inosolves != 3) || 
+            (dnorm > 0.01 * dvectnorm(imatsize, 0, dresultvector)))
+        {
+            printf("CG (one region): differs from dconjgrad by %e after %d iterations!\n",
+                dnorm, iwsiter);
+        }
+        
+/* 
+// A vector plan for r = b - Ax should give what a multiplication and a
+// subtraction give, and one for d = r + 0.5d (into d) what dtruesaxpy 
+// gives.
+*/        
+        
+        vplan ourplan;
+        FLPT * dplanx = drandomvector(imatsize);
+        FLPT * dplanr = dassign(imatsize);
+        FLPT * dplancheck = dassign(imatsize);
+        init_vplan(&ourplan, imatsize);
+        addterm_vplan(&ourplan, 1.0, didentvector);
+        addmult_vplan(&ourplan, -1.0, ucdsa, dplanx);
+        ddummy = evaldot_vplan(&ourplan, dplanr);
+        multiply_ucdsrow(ucdsa, dplanx, dplancheck);
+        dvectsub(imatsize, didentvector, dplancheck, dplancheck);
+        dvectsub(imatsize, dplanr, dplancheck, dmultvector);
+        dexpect = dselfdprod(imatsize, dplancheck);
+        if ((dvectnorm(imatsize, 0, dmultvector) > 1e-4) ||
+            (fabs(ddummy - dexpect) > 1e-4 * dexpect) ||
+            (eval_vplan(&ourplan, dplanx) != NULL))
+        {
+            printf("Vector plan r = b - Ax is broken!\n");
+        }
+        dveccopy(imatsize, dplancheck, dplanx);
+        init_vplan(&ourplan, imatsize);
+        addterm_vplan(&ourplan, 1.0, dplanr);
+        addterm_vplan(&ourplan, 0.5, dplanx);
+        eval_vplan(&ourplan, dplanx);
+        dtruesaxpy(imatsize, 1.0, dplanr, 0.5, dplancheck);
+        dvectsub(imatsize, dplanx, dplancheck, dmultvector);
+        if (dvectnorm(imatsize, 0, dmultvector) > 1e-4)
+        {
+            printf("Vector plan d = r + beta.d is broken!\n");
+        }
+        free(dplanx);
+        free(dplanr);
+        free(dplancheck);
+        
+/* 
+// The pipelined CG should reach as good a solution as dconjgrad. As 
+// ucdsa is not symmetric, T (like ucdsa, but with the elements outside
+// the matrix zeroed) is used.
+*/        
+        
+        ucds * ucdssym = create_ucds(imatsize, tldiagindices, 5);
+        for (i = 0; i < 5; i++)
+        {
+            for (j = 0; j < imatsize; j++) /* Column j, row j - k. */
+            {
+                ucdssym->ddiagelems[i * imatsize + j] = 
+                    ((j - tldiagindices[i] >= 0) && 
+                    (j - tldiagindices[i] < imatsize)) ? tddiagvals[i] : 0.0;
+            }
+        }
+        dconjgrad(ucdssym, didentvector, dzerovector, dresultvector,
+            &multiply_ucdsrow, dvectnorm, 2, dmaxerror, &icount);
+        dconjgradpipe(ourws, ucdssym, didentvector, dzerovector, ddifvector,
+            dmaxerror, &iwsiter);
+        dvectsub (imatsize, dresultvector, ddifvector, dmultvector);
+        dnorm = dvectnorm(imatsize, 0, dmultvector);
+        if ((ourws->inosolves != 4) || (iwsiter > icount + 1) ||
+            (dnorm > 0.01 * dvectnorm(imatsize, 0, dresultvector)))
+        {
+            printf("CG (pipelined): differs from dconjgrad by %e after %d iterations (CG: %d)!\n",
+                dnorm, iwsiter, icount);
+        }
+        
+/* 
+// And so should the s-step one, for a few values of s, in about as many
+// iterations (with floats, rounding in G can take up to twice as many).
+*/        
+        
+        for (i = 1; i <= 4; i += 3)
+        {
+            dconjgradsstep(ourws, ucdssym, didentvector, dzerovector, 
+                ddifvector, i, dmaxerror, &iwsiter);
+            dvectsub (imatsize, dresultvector, ddifvector, dmultvector);
+            dnorm = dvectnorm(imatsize, 0, dmultvector);
+            if ((iwsiter > ((sizeof(FLPT) == sizeof(float)) ? 2 : 1) * 
+                icount + i) ||
+                (dnorm > 0.01 * dvectnorm(imatsize, 0, dresultvector)))
+            {
+                printf("CG (%d steps at once): differs from dconjgrad by %e after %d iterations (CG: %d)!\n",
+                    i, dnorm, iwsiter, icount);
+            }
+        }
+        
+/* 
+// Its true residual should pass the stopping test. With T of 50 rows, 
+// the solve takes 17 iterations, which leaves one step over for s = 2 
+// and s = 4. With floats, derror is larger, as for PCG below, and it 
+// takes 13; and as even dconjgrad's true r.r misses the test for T of a
+// few hundred rows or more, T of imatsize rows is only checked with 
+// doubles.
+*/        
+        
+        const INTG bsstepsingle = (sizeof(FLPT) == sizeof(float));
+        const FLPT dssteperror = bsstepsingle ? 0.05 : dmaxerror;
+        ucds * ucdssmall = create_ucds(50, tldiagindices, 5);
+        for (i = 0; i < 5; i++)
+        {
+            for (j = 0; j < 50; j++) /* Column j, row j - k. */
+            {
+                ucdssmall->ddiagelems[i * 50 + j] = 
+                    ((j - tldiagindices[i] >= 0) && 
+                    (j - tldiagindices[i] < 50)) ? tddiagvals[i] : 0.0;
+            }
+        }
+        for (i = 2; i <= 4; i += 2)
+        {
+            if (!bsstepsingle)
+            {
+                btestsstep(imatsize, ucdssym, i, dssteperror);
+            }
+            btestsstep(50, ucdssmall, i, dssteperror);
+        }
+        destroy_ucds(ucdssmall);
+        
+/* With -T, which is negative definite, it should give up, not loop. */        
+        
+        ucds * ucdsneg = create_ucds(imatsize, tldiagindices, 5);
+        for (j = 0; j < 5 * imatsize; j++)
+        {
+            ucdsneg->ddiagelems[j] = -ucdssym->ddiagelems[j];
+        }
+        if (dconjgradsstep(ourws, ucdsneg, didentvector, dzerovector, 
+            ddifvector, 4, dmaxerror, &iwsiter) != NULL)
+        {
+            printf("CG (4 steps at once): a negative definite matrix is solved!\n");
+        }
+        destroy_ucds(ucdsneg);
+        
+/* 
+// Block CG on three systems should reach what dconjgrad does for each
+// (to 1%, or 10% for FLPT as float, where derror is larger, as for PCG
+// below), in not many more iterations than the slowest of them: half as
+// many again, or twice as many with floats. The right hand sides are centred on zero; ones that 
+// share a large part (as random vectors of 0 to 9 do) have residuals 
+// that line up, and then block CG can take more than twice as many. 
+// dconjgradblock, which solves them apart at this size, should take as 
+// many as the slowest.
+*/        
+        
+        FLPT * dblockb[3] = {drandomvector(imatsize), 
+            drandomvector(imatsize), drandomvector(imatsize)};
+        const INTG bblocksingle = (sizeof(FLPT) == sizeof(float));
+        const FLPT dblockerror = bblocksingle ? 0.05 : dmaxerror;
+        for (i = 0; i < 3; i++)
+        {
+            for (j = 0; j < imatsize; j++)
+            {
+                dblockb[i][j] -= 4.5;
+            }
+        }
+        FLPT * dblockx[3] = {dassign(imatsize), dassign(imatsize), 
+            dassign(imatsize)};
+        FLPT * dblockin = dassign(3 * imatsize);
+        FLPT * dblockout = dassign(3 * imatsize);
+        FLPT * dblockapart = dassign(3 * imatsize);
+        FLPT * dblockzero = dsetvector(3 * imatsize, 0.0);
+        INTG iblockiter = 0, iapartiter = 0, imaxiter = 0;
+        cgworkspace * ourblockws = create_cgworkspaceblock(imatsize, 3);
+        dinterleave(imatsize, 3, dblockb, dblockin);
+        if (dconjgradblockws(ourblockws, ucdssym, 3, dblockin, dblockzero, 
+            dblockout, dblockerror, &iblockiter) == NULL)
+        {
+            printf("Block CG: the solve fails!\n");
+        }
+        if (dconjgradblock(ucdssym, 3, dblockin, dblockzero, dblockapart, 
+            dblockerror, &iapartiter) == NULL)
+        {
+            printf("Block CG (apart): the solve fails!\n");
+        }
+        for (j = 0; j < 2; j++)
+        {
+            ddeinterleave(imatsize, 3, (j == 0) ? dblockout : dblockapart, 
+                dblockx);
+            for (i = 0; i < 3; i++)
+            {
+                dconjgrad(ucdssym, dblockb[i], dzerovector, dresultvector,
+                    &multiply_ucdsrow, dvectnorm, 2, dblockerror, &icount);
+                imaxiter = max(imaxiter, icount);
+                dvectsub (imatsize, dresultvector, dblockx[i], dmultvector);
+                dnorm = dvectnorm(imatsize, 0, dmultvector);
+                if (dnorm > (bblocksingle ? 0.1 : 0.01) * 
+                    dvectnorm(imatsize, 0, dresultvector))
+                {
+                    printf("Block CG%s: system %d differs from dconjgrad by %e!\n",
+                        (j == 0) ? "" : " (apart)", i, dnorm);
+                }
+            }
+        }
+        if (2 * iblockiter > (bblocksingle ? 4 : 3) * imaxiter)
+        {
+            printf("Block CG: %d iterations (CG: up to %d)!\n", iblockiter,
+                imaxiter);
+        }
+        if (iapartiter != imaxiter)
+        {
+            printf("Block CG (apart): %d iterations (CG: up to %d)!\n", 
+                iapartiter, imaxiter);
+        }
+
+/*
+// A block workspace should give the same X on each solve, and one made
+// without room for the Gram matrices should be refused.
+*/
+
+        FLPT * dblockagain = dassign(3 * imatsize);
+        if (dconjgradblockws(ourblockws, ucdssym, 3, dblockin, dblockzero, 
+            dblockagain, dblockerror, &iwsiter) == NULL)
+        {
+            printf("Block CG (workspace): the solve fails!\n");
+        }
+        dvectsub(3 * imatsize, dblockagain, dblockout, dblockagain);
+        if ((ourblockws == NULL) || (ourblockws->inosolves != 2) ||
+            (iwsiter != iblockiter) ||
+            (dvectnorm(3 * imatsize, 0, dblockagain) != 0.0))
+        {
+            printf("Block CG (workspace): the solves differ!\n");
+        }
+        if (dconjgradblockws(ourws, ucdssym, 3, dblockin, dblockzero,
+            dblockagain, dmaxerror, NULL) != NULL)
+        {
+            printf("Block CG (workspace): a workspace without Gram room is used!\n");
+        }
+        destroy_cgworkspace(ourblockws);
+        free(dblockagain);
+        for (i = 0; i < 3; i++)
+        {
+            free(dblockb[i]);
+            free(dblockx[i]);
+        }
+        free(dblockin);
+        free(dblockout);
+        free(dblockapart);
+        free(dblockzero);
+        
+/* The matrix powers kernel should give what repeated multiplication does. */        
+        
+        FLPT * dpowers = dassign(4 * imatsize);
+        if (matpowers_ucds(ucdssym, didentvector, 3, 0.5, dpowers) == NULL)
+        {
+            printf("Matrix powers: the kernel fails!\n");
+        }
+        dveccopy(imatsize, dmultvector, didentvector);
+        for (i = 1; i <= 3; i++)
+        {
+            multiply_ucdsrow(ucdssym, dmultvector, ddifvector);
+            dscalarprod(imatsize, 0.5, ddifvector, dmultvector);
+            dvectsub (imatsize, dmultvector, &(dpowers[i * imatsize]), 
+                ddifvector);
+            if (dvectnorm(imatsize, 0, ddifvector) > 
+                1e-5 * dvectnorm(imatsize, 0, dmultvector))
+            {
+                printf("Matrix powers: power %d is off by %e!\n", i, 
+                    dvectnorm(imatsize, 0, ddifvector));
+            }
+        }
+        free(dpowers);
+        destroy_ucds(ucdssym);
+        
+/* 
+// On a matrix DTD with T like ucdsa and D a badly scaled diagonal, the
+// Jacobi preconditioned CG should need no more iterations than CG, and
+// leave a true residual r.r no larger than CG's. (PCG stops on r.z, not
+// r.r, so its r.r need not pass the test dconjgrad makes.)
+*/        
+        
+        ucds * ucdsscaled = create_ucds(imatsize, tldiagindices, 5);
+        FLPT * dscales = dassign(imatsize);
+        for (j = 0; j < imatsize; j++)
+        {
+            dscales[j] = 1.0 + 99.0 * (j % 7) / 6.0;
+        }
+        for (i = 0; i < 5; i++)
+        {
+            for (j = 0; j < imatsize; j++) /* Column j, row j - k. */
+            {
+                INTG lrow = j - tldiagindices[i];
+                ucdsscaled->ddiagelems[i * imatsize + j] = 
+                    ((lrow >= 0) && (lrow < imatsize)) ?
+                    dscales[lrow] * tddiagvals[i] * dscales[j] : 0.0;
+            }
+        }
+        INTG ipcgiter = 0;
+        FLPT dpcgnorm;
+        dconjgrad(ucdsscaled, didentvector, dzerovector, dresultvector,
+            &multiply_ucdsrow, dvectnorm, 2, dmaxerror, &icount);
+        multiply_ucdsrow(ucdsscaled, dresultvector, dmultvector);
+        dvectsub (imatsize, didentvector, dmultvector, ddifvector);
+        dnorm = dvectnorm(imatsize, 2, ddifvector);
+        dpconjgrad(ucdsscaled, didentvector, dzerovector, dresultvector,
+            &multiply_ucdsrow, dvectnorm, 2, dmaxerror, &ipcgiter);
+        multiply_ucdsrow(ucdsscaled, dresultvector, dmultvector);
+        dvectsub (imatsize, didentvector, dmultvector, ddifvector);
+        dpcgnorm = pow(dvectnorm(imatsize, 2, ddifvector), 2);
+        if ((ipcgiter > icount) || (dpcgnorm > dnorm * dnorm))
+        {
+            printf("PCG: %d iterations (CG: %d), r.r %e (CG: %e)!\n", 
+                ipcgiter, icount, dpcgnorm, dnorm * dnorm);
+        }
+        
+/* 
+// SSOR and IC(0) preconditioned CG should need no more iterations than 
+// the Jacobi one, and reach as good a solution. With floats, the stopping
+// test of dconjgrad (r.z below derror^4 of its start) cannot be met for 
+// derror as small as dmaxerror, so a larger one is used.
+*/        
+        
+        const INTG bsingle = (sizeof(FLPT) == sizeof(float));
+        const FLPT dprecerror = bsingle ? 0.05 : dmaxerror;
+        dpconjgradws(ourws, ucdsscaled, didentvector, dzerovector, 
+            dresultvector, &multiply_ucdsrow, dvectnorm, 2, dprecerror, 
+            &ipcgiter);
+        multiply_ucdsrow(ucdsscaled, dresultvector, dmultvector);
+        dvectsub (imatsize, didentvector, dmultvector, ddifvector);
+        dpcgnorm = max(10.0 * dvectnorm(imatsize, 2, ddifvector), 
+            bsingle ? 0.1 * sqrt(imatsize) : dmaxerror);
+        for (i = UCDSPRECSSOR; i <= UCDSPRECIC0; i++)
+        {
+            ucdsprecond * ourprec = create_ucdsprecond(ucdsscaled, i, 1.0);
+            INTG ipreciter = 0;
+            if ((ourprec == NULL) || (dprecconjgradws(ourws, ourprec, 
+                ucdsscaled, didentvector, dzerovector, dresultvector, 
+                &multiply_ucdsrow, dvectnorm, 2, dprecerror, &ipreciter) 
+                == NULL))
+            {
+                printf("Preconditioner %d could not be made or used!\n", i);
+            }
+            else
+            {
+                multiply_ucdsrow(ucdsscaled, dresultvector, dmultvector);
+                dvectsub (imatsize, didentvector, dmultvector, ddifvector);
+                dnorm = dvectnorm(imatsize, 2, ddifvector);
+                if ((ipreciter > ipcgiter) || (dnorm > dpcgnorm))
+                {
+                    printf("Preconditioner %d: %d iterations (PCG: %d), norm %e (limit: %e)!\n", 
+                        i, ipreciter, ipcgiter, dnorm, dpcgnorm);
+                }
+            }
+            destroy_ucdsprecond(ourprec);
+        }
+        free(dscales);
+        destroy_ucds(ucdsscaled);
+        destroy_cgworkspace(ourws);
+        ourws = create_cgworkspace(imatsize - 1);
+        if (dconjgradws(ourws, ucdsa, didentvector, dzerovector, ddifvector,
+            &multiply_ucdsrow, dvectnorm, 2, dmaxerror, &iwsiter) != NULL)
+        {
+            printf("CG workspace: a workspace of the wrong size is used!\n");
+        }
+        destroy_cgworkspace(ourws);
+        ourws = create_cgworkspacebasis(imatsize, 2);
+        if (dconjgradsstep(ourws, ucdsa, didentvector, dzerovector, 
+            ddifvector, 1, dmaxerror, &iwsiter) != NULL)
+        {
+            printf("CG workspace: a basis that is too small is used!\n");
+        }
+        destroy_cgworkspace(ourws);
+        
         
         
       //  inoerrors = btestconggrad(imatsize, ucdsa, 0.001, inoreps);
@@ -399,6 +1241,8 @@ int main(int argc, char *argv[])
     free(dmultvector);
     free(ddifvector);
     free(dresultvector);
+    printf("Narrow storage accuracy (worst error over |A||x| in a row): ");
+    printf("float %e, bfloat16 %e\n", dnarrowworst[0], dnarrowworst[1]);
     printf("We made it with a matrix size of %d!\n", imatsize);
     return 0;
 }
@@ -3,10 +3,12 @@
 // Written by Peter Murphy. (c) 2013, 2014
 */
 
+#include <float.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <time.h>
 #include <omp.h>
 #include "projcommon.h"
@@ -14,6 +16,83 @@
 
 /* Function implementations. */
 
+/* Whether reductions are deterministic (see setdeterministic). */
+
+static INTG bdeterministic = 0;
+
+void setdeterministic(const INTG bdetermine)
+{
+    bdeterministic = (bdetermine != 0);
+}
+
+INTG getdeterministic(void)
+{
+    return bdeterministic;
+}
+
+/*
+// The dsumpartials function adds up the lnoblocks values of dpartials in
+// a fixed pairwise order (overwriting them), and returns the sum.
+*/
+
+static FLPT dsumpartials(const INTG lnoblocks, FLPT * dpartials)
+{
+    INTG i, lstep; /* Iteration variables. */
+    if (lnoblocks < 1)
+    {
+        return 0.0;
+    }
+    for (lstep = 1; lstep < lnoblocks; lstep *= 2)
+    {
+        for (i = 0; i + lstep < lnoblocks; i += 2 * lstep)
+        {
+            dpartials[i] += dpartials[i + lstep];
+        }
+    }
+    return dpartials[0];
+}
+
+/*
+// UCDSBLOCKSUM(DRESULT, LSIZE, TERM) sets DRESULT to the sum of TERM for
+// i from 0 to LSIZE - 1, in deterministic mode. The range is cut into
+// blocks of UCDSDETBLOCK, whatever the number of threads; each block is 
+// summed by one thread with a SIMD loop, and the block sums are added
+// with dsumpartials. If there is no memory for the block sums, the sum
+// is done serially instead.
+*/
+
+#define UCDSBLOCKSUM(DRESULT, LSIZE, TERM) \
+{ \
+    const INTG lnoblocks = ((LSIZE) + UCDSDETBLOCK - 1) / UCDSDETBLOCK; \
+    FLPT * dpartials = dassign(max(1, lnoblocks)); \
+    INTG i, k; /* Iteration variables. */ \
+    if (dpartials == NULL) \
+    { \
+        DRESULT = 0.0; \
+        for (i = 0; i < (LSIZE); i++) \
+        { \
+            DRESULT += (TERM); \
+        } \
+    } \
+    else \
+    { \
+        _Pragma("omp parallel for private(i) schedule(static)") \
+        for (k = 0; k < lnoblocks; k++) \
+        { \
+            const INTG lto = min((LSIZE), (k + 1) * UCDSDETBLOCK); \
+            FLPT dsum = 0.0; \
+            _Pragma("omp simd reduction(+:dsum)") \
+            for (i = k * UCDSDETBLOCK; i < lto; i++) \
+            { \
+                dsum += (TERM); \
+            } \
+            dpartials[k] = dsum; \
+        } \
+        DRESULT = dsumpartials(lnoblocks, dpartials); \
+        free(dpartials); \
+    } \
+}
+
 FLPT * dsetvector(const INTG isize, const FLPT dvalue)
 {
     FLPT * dret = dassign(isize); /* Return value. */
@@ -22,7 +101,11 @@ FLPT * dsetvector(const INTG isize, const FLPT dvalue)
     {
         return NULL;
     }
-    #pragma omp parallel for
+    if (bstreamvector(isize))
+    {
+        return dstreamfill(isize, dvalue, dret);
+    }
+    #pragma omp parallel for schedule(static)
     for (i = 0; i < isize; i++)
     {
         dret[i] = dvalue;
@@ -33,7 +116,11 @@ FLPT * dsetvector(const INTG isize, const FLPT dvalue)
 FLPT * doverwritevector(const INTG isize, const FLPT dvalue, FLPT* dret)
 {
     INTG i; /* Iteration variable. */
-    #pragma omp parallel for
+    if (bstreamvector(isize))
+    {
+        return dstreamfill(isize, dvalue, dret);
+    }
+    #pragma omp parallel for schedule(static)
     for (i = 0; i < isize; i++)
     {
         dret[i] = dvalue;
@@ -41,39 +128,69 @@ FLPT * doverwritevector(const INTG isize, const FLPT dvalue, FLPT* dret)
     return dret;
 }
 
+/* 
+// The random vectors come from a seed and a count of the vectors made so
+// far, so that each call gets a new stream (see setrandomseed).
+*/
+
+static uint64_t urandomseed = 0;
+static uint64_t urandomcalls = 0;
+
+void setrandomseed(const uint64_t useed)
+{
+    urandomseed = useed;
+    urandomcalls = 0;
+}
+
+/* 
+// The usplitmix function is the output function of the SplitMix64 
+// generator: it scrambles a 64-bit counter into a random 64-bit value.
+*/
+
+static inline uint64_t usplitmix(uint64_t ucounter)
+{
+    ucounter += 0x9E3779B97F4A7C15ULL;
+    ucounter = (ucounter ^ (ucounter >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    ucounter = (ucounter ^ (ucounter >> 27)) * 0x94D049BB133111EBULL;
+    return ucounter ^ (ucounter >> 31);
+}
+
 FLPT * doverwriterandom(const INTG isize, FLPT* dret)
 {
     INTG i; /* Iteration variable. */
-    #pragma omp parallel for
+    const uint64_t ukey = usplitmix(urandomseed ^ 
+        usplitmix(urandomcalls++)); /* Picks the stream. */
+        
+/* The top 32 bits times 10, over 2^32, give 0 to 9 without a division. */        
+        
+    #pragma omp parallel for simd schedule(static)
     for (i = 0; i < isize; i++)
     {
-        dret[i] = rand()%10;
+        dret[i] = (FLPT) (((usplitmix(ukey + (uint64_t) i) >> 32) * 10) 
+            >> 32);
     }
     return dret;
 }
 
-
 FLPT * drandomvector(const INTG isize)
 {
     FLPT * dret = dassign(isize); /* Return value. */
-    INTG i; /* Iteration variable. */
     if (dret == NULL)
     {
         return NULL;
     }
-    #pragma omp parallel for
-    for (i = 0; i < isize; i++)
-    {
-        dret[i] = rand()%10;
-    }
-    return dret;
+    return doverwriterandom(isize, dret);
 }
 
 FLPT * dveccopy (const INTG lvectsize, FLPT * doverwrite, 
     const FLPT *dsource)
 {
     INTG i; /* An iteration variable. */
-    #pragma omp parallel for
+    if (bstreamvector(lvectsize))
+    {
+        return dstreamcopy(lvectsize, doverwrite, dsource);
+    }
+    #pragma omp parallel for schedule(static)
     for (i = 0; i < lvectsize; i++)
     {
         doverwrite[i] = dsource[i];
@@ -86,7 +203,12 @@ FLPT ddotprod (const INTG lvectsize, const FLPT * dleftvec,
 {
     INTG i; /* An iteration variable. */
     FLPT dresult = 0.0; /* The result. */
-    #pragma omp parallel for reduction(+:dresult)
+    if (bdeterministic)
+    {
+        UCDSBLOCKSUM(dresult, lvectsize, dleftvec[i] * drightvec[i]);
+        return dresult;
+    }
+    #pragma omp parallel for reduction(+:dresult) schedule(static)
     for (i = 0; i < lvectsize; i++)
     {
         dresult += (dleftvec[i] * drightvec[i]);
@@ -103,7 +225,7 @@ FLPT * dscalarprod (const INTG lvectsize, const FLPT dscalar,
     const FLPT * dvectin, FLPT * dvectout)
 {
     INTG i; /* An iteration variable. */
-    #pragma omp parallel for
+    #pragma omp parallel for schedule(static)
     for (i = 0; i < lvectsize; i++)
     {
         dvectout[i] = dscalar * dvectin[i];
@@ -116,7 +238,7 @@ FLPT * dsaxpy (const INTG lvectsize, const FLPT dinputa,
     const FLPT * dvectx, const FLPT * dvecty, FLPT * dvectout)
 {
     INTG i; /* An iteration variable. */
-    #pragma omp parallel for
+    #pragma omp parallel for schedule(static)
     for (i = 0; i < lvectsize; i++)
     {
         dvectout[i] = dvectx[i] + (dinputa * dvecty[i]);
@@ -134,7 +256,7 @@ FLPT * dtruesaxpy (const INTG lvectsize, const FLPT dinputa,
     const FLPT * dvectx, const FLPT dinputb, FLPT * dvecty)
 {
     INTG i; /* An iteration variable. */
-    #pragma omp parallel for
+    #pragma omp parallel for schedule(static)
     for (i = 0; i < lvectsize; i++)
     {
         dvecty[i] = (dinputa * dvectx[i]) + (dinputb * dvecty[i]);
@@ -151,7 +273,7 @@ FLPT * dvectadd (const INTG lvectsize, const FLPT * dleftvec,
     const FLPT * drightvec, FLPT * dvectout)
 {
     INTG i; /* An iteration variable. */
-    #pragma omp parallel for
+    #pragma omp parallel for schedule(static)
     for (i = 0; i < lvectsize; i++)
     {
         dvectout[i] = dleftvec[i] + drightvec[i];
@@ -163,7 +285,7 @@ FLPT * dvectsub (const INTG lvectsize, const FLPT * dleftvec,
     const FLPT * drightvec, FLPT * dvectout)
 {
     INTG i; /* An iteration variable. */
-    #pragma omp parallel for
+    #pragma omp parallel for schedule(static)
     for (i = 0; i < lvectsize; i++)
     {
         dvectout[i] = dleftvec[i] - drightvec[i];
@@ -175,7 +297,7 @@ FLPT * daddinsitu (const INTG lvectsize, FLPT * doverwrite,
     const FLPT dconst, const FLPT * drightvec)
 {
     INTG i; /* An iteration variable. */
-    #pragma omp parallel for
+    #pragma omp parallel for schedule(static)
     for (i = 0; i < lvectsize; i++)
     {
         doverwrite[i] += dconst * drightvec[i];
@@ -188,7 +310,7 @@ FLPT * daddtwosums (const INTG lvectsize, FLPT * dadjust,
     const FLPT * drightvec, const FLPT drightconst)
 {
     INTG i; /* An iteration variable. */
-    #pragma omp parallel for
+    #pragma omp parallel for schedule(static)
     for (i = 0; i < lvectsize; i++)
     {
         dadjust[i] = (dleftvec[i] * dleftconst) + 
@@ -198,14 +320,166 @@ FLPT * daddtwosums (const INTG lvectsize, FLPT * dadjust,
 }
 
 
+FLPT dcgupdate (const INTG lvectsize, const FLPT dalpha, 
+    const FLPT * ddvector, const FLPT * dqvector, FLPT * dvectx, 
+    FLPT * drvector)
+{
+    INTG i; /* An iteration variable. */
+    FLPT dresult = 0.0; /* The result. */
+    if (bdeterministic)
+    {
+        
+/* The updates are done a block at a time, each block summed alone. */        
+        
+        const INTG lnoblocks = (lvectsize + UCDSDETBLOCK - 1) / UCDSDETBLOCK;
+        FLPT * dpartials = dassign(max(1, lnoblocks));
+        INTG k; /* Over blocks. */
+        if (dpartials != NULL)
+        {
+            #pragma omp parallel for private(i) schedule(static)
+            for (k = 0; k < lnoblocks; k++)
+            {
+                const INTG lto = min(lvectsize, (k + 1) * UCDSDETBLOCK);
+                FLPT dsum = 0.0;
+                #pragma omp simd reduction(+:dsum)
+                for (i = k * UCDSDETBLOCK; i < lto; i++)
+                {
+                    dvectx[i] += dalpha * ddvector[i];
+                    drvector[i] -= dalpha * dqvector[i];
+                    dsum += drvector[i] * drvector[i];
+                }
+                dpartials[k] = dsum;
+            }
+            dresult = dsumpartials(lnoblocks, dpartials);
+            free(dpartials);
+            return dresult;
+        }
+        daddinsitu(lvectsize, dvectx, dalpha, ddvector);
+        daddinsitu(lvectsize, drvector, -dalpha, dqvector);
+        return ddotprod(lvectsize, drvector, drvector);
+    }
+    #pragma omp parallel for reduction(+:dresult) schedule(static)
+    for (i = 0; i < lvectsize; i++)
+    {
+        dvectx[i] += dalpha * ddvector[i];
+        drvector[i] -= dalpha * dqvector[i];
+        dresult += drvector[i] * drvector[i];
+    }
+    return dresult;
+}
+
+FLPT dpcgupdate (const INTG lvectsize, const FLPT dalpha, 
+    const FLPT * ddvector, const FLPT * dqvector, const FLPT * dinvdiag,
+    FLPT * dvectx, FLPT * drvector, FLPT * dzvector)
+{
+    INTG i; /* An iteration variable. */
+    FLPT dresult = 0.0; /* The result. */
+    if (bdeterministic)
+    {
+        daddinsitu(lvectsize, dvectx, dalpha, ddvector);
+        daddinsitu(lvectsize, drvector, -dalpha, dqvector);
+        return djacobidot(lvectsize, dinvdiag, drvector, dzvector);
+    }
+    
+/* 
+// The work is split into blocks of UCDSDETBLOCK; the second loop finds 
+// the block of r still in the L1 cache. One loop for all eight streams
+// turned out slower than two loops over each block.
+*/    
+    
+    INTG k; /* Over blocks. */
+    const INTG lnoblocks = (lvectsize + UCDSDETBLOCK - 1) / UCDSDETBLOCK;
+    #pragma omp parallel for private(i) reduction(+:dresult) schedule(static)
+    for (k = 0; k < lnoblocks; k++)
+    {
+        const INTG lfrom = k * UCDSDETBLOCK;
+        const INTG lto = min(lvectsize, lfrom + UCDSDETBLOCK);
+        #pragma omp simd
+        for (i = lfrom; i < lto; i++)
+        {
+            dvectx[i] += dalpha * ddvector[i];
+            drvector[i] -= dalpha * dqvector[i];
+        }
+        #pragma omp simd reduction(+:dresult)
+        for (i = lfrom; i < lto; i++)
+        {
+            dzvector[i] = dinvdiag[i] * drvector[i];
+            dresult += drvector[i] * dzvector[i];
+        }
+    }
+    return dresult;
+}
+
+FLPT djacobidot (const INTG lvectsize, const FLPT * dinvdiag, 
+    const FLPT * drvector, FLPT * dzvector)
+{
+    INTG i; /* An iteration variable. */
+    FLPT dresult = 0.0; /* The result. */
+    if (bdeterministic)
+    {
+        #pragma omp parallel for schedule(static)
+        for (i = 0; i < lvectsize; i++)
+        {
+            dzvector[i] = dinvdiag[i] * drvector[i];
+        }
+        return ddotprod(lvectsize, drvector, dzvector);
+    }
+    #pragma omp parallel for simd reduction(+:dresult) schedule(static)
+    for (i = 0; i < lvectsize; i++)
+    {
+        dzvector[i] = dinvdiag[i] * drvector[i];
+        dresult += drvector[i] * dzvector[i];
+    }
+    return dresult;
+}
+
+FLPT * dinterleave (const INTG lvectsize, const INTG inovects, 
+    FLPT ** dvectors, FLPT * dinterleaved)
+{
+    INTG i, j; /* Iteration variables. */
+    #pragma omp parallel for private(j) schedule(static)
+    for (i = 0; i < lvectsize; i++)
+    {
+        for (j = 0; j < inovects; j++)
+        {
+            dinterleaved[i*inovects + j] = dvectors[j][i];
+        }
+    }
+    return dinterleaved;
+}
+
+FLPT ** ddeinterleave (const INTG lvectsize, const INTG inovects, 
+    const FLPT * dinterleaved, FLPT ** dvectors)
+{
+    INTG i, j; /* Iteration variables. */
+    #pragma omp parallel for private(j) schedule(static)
+    for (i = 0; i < lvectsize; i++)
+    {
+        for (j = 0; j < inovects; j++)
+        {
+            dvectors[j][i] = dinterleaved[i*inovects + j];
+        }
+    }
+    return dvectors;
+}
+
 FLPT dvectnorm (const INTG lvectsize, const INTG mode, 
     const FLPT * dvectin)
 {
     INTG i; /* An iteration variable. */
     FLPT dresult = 0.0; /* The result. */
-    if (mode == 1)
+    if ((mode == 1) && bdeterministic)
+    {
+        UCDSBLOCKSUM(dresult, lvectsize, fabs(dvectin[i]));
+    }
+    else if ((mode == 2) && bdeterministic)
+    {
+        UCDSBLOCKSUM(dresult, lvectsize, pow(dvectin[i], 2));
+        dresult = sqrt(dresult);
+    }
+    else if (mode == 1)
     {
-        #pragma omp parallel for reduction(+:dresult)
+        #pragma omp parallel for reduction(+:dresult) schedule(static)
         for (i = 0; i < lvectsize; i++)
         {
             dresult += fabs(dvectin[i]);
@@ -213,7 +487,7 @@ FLPT dvectnorm (const INTG lvectsize, const INTG mode,
     }
     else if (mode == 2)
     {
-        #pragma omp parallel for reduction(+:dresult)
+        #pragma omp parallel for reduction(+:dresult) schedule(static)
         for (i = 0; i < lvectsize; i++)
         {
             dresult += pow(dvectin[i], 2);
@@ -235,647 +509,4352 @@ FLPT dvectnorm (const INTG lvectsize, const INTG mode,
     return dresult;
 }
 
-FLPT daltnorm (const INTG lvectsize, const INTG mode, 
-    const FLPT * dvectin)
+/* The leaf size of dpairwise (see setpairwiseleaf). */
+
+static INTG lpairwiseleaf = UCDSPAIRLEAF;
+
+void setpairwiseleaf(const INTG lleafsize)
 {
-    FLPT dresult = 0.0; /* The result. */
-    if (lvectsize == 1)
+    lpairwiseleaf = max(1, lleafsize);
+}
+
+INTG getpairwiseleaf(void)
+{
+    return lpairwiseleaf;
+}
+
+/*
+// The dpairtree function does the work of dpairwise below. Halves longer
+// than the leaf size are split again, the first half as an OpenMP task
+// that any thread of the team can pick up, and the second by the thread
+// itself. The tree only depends on lvectsize and the leaf size, not on
+// the number of threads.
+*/
+
+static FLPT dpairtree(const INTG lvectsize, const FLPT * dvectin, 
+    const fpleaf fpleaffn, const fpcombine fpcombinefn, const INTG lleafsize)
+{
+    if (lvectsize <= lleafsize)
     {
-        return fabs(dvectin[0]);
+        return fpleaffn(lvectsize, dvectin);
     }
-    INTG lhalf = lvectsize / 2;
-    INTG lremd = lvectsize - lhalf;
-    FLPT fbr1;
-    FLPT fbr2;
-    FLPT * dsndptr = (FLPT *) &(dvectin[lhalf]);
-    #pragma omp parallel sections
-    {
-        #pragma omp section
-        {
-            fbr1 = daltnorm(lhalf, mode, dvectin);
-        } 
-        #pragma omp section
-        {
-            fbr2 = daltnorm(lremd, mode, dsndptr);
-        } 
-    }    
-    if (mode == 1)
+    const INTG lhalf = lvectsize / 2;
+    FLPT dleft, dright; /* The results for each half. */
+    #pragma omp task shared(dleft)
+    dleft = dpairtree(lhalf, dvectin, fpleaffn, fpcombinefn, lleafsize);
+    dright = dpairtree(lvectsize - lhalf, &(dvectin[lhalf]), fpleaffn, 
+        fpcombinefn, lleafsize);
+    #pragma omp taskwait
+    return fpcombinefn(dleft, dright);
+}
+
+FLPT dpairwise(const INTG lvectsize, const FLPT * dvectin, 
+    const fpleaf fpleaffn, const fpcombine fpcombinefn)
+{
+    FLPT dresult = 0.0; /* The result. */
+    const INTG lleafsize = lpairwiseleaf;
+    #pragma omp parallel if (lvectsize > lleafsize)
     {
-        dresult = fbr1 + fbr2;
+        #pragma omp single
+        dresult = dpairtree(lvectsize, dvectin, fpleaffn, fpcombinefn, 
+            lleafsize);
     }
-    else if (mode == 2)
+    return dresult;
+}
+
+/* Leaves and combining functions for daltnorm. */
+
+static FLPT dleafabssum(const INTG lvectsize, const FLPT * dvectin)
+{
+    INTG i; /* An iteration variable. */
+    FLPT dresult = 0.0; /* The result. */
+    #pragma omp simd reduction(+:dresult)
+    for (i = 0; i < lvectsize; i++)
     {
-        dresult = sqrt(pow(fbr1,2) + pow(fbr2, 2));
+        dresult += fabs(dvectin[i]);
     }
-    else /* Infinity mode */
-    {
-        dresult = max(fbr1, fbr2);
-    }        
     return dresult;
 }
 
-ucds* create_ucds(const INTG lmatsize, INTG * ldiagindices, const INTG lnumdiag)
+static FLPT dleafsquaresum(const INTG lvectsize, const FLPT * dvectin)
 {
-    if ((lmatsize < 1) || (ldiagindices[0] < (1 - lmatsize)) || 
-        (ldiagindices[0] > ldiagindices[lnumdiag - 1]) 
-        || ((lmatsize - 1) < ldiagindices[lnumdiag - 1])) 
+    INTG i; /* An iteration variable. */
+    FLPT dresult = 0.0; /* The result. */
+    #pragma omp simd reduction(+:dresult)
+    for (i = 0; i < lvectsize; i++)
     {
-        return NULL;
+        dresult += dvectin[i] * dvectin[i];
     }
-    ucds* ourucds = (ucds *)malloc(1 * sizeof(ucds));
-    ourucds->lmatsize = lmatsize;
-    ourucds->lnumdiag = lnumdiag;
-    ourucds->ldiagindices = ldiagindices;
-    ourucds->ddiagelems = dassign(lnumdiag * lmatsize);
-    return ourucds;
+    return dresult;
 }
 
-ucds * mmatrix_ucds(const INTG lmatsize, INTG * ldiagindices, FLPT *
-    ddiagvals, const INTG lnumdiag)
+static FLPT dleafabsmax(const INTG lvectsize, const FLPT * dvectin)
 {
-    
-/* 
-// Before allocating space for the cds, we have to check that parameters 
-// make a M-matrix creation possible.
-*/
-
-    if ((ldiagindices[0] > 0) || (ldiagindices[lnumdiag - 1] < 0))
+    INTG i; /* An iteration variable. */
+    FLPT dresult = 0.0; /* The result. */
+    #pragma omp simd reduction(max:dresult)
+    for (i = 0; i < lvectsize; i++)
     {
-        return NULL;
+        dresult = max(dresult, fabs(dvectin[i]));
     }
-    
-    register FLPT dsum = 0.0; /* This checks diagonal dominance. */ 
-    INTG i, j; /* Iteration variables. */
-    for (i = 0; i < lnumdiag; i++)
+    return dresult;
+}
+
+static FLPT dcombineadd(const FLPT dleft, const FLPT dright)
+{
+    return dleft + dright;
+}
+
+static FLPT dcombinemax(const FLPT dleft, const FLPT dright)
+{
+    return max(dleft, dright);
+}
+
+FLPT daltnorm (const INTG lvectsize, const INTG mode, 
+    const FLPT * dvectin)
+{
+    if (mode == 1)
     {
-        dsum += ddiagvals[i];
+        return dpairwise(lvectsize, dvectin, &dleafabssum, &dcombineadd);
     }
-    if (dsum < 0.0)
+    else if (mode == 2)
     {
-        return NULL;
+        return sqrt(dpairwise(lvectsize, dvectin, &dleafsquaresum, 
+            &dcombineadd));
     }
-    
-/* Now we can allocate the cds. */    
-    
-    ucds * ourucds = create_ucds(lmatsize, ldiagindices, lnumdiag);
-    #pragma omp parallel for
-    for (i = 0; i < lnumdiag; i++)
+    else /* Infinity mode */
     {
-        #pragma omp parallel for
-        for (j = 0; j < lmatsize; j++)
-        {
-            ourucds->ddiagelems[i*lmatsize + j] = ddiagvals[i];
-        }
+        return dpairwise(lvectsize, dvectin, &dleafabsmax, &dcombinemax);
     }
-    return ourucds;
 }
 
-INTG createspdd(INTG inodiags, INTG * ldiagelems, FLPT * ddiagvals)
+FLPT dreducenorm (const INTG lvectsize, const INTG mode, 
+    const FLPT * dvectin)
 {
-    if ((inodiags < 1) || (inodiags % 2 == 0))
+    INTG i; /* An iteration variable. */
+    FLPT dresult = 0.0; /* The result. */
+    if ((mode == 1) && bdeterministic)
     {
-        return 0; /* inodiags has to be odd to create spd matrices. */
+        UCDSBLOCKSUM(dresult, lvectsize, fabs(dvectin[i]));
     }
-    
-    INTG i;
-    INTG imidpoint = inodiags / 2;
-    for (i = 0; i < inodiags; i++)
+    else if ((mode == 2) && bdeterministic)
     {
-        ldiagelems[i] = i - imidpoint;
-        if (i == imidpoint)
+        UCDSBLOCKSUM(dresult, lvectsize, dvectin[i] * dvectin[i]);
+        dresult = sqrt(dresult);
+    }
+    else if (mode == 1)
+    {
+        #pragma omp parallel for simd reduction(+:dresult) schedule(static)
+        for (i = 0; i < lvectsize; i++)
         {
-            ddiagvals[i] = 2.0 * imidpoint;
+            dresult += fabs(dvectin[i]);
         }
-        else
+    }
+    else if (mode == 2)
+    {
+        #pragma omp parallel for simd reduction(+:dresult) schedule(static)
+        for (i = 0; i < lvectsize; i++)
         {
-            ddiagvals[i] = -1.0;          
+            dresult += dvectin[i] * dvectin[i];
         }
-    }  
-    return 1; /* Success! */
+        dresult = sqrt(dresult);
+    }
+    else /* Infinity mode */
+    {
+        #pragma omp parallel for simd reduction(max:dresult) schedule(static)
+        for (i = 0; i < lvectsize; i++)
+        {
+            dresult = max(dresult, fabs(dvectin[i]));
+        }
+    }        
+    return dresult;
 }
 
-mmtestbed * mmsetup(INTG lnumdiag, INTG ivectsize, mmtestbed * mmref)
+FLPT dscalednorm (const INTG lvectsize, const FLPT * dvectin)
 {
-    mmref->lnumdiag = lnumdiag;
-    mmref->ldiagindices = (INTG *) malloc (lnumdiag * sizeof(INTG));
-    mmref->ddiagelems = dassign(lnumdiag);
-    createspdd(lnumdiag, mmref->ldiagindices, mmref->ddiagelems);
-    mmref->dret = dassign(ivectsize);
-    mmref->ourucds = mmatrix_ucds(ivectsize, mmref->ldiagindices,
-        mmref->ddiagelems, lnumdiag);
-    mmref->inoreps = 0;
-    return mmref;
-}
-
-void mmdestroy(mmtestbed * mmref)
-{
-    free(mmref->dret);
-    free(mmref->ddiagelems);
-    free(mmref->ldiagindices);
-    destroy_ucds(mmref->ourucds);
-}
-
-void destroy_ucds(ucds * ourucds)
-{
-    free(ourucds->ddiagelems); 
-    free(ourucds);
-}
-
-FLPT * multiply_ucds(const ucds *ourucds, const FLPT *dvector, FLPT * dret)
-{
-    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL))
+    INTG i; /* An iteration variable. */
+    FLPT dsum = 0.0; /* The sum of the scaled squares. */
+    const FLPT dmax = dreducenorm(lvectsize, 3, dvectin); /* The scale. */
+    if ((dmax == 0.0) || isinf(dmax) || isnan(dmax))
     {
-        return NULL;
+        return dmax;
     }
-    
-    INTG i, j; /* Iteration variables */
-    INTG lrevindex; /* Current diagonal index to evaluate. */
-    INTG miniter, maxiter; /* Sets range to iterate over in value lookup. */
-    
-    for (i = 0; i < ourucds->lmatsize; i++)
+    /* Divide, as 1 / dmax overflows for a subnormal dmax. */
+    if (bdeterministic)
     {
-        dret[i] = 0.0;
+        UCDSBLOCKSUM(dsum, lvectsize, 
+            (dvectin[i] / dmax) * (dvectin[i] / dmax));
+        return dmax * sqrt(dsum);
     }
-    
-    #pragma omp parallel for private(lrevindex, miniter, maxiter, j)
-    for (i = 0; i < ourucds->lnumdiag; i++)
+    #pragma omp parallel for simd reduction(+:dsum) schedule(static)
+    for (i = 0; i < lvectsize; i++)
     {
-        lrevindex = ourucds->ldiagindices[i];
-        miniter = max(0, lrevindex);
-        maxiter = min(ourucds->lmatsize - 1, ourucds->lmatsize - 1 
-            + lrevindex);
-//        #pragma omp parallel for
-        for (j = miniter; j <= maxiter; j++)
-        {
-            #pragma omp atomic
-            dret[j - lrevindex] += ourucds->ddiagelems[i*ourucds->lmatsize 
-                + j] * dvector[j];
-        }
+        dsum += (dvectin[i] / dmax) * (dvectin[i] / dmax);
     }
-    return dret; 
+    return dmax * sqrt(dsum);
 }
 
-FLPT * multiply_ucdsalt(const ucds *ourucds, const FLPT *dvector, FLPT * dret)
+/*
+// The ucdscreate function does the work shared by create_ucds,
+// create_ucdsconst and narrow_ucds. It checks the arguments, fills in the
+// structure and allocates the elements for istorage.
+//
+// Apart from UCDSCONST, the diagonals are zeroed straight away, each 
+// thread zeroing its own rowblock of every diagonal. This is the first 
+// touch of those pages, so each one is placed on the node of the thread
+// that multiplies those rows, whoever fills the matrix in later.
+*/
+
+static ucds* ucdscreate(const INTG lmatsize, INTG * ldiagindices, 
+    const INTG lnumdiag, const INTG istorage)
 {
-    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL))
+    if ((lmatsize < 1) || (ldiagindices[0] < (1 - lmatsize)) || 
+        (ldiagindices[0] > ldiagindices[lnumdiag - 1]) 
+        || ((lmatsize - 1) < ldiagindices[lnumdiag - 1])) 
     {
         return NULL;
     }
-    
-    INTG i, j; /* Iteration variables */
-    INTG lrevindex; /* Current diagonal index to evaluate. */
-    INTG miniter, maxiter; /* Sets range to iterate over in value lookup. */
-    
-    for (i = 0; i < ourucds->lmatsize; i++)
+    ucds* ourucds = (ucds *)malloc(1 * sizeof(ucds));
+    if (ourucds == NULL)
     {
-        dret[i] = 0.0;
+        return NULL;
     }
-    
-    //##pragma omp parallel for private(lrevindex, miniter, maxiter, j)
-    for (i = 0; i < ourucds->lnumdiag; i++)
+    char * pelems; /* The elements, whatever their type. */
+    size_t lelemsize; /* The size of one element. */
+    ourucds->lmatsize = lmatsize;
+    ourucds->lnumdiag = lnumdiag;
+    ourucds->ldiagindices = ldiagindices;
+    ourucds->ddiagelems = NULL;
+    ourucds->fdiagelems = NULL;
+    ourucds->udiagelems = NULL;
+    ourucds->istorage = istorage;
+    switch (istorage)
     {
-        lrevindex = ourucds->ldiagindices[i];
-        miniter = max(0, lrevindex);
-        maxiter = min(ourucds->lmatsize - 1, ourucds->lmatsize - 1 
-            + lrevindex);
-        #pragma omp parallel for
-        for (j = miniter; j <= maxiter; j++)
-        {
-            dret[j - lrevindex] += ourucds->ddiagelems[i*ourucds->lmatsize 
-                + j] * dvector[j];
-        }
+        case UCDSCONST:
+            ourucds->ddiagelems = dassign(lnumdiag);
+            pelems = (char *) ourucds->ddiagelems;
+            lelemsize = 0;
+            break;
+        case UCDSSINGLE:
+            ourucds->fdiagelems = (float *) vassign((size_t) lnumdiag * 
+                lmatsize * sizeof(float));
+            pelems = (char *) ourucds->fdiagelems;
+            lelemsize = sizeof(float);
+            break;
+        case UCDSBF16:
+            ourucds->udiagelems = (uint16_t *) vassign((size_t) lnumdiag * 
+                lmatsize * sizeof(uint16_t));
+            pelems = (char *) ourucds->udiagelems;
+            lelemsize = sizeof(uint16_t);
+            break;
+        default:
+            ourucds->ddiagelems = dassign(lnumdiag * lmatsize);
+            pelems = (char *) ourucds->ddiagelems;
+            lelemsize = sizeof(FLPT);
     }
-    return dret; 
-}
-
-FLPT * multiply_ucds27(const ucds *ourucds, const FLPT *dvector, FLPT * dret)
-{
-    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL))
+    if (pelems == NULL)
     {
+        free(ourucds);
         return NULL;
     }
-
-    const INTG idiagnum = LARGEDIAG;
-    INTG i, j; /* Iteration variables */
-    INTG lrevindex; /* Current diagonal index to evaluate. */
-    INTG miniter, maxiter; /* Sets range to iterate over in value lookup. */
-    
-    for (i = 0; i < ourucds->lmatsize; i++)
-    {
-        dret[i] = 0.0;
-    }
-    
-    #pragma omp parallel for private(lrevindex, miniter, maxiter, j)
-    for (i = 0; i < idiagnum; i++)
+    if (lelemsize > 0)
     {
-        lrevindex = ourucds->ldiagindices[i];
-        miniter = max(0, lrevindex);
-        maxiter = min(ourucds->lmatsize - 1, ourucds->lmatsize - 1 
-            + lrevindex);
-        //#pragma omp parallel for
-        for (j = miniter; j <= maxiter; j++)
+        #pragma omp parallel
         {
-            #pragma omp atomic
-            dret[j - lrevindex] += ourucds->ddiagelems[i*ourucds->lmatsize 
-                + j] * dvector[j];
+            INTG i; /* Iteration variable. */
+            INTG lstart, lend; /* The block of rows this thread owns. */
+            rowblock(lmatsize, &lstart, &lend);
+            for (i = 0; i < lnumdiag; i++)
+            {
+                memset(&(pelems[((size_t) i*lmatsize + lstart) * lelemsize]),
+                    0, (lend - lstart) * lelemsize);
+            }
         }
     }
-    return dret; 
+    
+/* 
+// Row j reaches column j + ldiagindices[i] on the i-th diagonal, so the 
+// lowest and highest diagonals decide where the interior rows lie.
+*/    
+    
+    ourucds->linteriorstart = min(lmatsize, max(0, -ldiagindices[0]));
+    ourucds->linteriorend = max(ourucds->linteriorstart, 
+        min(lmatsize, lmatsize - ldiagindices[lnumdiag - 1]));
+    return ourucds;
 }
 
-FLPT * multiply_ucdsalt27(const ucds *ourucds, const FLPT *dvector, FLPT * dret)
+ucds* create_ucds(const INTG lmatsize, INTG * ldiagindices, const INTG lnumdiag)
 {
-    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL))
-    {
-        return NULL;
-    }
+    return ucdscreate(lmatsize, ldiagindices, lnumdiag, UCDSFULL);
+}
 
-    const INTG idiagnum = LARGEDIAG;
-    INTG i, j; /* Iteration variables */
-    INTG lrevindex; /* Current diagonal index to evaluate. */
-    INTG miniter, maxiter; /* Sets range to iterate over in value lookup. */
-    
-    for (i = 0; i < ourucds->lmatsize; i++)
-    {
-        dret[i] = 0.0;
-    }
-    
-    //#pragma omp parallel for private(lrevindex, miniter, maxiter, j)
-    for (i = 0; i < idiagnum; i++)
-    {
-        lrevindex = ourucds->ldiagindices[i];
-        miniter = max(0, lrevindex);
-        maxiter = min(ourucds->lmatsize - 1, ourucds->lmatsize - 1 
-            + lrevindex);
-        #pragma omp parallel for
-        for (j = miniter; j <= maxiter; j++)
-        {
-            dret[j - lrevindex] += ourucds->ddiagelems[i*ourucds->lmatsize 
-                + j] * dvector[j];
-        }
-    }
-    return dret; 
+ucds* create_ucdsconst(const INTG lmatsize, INTG * ldiagindices, 
+    const INTG lnumdiag)
+{
+    return ucdscreate(lmatsize, ldiagindices, lnumdiag, UCDSCONST);
 }
 
-FLPT * multiply_ucds5(const ucds *ourucds, const FLPT *dvector, FLPT * dret)
+/* 
+// The ubf16 and fbf16 functions convert between float and bfloat16, the
+// top half of the bits of a float. ubf16 rounds to nearest (ties to 
+// even) by adding just under half of the dropped part before truncating,
+// and keeps a NaN a NaN.
+*/
+
+static inline uint16_t ubf16(const float fvalue)
 {
-    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL))
+    union { float f; uint32_t u; } ubits; /* The bits of the value. */
+    ubits.f = fvalue;
+    if ((ubits.u & 0x7fffffffU) > 0x7f800000U)
     {
-        return NULL;
+        return (uint16_t) ((ubits.u >> 16) | 0x0040U);
     }
+    ubits.u += 0x7fffU + ((ubits.u >> 16) & 1U);
+    return (uint16_t) (ubits.u >> 16);
+}
 
-    const INTG idiagnum = MIDDIAG;
-    INTG i, j; /* Iteration variables */
-    INTG lrevindex; /* Current diagonal index to evaluate. */
-    INTG miniter, maxiter; /* Sets range to iterate over in value lookup. */
-    
-    for (i = 0; i < ourucds->lmatsize; i++)
-    {
-        dret[i] = 0.0;
-    }
-    
-    #pragma omp parallel for private(lrevindex, miniter, maxiter, j)
-    for (i = 0; i < idiagnum; i++)
-    {
-        lrevindex = ourucds->ldiagindices[i];
-        miniter = max(0, lrevindex);
-        maxiter = min(ourucds->lmatsize - 1, ourucds->lmatsize - 1 
-            + lrevindex);
-        //#pragma omp parallel for
-        for (j = miniter; j <= maxiter; j++)
-        {
-            #pragma omp atomic
-            dret[j - lrevindex] += ourucds->ddiagelems[i*ourucds->lmatsize 
-                + j] * dvector[j];
-        }
-    }
-    return dret; 
+static inline float fbf16(const uint16_t uvalue)
+{
+    union { float f; uint32_t u; } ubits; /* The bits of the value. */
+    ubits.u = ((uint32_t) uvalue) << 16;
+    return ubits.f;
 }
 
-FLPT * multiply_ucdsalt5(const ucds *ourucds, const FLPT *dvector, FLPT * dret)
+uint16_t dtobf16(const FLPT dvalue)
 {
-    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL))
+    return ubf16((float) dvalue);
+}
+
+FLPT dfrombf16(const uint16_t uvalue)
+{
+    return (FLPT) fbf16(uvalue);
+}
+
+ucds* narrow_ucds(const ucds * ourucds, const INTG istorage)
+{
+    if ((ourucds == NULL) || (ourucds->istorage != UCDSFULL) ||
+        ((istorage != UCDSSINGLE) && (istorage != UCDSBF16)))
     {
         return NULL;
     }
-
-    const INTG idiagnum = MIDDIAG;
-    INTG i, j; /* Iteration variables */
-    INTG lrevindex; /* Current diagonal index to evaluate. */
-    INTG miniter, maxiter; /* Sets range to iterate over in value lookup. */
-    
-    for (i = 0; i < ourucds->lmatsize; i++)
+    const INTG lmatsize = ourucds->lmatsize;
+    const INTG lnumdiag = ourucds->lnumdiag;
+    ucds * ournarrow = ucdscreate(lmatsize, ourucds->ldiagindices, lnumdiag,
+        istorage);
+    if (ournarrow == NULL)
     {
-        dret[i] = 0.0;
+        return NULL;
     }
-    
-    //#pragma omp parallel for private(lrevindex, miniter, maxiter, j)
-    for (i = 0; i < idiagnum; i++)
+    #pragma omp parallel
     {
-        lrevindex = ourucds->ldiagindices[i];
-        miniter = max(0, lrevindex);
-        maxiter = min(ourucds->lmatsize - 1, ourucds->lmatsize - 1 
-            + lrevindex);
-        #pragma omp parallel for
-        for (j = miniter; j <= maxiter; j++)
+        INTG i, j; /* Iteration variables. */
+        INTG lstart, lend; /* The block of rows this thread owns. */
+        rowblock(lmatsize, &lstart, &lend);
+        for (i = 0; i < lnumdiag; i++)
         {
-            dret[j - lrevindex] += ourucds->ddiagelems[i*ourucds->lmatsize 
-                + j] * dvector[j];
+            for (j = i*lmatsize + lstart; j < i*lmatsize + lend; j++)
+            {
+                if (istorage == UCDSSINGLE)
+                {
+                    ournarrow->fdiagelems[j] = (float) ourucds->ddiagelems[j];
+                }
+                else
+                {
+                    ournarrow->udiagelems[j] = 
+                        ubf16((float) ourucds->ddiagelems[j]);
+                }
+            }
         }
     }
-    return dret; 
+    return ournarrow;
 }
 
-FLPT * multiply_ucdsd27(const ucds *ourucds, const FLPT *dvector, FLPT * dret)
+/* 
+// Before allocating space for the cds, we have to check that parameters 
+// make a M-matrix creation possible. The bmmatrixok function does this
+// for mmatrix_ucds and mmatrix_ucdsconst.
+*/
+
+static INTG bmmatrixok(const INTG * ldiagindices, const FLPT * ddiagvals, 
+    const INTG lnumdiag)
 {
-    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL))
+    if ((ldiagindices[0] > 0) || (ldiagindices[lnumdiag - 1] < 0))
     {
-        return NULL;
+        return 0;
     }
-
-//    const INTG idiagnum = LARGEDIAG;
-    INTG i, j; /* Iteration variables */
-    INTG lrevindex; /* Current diagonal index to evaluate. */
-    INTG miniter, maxiter; /* Sets range to iterate over in value lookup. */
     
-    for (i = 0; i < ourucds->lmatsize; i++)
+    register FLPT dsum = 0.0; /* This checks diagonal dominance. */ 
+    INTG i; /* Iteration variable. */
+    for (i = 0; i < lnumdiag; i++)
     {
-        dret[i] = 0.0;
+        dsum += ddiagvals[i];
     }
-    
-    #pragma omp parallel for private(lrevindex, miniter, maxiter, j)
-    for (i = 0; i < LARGEDIAG; i++)
+    if (dsum < 0.0)
     {
-        lrevindex = ourucds->ldiagindices[i];
-        miniter = max(0, lrevindex);
-        maxiter = min(ourucds->lmatsize - 1, ourucds->lmatsize - 1 
-            + lrevindex);
-        //#pragma omp parallel for
-        for (j = miniter; j <= maxiter; j++)
-        {
-            #pragma omp atomic
-            dret[j - lrevindex] += ourucds->ddiagelems[i*ourucds->lmatsize 
-                + j] * dvector[j];
-        }
+        return 0;
     }
-    return dret; 
+    return 1;
 }
 
-FLPT * multiply_ucdsaltd27(const ucds *ourucds, const FLPT *dvector, FLPT * dret)
+ucds * mmatrix_ucds(const INTG lmatsize, INTG * ldiagindices, FLPT *
+    ddiagvals, const INTG lnumdiag)
 {
-    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL))
+    if (!bmmatrixok(ldiagindices, ddiagvals, lnumdiag))
     {
         return NULL;
     }
-
-//    const INTG idiagnum = LARGEDIAG;
-    INTG i, j; /* Iteration variables */
-    INTG lrevindex; /* Current diagonal index to evaluate. */
-    INTG miniter, maxiter; /* Sets range to iterate over in value lookup. */
     
-    for (i = 0; i < ourucds->lmatsize; i++)
+/* Now we can allocate the cds. */    
+    
+    ucds * ourucds = create_ucds(lmatsize, ldiagindices, lnumdiag);
+    if (ourucds == NULL)
     {
-        dret[i] = 0.0;
+        return NULL;
     }
     
-    //#pragma omp parallel for private(lrevindex, miniter, maxiter, j)
-    for (i = 0; i < LARGEDIAG; i++)
+/* Each thread fills its own rows, as in multiply_ucdsrow. */    
+    
+    #pragma omp parallel
     {
-        lrevindex = ourucds->ldiagindices[i];
-        miniter = max(0, lrevindex);
-        maxiter = min(ourucds->lmatsize - 1, ourucds->lmatsize - 1 
-            + lrevindex);
-        #pragma omp parallel for
-        for (j = miniter; j <= maxiter; j++)
+        INTG i, j; /* Iteration variables. */
+        INTG lstart, lend; /* The block of rows this thread owns. */
+        rowblock(lmatsize, &lstart, &lend);
+        for (i = 0; i < lnumdiag; i++)
         {
-            dret[j - lrevindex] += ourucds->ddiagelems[i*ourucds->lmatsize 
-                + j] * dvector[j];
+            for (j = lstart; j < lend; j++)
+            {
+                ourucds->ddiagelems[i*lmatsize + j] = ddiagvals[i];
+            }
         }
     }
-    return dret; 
+    return ourucds;
 }
 
-FLPT * multiply_ucdsd5(const ucds *ourucds, const FLPT *dvector, FLPT * dret)
+ucds * mmatrix_ucdsconst(const INTG lmatsize, INTG * ldiagindices, FLPT *
+    ddiagvals, const INTG lnumdiag)
 {
-    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL))
+    if (!bmmatrixok(ldiagindices, ddiagvals, lnumdiag))
+    {
+        return NULL;
+    }
+    ucds * ourucds = create_ucdsconst(lmatsize, ldiagindices, lnumdiag);
+    if (ourucds == NULL)
     {
         return NULL;
     }
+    dveccopy(lnumdiag, ourucds->ddiagelems, ddiagvals);
+    return ourucds;
+}
 
-//    const INTG idiagnum = MIDDIAG;
-    INTG i, j; /* Iteration variables */
-    INTG lrevindex; /* Current diagonal index to evaluate. */
-    INTG miniter, maxiter; /* Sets range to iterate over in value lookup. */
-    
-    for (i = 0; i < ourucds->lmatsize; i++)
+INTG createspdd(INTG inodiags, INTG * ldiagelems, FLPT * ddiagvals)
+{
+    if ((inodiags < 1) || (inodiags % 2 == 0))
     {
-        dret[i] = 0.0;
+        return 0; /* inodiags has to be odd to create spd matrices. */
     }
     
-    #pragma omp parallel for private(lrevindex, miniter, maxiter, j)
-    for (i = 0; i < MIDDIAG; i++)
+    INTG i;
+    INTG imidpoint = inodiags / 2;
+    for (i = 0; i < inodiags; i++)
     {
-        lrevindex = ourucds->ldiagindices[i];
-        miniter = max(0, lrevindex);
-        maxiter = min(ourucds->lmatsize - 1, ourucds->lmatsize - 1 
-            + lrevindex);
-        //#pragma omp parallel for
-        for (j = miniter; j <= maxiter; j++)
+        ldiagelems[i] = i - imidpoint;
+        if (i == imidpoint)
         {
-            #pragma omp atomic
-            dret[j - lrevindex] += ourucds->ddiagelems[i*ourucds->lmatsize 
-                + j] * dvector[j];
+            ddiagvals[i] = 2.0 * imidpoint;
         }
-    }
-    return dret; 
+        else
+        {
+            ddiagvals[i] = -1.0;          
+        }
+    }  
+    return 1; /* Success! */
 }
 
-FLPT * multiply_ucdsaltd5(const ucds *ourucds, const FLPT *dvector, FLPT * dret)
+INTG create3dstencil(INTG inx, INTG iny, INTG inopoints, INTG * ldiagelems, 
+    FLPT * ddiagvals)
 {
-    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL))
+    if ((inx < 3) || (iny < 3) || ((inopoints != 7) && (inopoints != 19) && 
+        (inopoints != 27)))
     {
-        return NULL;
+        return 0;
     }
-
-//    const INTG idiagnum = MIDDIAG;
-    INTG i, j; /* Iteration variables */
-    INTG lrevindex; /* Current diagonal index to evaluate. */
-    INTG miniter, maxiter; /* Sets range to iterate over in value lookup. */
     
-    for (i = 0; i < ourucds->lmatsize; i++)
-    {
-        dret[i] = 0.0;
-    }
+    INTG ix, iy, iz; /* Offsets in each direction. */
+    INTG idist; /* How many directions the neighbour is offset in. */
+    INTG icount = 0; /* The number of diagonals so far. */
+    INTG imaxdist = (inopoints == 7) ? 1 : ((inopoints == 19) ? 2 : 3);
     
-    //#pragma omp parallel for private(lrevindex, miniter, maxiter, j)
-    for (i = 0; i < MIDDIAG; i++)
+/* 
+// Going through z, then y, then x keeps the indices in ascending order, as
+// inx and iny are at least 3.
+*/    
+    
+    for (iz = -1; iz <= 1; iz++)
     {
-        lrevindex = ourucds->ldiagindices[i];
-        miniter = max(0, lrevindex);
-        maxiter = min(ourucds->lmatsize - 1, ourucds->lmatsize - 1 
-            + lrevindex);
-        #pragma omp parallel for
-        for (j = miniter; j <= maxiter; j++)
+        for (iy = -1; iy <= 1; iy++)
         {
-            dret[j - lrevindex] += ourucds->ddiagelems[i*ourucds->lmatsize 
-                + j] * dvector[j];
+            for (ix = -1; ix <= 1; ix++)
+            {
+                idist = abs(ix) + abs(iy) + abs(iz);
+                if (idist > imaxdist)
+                {
+                    continue;
+                }
+                ldiagelems[icount] = ix + (iy * inx) + (iz * inx * iny);
+                ddiagvals[icount] = (idist == 0) ? (inopoints - 1.0) : -1.0;
+                icount++;
+            }
         }
     }
-    return dret; 
+    return 1; /* Success! */
 }
 
-void printucds(const char * name, ucds * ourucds)
+mmtestbed * mmsetup(INTG lnumdiag, INTG ivectsize, mmtestbed * mmref)
 {
-    printf("name: %s, matrix size: %d, number of diagonals: %d, ", name, 
-        ourucds->lmatsize, ourucds->lnumdiag);
-    printintvector("diagindices", ourucds->lnumdiag, ourucds->ldiagindices);
-    printvector("values", ourucds->lnumdiag * ourucds->lmatsize,
-        ourucds->ddiagelems);
+    mmref->lnumdiag = lnumdiag;
+    mmref->ldiagindices = (INTG *) malloc (lnumdiag * sizeof(INTG));
+    mmref->ddiagelems = dassign(lnumdiag);
+    createspdd(lnumdiag, mmref->ldiagindices, mmref->ddiagelems);
+    mmref->dret = dassignlocal(ivectsize);
+    mmref->ourucds = mmatrix_ucds(ivectsize, mmref->ldiagindices,
+        mmref->ddiagelems, lnumdiag);
+    mmref->inoreps = 0;
+    return mmref;
+}
+
+void mmdestroy(mmtestbed * mmref)
+{
+    free(mmref->dret);
+    free(mmref->ddiagelems);
+    free(mmref->ldiagindices);
+    destroy_ucds(mmref->ourucds);
+}
+
+void destroy_ucds(ucds * ourucds)
+{
+    if (ourucds == NULL)
+    {
+        return;
+    }
+    vunassign(ourucds->ddiagelems); 
+    vunassign(ourucds->fdiagelems); 
+    vunassign(ourucds->udiagelems); 
+    free(ourucds);
+}
+
+/*
+// The ducdselem function returns the element of the i-th diagonal in
+// column lcol, whatever the storage of ourucds.
+*/
+
+static inline FLPT ducdselem(const ucds *ourucds, const INTG i, 
+    const INTG lcol)
+{
+    const INTG lindex = (i * ourucds->lmatsize) + lcol;
+    switch (ourucds->istorage)
+    {
+        case UCDSCONST:
+            return ourucds->ddiagelems[i];
+        case UCDSSINGLE:
+            return (FLPT) ourucds->fdiagelems[lindex];
+        case UCDSBF16:
+            return (FLPT) fbf16(ourucds->udiagelems[lindex]);
+        default:
+            return ourucds->ddiagelems[lindex];
+    }
+}
+
+FLPT * jacobi_ucds(const ucds * ourucds, FLPT * dinvdiag)
+{
+    INTG i, j; /* Iteration variables. */
+    INTG imain = -1; /* The main diagonal. */
+    INTG bzero = 0; /* Whether there is a zero on it. */
+    if ((ourucds == NULL) || (dinvdiag == NULL))
+    {
+        return NULL;
+    }
+    for (i = 0; i < ourucds->lnumdiag; i++)
+    {
+        if (ourucds->ldiagindices[i] == 0)
+        {
+            imain = i;
+        }
+    }
+    if (imain < 0)
+    {
+        return NULL;
+    }
+    #pragma omp parallel for reduction(||:bzero) schedule(static)
+    for (j = 0; j < ourucds->lmatsize; j++)
+    {
+        const FLPT delem = ducdselem(ourucds, imain, j);
+        bzero = bzero || (delem == 0.0);
+        dinvdiag[j] = 1.0 / delem;
+    }
+    return bzero ? NULL : dinvdiag;
+}
+
+/*
+// The ucdslevels function finds the level of each row for the forward
+// (bbackward 0) or backward (nonzero) solve of ourprec, from the nonzero
+// elements of its factor, and sorts the rows by level (in row order 
+// within a level) into *lprows, with level l starting at (*lpstart)[l]. 
+// It returns the number of levels, or 0 if memory runs out.
+*/
+
+static INTG ucdslevels(const ucdsprecond * ourprec, const INTG bbackward, 
+    INTG ** lpstart, INTG ** lprows)
+{
+    INTG i, j, p; /* Iteration variables. */
+    const INTG n = ourprec->lmatsize; /* The size of the matrix. */
+    const INTG * lindices = ourprec->ourfactor->ldiagindices;
+    const FLPT * delems = ourprec->ourfactor->ddiagelems;
+    INTG imaxlevel = 0; /* The highest level. */
+    INTG * llevel = iassign(n); /* The level of each row. */
+    *lpstart = NULL;
+    *lprows = NULL;
+    if (llevel == NULL)
+    {
+        return 0;
+    }
+    for (i = 0; i < n; i++)
+    {
+        j = bbackward ? (n - 1 - i) : i;
+        INTG ilevel = 0; /* The level of row j. */
+        for (p = 0; p < ourprec->inumlower; p++)
+        {
+            /* Row j needs row lneed, if the element between them is not 0. */
+            const INTG lneed = bbackward ? (j - lindices[p]) : 
+                (j + lindices[p]);
+            const INTG lcol = bbackward ? j : lneed;
+            if ((lneed >= 0) && (lneed < n) && 
+                (delems[(p * n) + lcol] != 0.0) && 
+                (llevel[lneed] >= ilevel))
+            {
+                ilevel = llevel[lneed] + 1;
+            }
+        }
+        llevel[j] = ilevel;
+        imaxlevel = (ilevel > imaxlevel) ? ilevel : imaxlevel;
+    }
+    *lpstart = iassign(imaxlevel + 2);
+    *lprows = iassign(n);
+    if ((*lpstart == NULL) || (*lprows == NULL))
+    {
+        vunassign(llevel);
+        return 0;
+    }
+    for (i = 0; i < imaxlevel + 2; i++)
+    {
+        (*lpstart)[i] = 0;
+    }
+    for (j = 0; j < n; j++)
+    {
+        (*lpstart)[llevel[j] + 1]++;
+    }
+    for (i = 1; i < imaxlevel + 2; i++)
+    {
+        (*lpstart)[i] += (*lpstart)[i - 1];
+    }
+    for (j = 0; j < n; j++) /* This moves each start up to the next one. */
+    {
+        (*lprows)[(*lpstart)[llevel[j]]++] = j;
+    }
+    for (i = imaxlevel + 1; i > 0; i--)
+    {
+        (*lpstart)[i] = (*lpstart)[i - 1];
+    }
+    (*lpstart)[0] = 0;
+    vunassign(llevel);
+    return imaxlevel + 1;
+}
+
+void destroy_ucdsprecond(ucdsprecond * ourprec)
+{
+    if (ourprec == NULL)
+    {
+        return;
+    }
+    if (ourprec->ourfactor != NULL)
+    {
+        vunassign(ourprec->ourfactor->ldiagindices);
+        destroy_ucds(ourprec->ourfactor);
+    }
+    vunassign(ourprec->dinvdiag);
+    vunassign(ourprec->lfwdstart);
+    vunassign(ourprec->lfwdrows);
+    vunassign(ourprec->lbackstart);
+    vunassign(ourprec->lbackrows);
+    free(ourprec);
+}
+
+/*
+// The bic0factor function works out the IC(0) factor of ucdsa into 
+// ourprec, one row at a time. In row i, with L_ij on the diagonal of 
+// offset k (j = i + k), it subtracts L_im L_jm / D_m for each column m
+// before j in the pattern of both rows: m is i + a for each lower offset
+// a below k for which a - k is also a lower offset. It returns 0 if a 
+// pivot is not positive, or memory runs out, and 1 otherwise.
+*/
+
+static INTG bic0factor(ucdsprecond * ourprec, const ucds * ucdsa, 
+    const INTG imain)
+{
+    INTG i, p, a, b; /* Iteration variables. */
+    const INTG n = ourprec->lmatsize; /* The size of the matrix. */
+    const INTG inumlower = ourprec->inumlower;
+    const INTG * lindices = ourprec->ourfactor->ldiagindices;
+    FLPT * delems = ourprec->ourfactor->ddiagelems;
+    FLPT * ddiag = &delems[inumlower * n]; /* D. */
+    INTG inopairs = 0; /* The number of pairs (a, b) found. */
+    INTG * lpairstart = iassign(inumlower + 1); /* Pairs for each p. */
+    INTG * lpairs = iassign((2 * inumlower * inumlower) + 1);
+    if ((lpairstart == NULL) || (lpairs == NULL))
+    {
+        vunassign(lpairstart);
+        vunassign(lpairs);
+        return 0;
+    }
+    for (p = 0; p < inumlower; p++)
+    {
+        lpairstart[p] = inopairs;
+        for (a = 0; a < p; a++)
+        {
+            for (b = 0; b < inumlower; b++)
+            {
+                if (lindices[b] == (lindices[a] - lindices[p]))
+                {
+                    lpairs[2 * inopairs] = a;
+                    lpairs[(2 * inopairs) + 1] = b;
+                    inopairs++;
+                }
+            }
+        }
+    }
+    lpairstart[inumlower] = inopairs;
+    for (i = 0; i < n; i++)
+    {
+        FLPT dpivot = ducdselem(ucdsa, imain, i); /* D_i. */
+        for (p = 0; p < inumlower; p++)
+        {
+            const INTG j = i + lindices[p]; /* The column. */
+            if (j < 0)
+            {
+                continue;
+            }
+            FLPT dsum = ducdselem(ucdsa, p, j); /* L_ij. */
+            INTG q; /* Iteration variable. */
+            for (q = lpairstart[p]; q < lpairstart[p + 1]; q++)
+            {
+                const INTG m = i + lindices[lpairs[2 * q]];
+                if (m >= 0)
+                {
+                    dsum -= delems[(lpairs[2 * q] * n) + m] * 
+                        delems[(lpairs[(2 * q) + 1] * n) + m] * 
+                        ourprec->dinvdiag[m];
+                }
+            }
+            delems[(p * n) + j] = dsum;
+            dpivot -= dsum * dsum * ourprec->dinvdiag[j];
+        }
+        if (!(dpivot > 0.0))
+        {
+            break;
+        }
+        ddiag[i] = dpivot;
+        ourprec->dinvdiag[i] = 1.0 / dpivot;
+    }
+    vunassign(lpairstart);
+    vunassign(lpairs);
+    return (i == n);
+}
+
+ucdsprecond * create_ucdsprecond(const ucds * ucdsa, const INTG itype, 
+    const FLPT domega)
+{
+    INTG i, j, p; /* Iteration variables. */
+    INTG imain = -1; /* The main diagonal of ucdsa. */
+    INTG inumlower = 0; /* The number of negative offsets. */
+    INTG bgood = 1; /* Whether the factor is usable. */
+    if ((ucdsa == NULL) || ((itype != UCDSPRECSSOR) && 
+        (itype != UCDSPRECIC0)) || ((itype == UCDSPRECSSOR) && 
+        !((domega > 0.0) && (domega < 2.0))))
+    {
+        return NULL;
+    }
+    for (i = 0; i < ucdsa->lnumdiag; i++)
+    {
+        if (ucdsa->ldiagindices[i] < 0)
+        {
+            inumlower++;
+        }
+        else if (ucdsa->ldiagindices[i] == 0)
+        {
+            imain = i;
+        }
+    }
+    if (imain < 0)
+    {
+        return NULL;
+    }
+    const INTG n = ucdsa->lmatsize; /* The size of the matrix. */
+    ucdsprecond * ourprec = (ucdsprecond *) malloc(sizeof(ucdsprecond));
+    INTG * lindices = iassign(inumlower + 1); /* Offsets of the factor. */
+    if ((ourprec == NULL) || (lindices == NULL))
+    {
+        free(ourprec);
+        vunassign(lindices);
+        return NULL;
+    }
+    for (p = 0; p < inumlower; p++)
+    {
+        lindices[p] = ucdsa->ldiagindices[p];
+    }
+    lindices[inumlower] = 0;
+    ourprec->lmatsize = n;
+    ourprec->itype = itype;
+    ourprec->inumlower = inumlower;
+    ourprec->ourfactor = create_ucds(n, lindices, inumlower + 1);
+    ourprec->dinvdiag = dassign(n);
+    ourprec->lfwdstart = NULL;
+    ourprec->lfwdrows = NULL;
+    ourprec->lbackstart = NULL;
+    ourprec->lbackrows = NULL;
+    if (ourprec->ourfactor == NULL)
+    {
+        vunassign(lindices);
+    }
+    if ((ourprec->ourfactor == NULL) || (ourprec->dinvdiag == NULL))
+    {
+        destroy_ucdsprecond(ourprec);
+        return NULL;
+    }
+    FLPT * delems = ourprec->ourfactor->ddiagelems;
+    if (itype == UCDSPRECSSOR)
+    {
+        #pragma omp parallel for private(p) reduction(&&:bgood) \
+            schedule(static)
+        for (j = 0; j < n; j++)
+        {
+            const FLPT dpivot = ducdselem(ucdsa, imain, j) / domega;
+            for (p = 0; p < inumlower; p++)
+            {
+                const INTG lcol = j + lindices[p];
+                if (lcol >= 0)
+                {
+                    delems[(p * n) + lcol] = ducdselem(ucdsa, p, lcol);
+                }
+            }
+            bgood = bgood && (dpivot > 0.0);
+            delems[(inumlower * n) + j] = dpivot;
+            ourprec->dinvdiag[j] = 1.0 / dpivot;
+        }
+    }
+    else
+    {
+        bgood = bic0factor(ourprec, ucdsa, imain);
+    }
+    if (bgood)
+    {
+        ourprec->inofwdlevels = ucdslevels(ourprec, 0, &ourprec->lfwdstart, 
+            &ourprec->lfwdrows);
+        ourprec->inobacklevels = ucdslevels(ourprec, 1, 
+            &ourprec->lbackstart, &ourprec->lbackrows);
+        bgood = (ourprec->inofwdlevels > 0) && (ourprec->inobacklevels > 0);
+    }
+    if (!bgood)
+    {
+        destroy_ucdsprecond(ourprec);
+        return NULL;
+    }
+    return ourprec;
+}
+
+/*
+// The dfwdrow function solves row j of (D + L) y = r, given the rows it
+// needs, and dbackrow solves row i of (D + L)^T z = D y, with y in 
+// dzvector (so z overwrites y).
+*/
+
+static inline void dfwdrow(const ucdsprecond * ourprec, 
+    const FLPT * drvector, FLPT * dzvector, const INTG j)
+{
+    INTG p; /* Iteration variable. */
+    const INTG n = ourprec->lmatsize; /* The size of the matrix. */
+    const INTG * lindices = ourprec->ourfactor->ldiagindices;
+    const FLPT * delems = ourprec->ourfactor->ddiagelems;
+    FLPT dsum = drvector[j]; /* The sum for the row. */
+    if ((ourprec->inumlower == 0) || (j + lindices[0] >= 0))
+    {
+        for (p = 0; p < ourprec->inumlower; p++) /* No column is before 0. */
+        {
+            dsum -= delems[(p * n) + j + lindices[p]] * 
+                dzvector[j + lindices[p]];
+        }
+    }
+    else
+    {
+        for (p = 0; p < ourprec->inumlower; p++)
+        {
+            const INTG lcol = j + lindices[p];
+            if (lcol >= 0)
+            {
+                dsum -= delems[(p * n) + lcol] * dzvector[lcol];
+            }
+        }
+    }
+    dzvector[j] = dsum * ourprec->dinvdiag[j];
+}
+
+static inline void dbackrow(const ucdsprecond * ourprec, FLPT * dzvector, 
+    const INTG i)
+{
+    INTG p; /* Iteration variable. */
+    const INTG n = ourprec->lmatsize; /* The size of the matrix. */
+    const INTG * lindices = ourprec->ourfactor->ldiagindices;
+    const FLPT * delems = ourprec->ourfactor->ddiagelems;
+    FLPT dsum = 0.0; /* The sum for the row. */
+    if ((ourprec->inumlower == 0) || (i - lindices[0] < n))
+    {
+        for (p = 0; p < ourprec->inumlower; p++) /* No row is past n - 1. */
+        {
+            dsum += delems[(p * n) + i] * dzvector[i - lindices[p]];
+        }
+    }
+    else
+    {
+        for (p = 0; p < ourprec->inumlower; p++)
+        {
+            const INTG lrow = i - lindices[p];
+            if (lrow < n)
+            {
+                dsum += delems[(p * n) + i] * dzvector[lrow];
+            }
+        }
+    }
+    dzvector[i] -= dsum * ourprec->dinvdiag[i];
+}
+
+FLPT * apply_ucdsprecond(const ucdsprecond * ourprec, 
+    const FLPT * drvector, FLPT * dzvector)
+{
+    INTG j; /* Iteration variable. */
+    if ((ourprec == NULL) || (drvector == NULL) || (dzvector == NULL))
+    {
+        return NULL;
+    }
+    const INTG n = ourprec->lmatsize; /* The size of the matrix. */
+    const INTG imaxlevels = (ourprec->inofwdlevels > 
+        ourprec->inobacklevels) ? ourprec->inofwdlevels : 
+        ourprec->inobacklevels;
+    INTG inothreads = 1; /* The threads the levels would be split over. */
+#ifdef _OPENMP
+    inothreads = omp_get_max_threads();
+#endif
+    if ((inothreads < 2) || (n < (imaxlevels * UCDSMINLEVELROWS)))
+    {
+        for (j = 0; j < n; j++)
+        {
+            dfwdrow(ourprec, drvector, dzvector, j);
+        }
+        for (j = n - 1; j >= 0; j--)
+        {
+            dbackrow(ourprec, dzvector, j);
+        }
+        return dzvector;
+    }
+    #pragma omp parallel private(j)
+    {
+        INTG l; /* The level. */
+        for (l = 0; l < ourprec->inofwdlevels; l++)
+        {
+            #pragma omp for schedule(static)
+            for (j = ourprec->lfwdstart[l]; j < ourprec->lfwdstart[l + 1]; 
+                j++)
+            {
+                dfwdrow(ourprec, drvector, dzvector, ourprec->lfwdrows[j]);
+            }
+        }
+        for (l = 0; l < ourprec->inobacklevels; l++)
+        {
+            #pragma omp for schedule(static)
+            for (j = ourprec->lbackstart[l]; j < ourprec->lbackstart[l + 1]; 
+                j++)
+            {
+                dbackrow(ourprec, dzvector, ourprec->lbackrows[j]);
+            }
+        }
+    }
+    return dzvector;
+}
+
+/*
+// The ducdsrowsum function returns row j of the product of ourucds and 
+// dvector, checking each diagonal against the edges of the matrix.
+*/
+
+static inline FLPT ducdsrowsum(const ucds *ourucds, const FLPT *dvector, 
+    const INTG j)
+{
+    INTG i; /* Iteration variable. */
+    INTG lcol; /* The column the diagonal reaches in row j. */
+    FLPT dsum = 0.0; /* The sum for the row. */
+    
+    for (i = 0; i < ourucds->lnumdiag; i++)
+    {
+        lcol = j + ourucds->ldiagindices[i];
+        if ((lcol >= 0) && (lcol < ourucds->lmatsize))
+        {
+            dsum += ducdselem(ourucds, i, lcol) * dvector[lcol];
+        }
+    }
+    return dsum;
+}
+
+/*
+// The ucdsgatherrows function sets dret[j] to row j of the product (as
+// found by ducdsrowsum) for every j in [lfrom, lto). The multiplication
+// functions below only use it for the rows outside [linteriorstart, 
+// linteriorend), so their main loops can run without any bounds tests. 
+// It handles every storage.
+*/
+
+static void ucdsgatherrows(const ucds *ourucds, const FLPT *dvector, 
+    FLPT * dret, const INTG lfrom, const INTG lto)
+{
+    INTG j; /* Iteration variable. */
+    
+    for (j = lfrom; j < lto; j++)
+    {
+        dret[j] = ducdsrowsum(ourucds, dvector, j);
+    }
+}
+
+FLPT * multiply_ucds(const ucds *ourucds, const FLPT *dvector, FLPT * dret)
+{
+    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL) ||
+        (ourucds->istorage != UCDSFULL))
+    {
+        return NULL;
+    }
+    if (bdeterministic)
+    {
+        return multiply_ucdsrow(ourucds, dvector, dret); /* No atomics. */
+    }
+    
+    INTG i, j; /* Iteration variables */
+    INTG lrevindex; /* Current diagonal index to evaluate. */
+    const INTG miniter = ourucds->linteriorstart; /* Rows where every */
+    const INTG maxiter = ourucds->linteriorend; /* diagonal is in range. */
+    const FLPT * ddiag; /* The current diagonal. */
+    
+    doverwritevector(maxiter - miniter, 0.0, &(dret[miniter]));
+    
+    #pragma omp parallel for private(lrevindex, ddiag, j)
+    for (i = 0; i < ourucds->lnumdiag; i++)
+    {
+        lrevindex = ourucds->ldiagindices[i];
+        ddiag = &(ourucds->ddiagelems[i*ourucds->lmatsize]);
+        //#pragma omp parallel for
+        for (j = miniter; j < maxiter; j++)
+        {
+            #pragma omp atomic
+            dret[j] += ddiag[j + lrevindex] * dvector[j + lrevindex];
+        }
+    }
+    ucdsgatherrows(ourucds, dvector, dret, 0, miniter);
+    ucdsgatherrows(ourucds, dvector, dret, maxiter, ourucds->lmatsize);
+    return dret; 
+}
+
+FLPT * multiply_ucdsalt(const ucds *ourucds, const FLPT *dvector, FLPT * dret)
+{
+    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL) ||
+        (ourucds->istorage != UCDSFULL))
+    {
+        return NULL;
+    }
+    
+    INTG i, j; /* Iteration variables */
+    INTG lrevindex; /* Current diagonal index to evaluate. */
+    const INTG miniter = ourucds->linteriorstart; /* Rows where every */
+    const INTG maxiter = ourucds->linteriorend; /* diagonal is in range. */
+    const FLPT * ddiag; /* The current diagonal. */
+    
+    doverwritevector(maxiter - miniter, 0.0, &(dret[miniter]));
+    
+    //#pragma omp parallel for private(lrevindex, ddiag, j)
+    for (i = 0; i < ourucds->lnumdiag; i++)
+    {
+        lrevindex = ourucds->ldiagindices[i];
+        ddiag = &(ourucds->ddiagelems[i*ourucds->lmatsize]);
+        #pragma omp parallel for schedule(static)
+        for (j = miniter; j < maxiter; j++)
+        {
+            dret[j] += ddiag[j + lrevindex] * dvector[j + lrevindex];
+        }
+    }
+    ucdsgatherrows(ourucds, dvector, dret, 0, miniter);
+    ucdsgatherrows(ourucds, dvector, dret, maxiter, ourucds->lmatsize);
+    return dret; 
+}
+
+/*
+// The drowblock function sets rows [lstart, lend) of dret to those of the
+// product of ourucds (with UCDSFULL storage) and dvector. It is called by
+// each thread of a parallel region for its own block of rows.
+*/
+
+static void drowblock(const ucds *ourucds, const FLPT *dvector, 
+    FLPT * dret, const INTG lstart, const INTG lend)
+{
+    const INTG lmatsize = ourucds->lmatsize;
+    const INTG lnumdiag = ourucds->lnumdiag;
+    const INTG * ldiagindices = ourucds->ldiagindices;
+    const FLPT * ddiagelems = ourucds->ddiagelems;
+    INTG i, j; /* Iteration variables */
+    INTG lrevindex; /* Current diagonal index to evaluate. */
+    INTG miniter, maxiter; /* Interior rows of the block. */
+    const FLPT * ddiag; /* The current diagonal. */
+    
+    miniter = min(lend, max(lstart, ourucds->linteriorstart));
+    maxiter = max(miniter, min(lend, ourucds->linteriorend));
+    for (j = miniter; j < maxiter; j++)
+    {
+        dret[j] = 0.0;
+    }
+    for (i = 0; i < lnumdiag; i++)
+    {
+        lrevindex = ldiagindices[i];
+        ddiag = &(ddiagelems[i*lmatsize]);
+        for (j = miniter; j < maxiter; j++)
+        {
+            dret[j] += ddiag[j + lrevindex] * dvector[j + lrevindex];
+        }
+    }
+    ucdsgatherrows(ourucds, dvector, dret, lstart, miniter);
+    ucdsgatherrows(ourucds, dvector, dret, maxiter, lend);
+}
+
+FLPT * multiply_ucdsrow(const ucds *ourucds, const FLPT *dvector, FLPT * dret)
+{
+    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL) ||
+        (ourucds->istorage != UCDSFULL))
+    {
+        return NULL;
+    }
+    
+    #pragma omp parallel
+    {
+        INTG lstart, lend; /* The block of rows this thread owns. */
+        rowblock(ourucds->lmatsize, &lstart, &lend);
+        drowblock(ourucds, dvector, dret, lstart, lend);
+    }
+    return dret; 
+}
+
+/*
+// The dedgedot function returns the part of dvector.dret that comes from
+// rows [lfrom, lto). The fused functions below use it for the boundary
+// rows, which are few.
+*/
+
+static FLPT dedgedot(const FLPT *dvector, const FLPT * dret, 
+    const INTG lfrom, const INTG lto)
+{
+    INTG j; /* Iteration variable. */
+    FLPT dsum = 0.0; /* The result. */
+    for (j = lfrom; j < lto; j++)
+    {
+        dsum += dvector[j] * dret[j];
+    }
+    return dsum;
+}
+
+/*
+// The drowblockdot function sets rows [lstart, lend) of dret to those of
+// the product of ourucds (with UCDSFULL storage) and dvector, and returns
+// the part of dvector.dret from those rows. It is called by each thread
+// of a parallel region for its own block of rows.
+*/
+
+static FLPT drowblockdot(const ucds *ourucds, const FLPT *dvector, 
+    FLPT * dret, const INTG lstart, const INTG lend)
+{
+    const INTG lmatsize = ourucds->lmatsize;
+    const INTG lnumdiag = ourucds->lnumdiag;
+    const INTG * ldiagindices = ourucds->ldiagindices;
+    const FLPT * ddiagelems = ourucds->ddiagelems;
+    FLPT dsum = 0.0; /* The dot product. */
+    INTG i, j; /* Iteration variables */
+    INTG lrevindex; /* Current diagonal index to evaluate. */
+    INTG miniter, maxiter; /* Interior rows of the block. */
+    const FLPT * ddiag; /* The current diagonal. */
+    
+    miniter = min(lend, max(lstart, ourucds->linteriorstart));
+    maxiter = max(miniter, min(lend, ourucds->linteriorend));
+    for (j = miniter; j < maxiter; j++)
+    {
+        dret[j] = 0.0;
+    }
+    for (i = 0; i < lnumdiag - 1; i++)
+    {
+        lrevindex = ldiagindices[i];
+        ddiag = &(ddiagelems[i*lmatsize]);
+        for (j = miniter; j < maxiter; j++)
+        {
+            dret[j] += ddiag[j + lrevindex] * dvector[j + lrevindex];
+        }
+    }
+    
+/* The last diagonal finishes each row, so it is summed in straight away. */        
+    
+    lrevindex = ldiagindices[lnumdiag - 1];
+    ddiag = &(ddiagelems[(lnumdiag - 1)*lmatsize]);
+    for (j = miniter; j < maxiter; j++)
+    {
+        dret[j] += ddiag[j + lrevindex] * dvector[j + lrevindex];
+        dsum += dret[j] * dvector[j];
+    }
+    ucdsgatherrows(ourucds, dvector, dret, lstart, miniter);
+    ucdsgatherrows(ourucds, dvector, dret, maxiter, lend);
+    return dsum + dedgedot(dvector, dret, lstart, miniter) + 
+        dedgedot(dvector, dret, maxiter, lend);
+}
+
+FLPT * multiply_ucdsrowdot(const ucds *ourucds, const FLPT *dvector, 
+    FLPT * dret, FLPT * ddot)
+{
+    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL) ||
+        (ddot == NULL) || (ourucds->istorage != UCDSFULL))
+    {
+        return NULL;
+    }
+    
+/* The per-thread sums below depend on the threads, so they are not used. */    
+    
+    if (bdeterministic)
+    {
+        multiply_ucdsrow(ourucds, dvector, dret);
+        *ddot = ddotprod(ourucds->lmatsize, dvector, dret);
+        return dret;
+    }
+
+    FLPT dsum = 0.0; /* The dot product. */
+    
+    #pragma omp parallel reduction(+:dsum)
+    {
+        INTG lstart, lend; /* The block of rows this thread owns. */
+        rowblock(ourucds->lmatsize, &lstart, &lend);
+        dsum += drowblockdot(ourucds, dvector, dret, lstart, lend);
+    }
+    *ddot = dsum;
+    return dret; 
+}
+
+/*
+// The dpowerrows function sets rows [lfrom, lto) of the ipower-th vector
+// of dpowers to those of dscale times the product of ourucds and the
+// vector before it.
+*/
+
+static inline void dpowerrows(const ucds *ourucds, FLPT * dpowers, 
+    const INTG ipower, const FLPT dscale, const INTG lfrom, const INTG lto)
+{
+    INTG j; /* Iteration variable. */
+    FLPT * dret = &(dpowers[ipower * ourucds->lmatsize]);
+    if (lfrom >= lto)
+    {
+        return;
+    }
+    drowblock(ourucds, &(dpowers[(ipower - 1) * ourucds->lmatsize]), 
+        dret, lfrom, lto);
+    if (dscale != 1.0)
+    {
+        #pragma omp simd
+        for (j = lfrom; j < lto; j++)
+        {
+            dret[j] *= dscale;
+        }
+    }
+}
+
+FLPT * matpowers_ucds(const ucds *ourucds, const FLPT *dvector, 
+    const INTG ipowers, const FLPT dscale, FLPT * dpowers)
+{
+    if ((ourucds == NULL) || (dvector == NULL) || (dpowers == NULL) || 
+        (ipowers < 0) || (ipowers > UCDSMAXPOWERS) || 
+        (ourucds->istorage != UCDSFULL))
+    {
+        return NULL;
+    }
+    const INTG lmatsize = ourucds->lmatsize;
+    const INTG lnumdiag = ourucds->lnumdiag;
+    const INTG lbelow = max(0, -ourucds->ldiagindices[0]); /* The halo. */
+    const INTG labove = max(0, ourucds->ldiagindices[lnumdiag - 1]);
+    const INTG ltile = max(UCDSMINTILE, icachesize(2) / 
+        (INTG) (sizeof(FLPT) * (lnumdiag + ipowers + 1)));
+    dveccopy(lmatsize, dpowers, dvector);
+    if (ipowers == 0)
+    {
+        return dpowers;
+    }
+    
+/*
+// Each thread works on the rows that rowblock gives it. Row j of power k
+// needs rows j - lbelow to j + labove of power k - 1, so within its own 
+// block a thread can work out rows [lstart + k.lbelow, lend - k.labove)
+// of power k without the others. It does these in tiles, with each power
+// lagging the one before by labove rows, so that a tile of every power 
+// is worked out while the rows it needs are still in cache. Then the
+// rows left at the edges of the blocks are done one power at a time, 
+// with a barrier before each.
+*/
+    
+    #pragma omp parallel
+    {
+        INTG k; /* The power. */
+        INTG lstart, lend; /* The block of rows of this thread. */
+        INTG ldone[UCDSMAXPOWERS + 1]; /* The next row of each power. */
+        INTG ledge, ltileend; /* The ends of the tile of power 1. */
+        rowblock(lmatsize, &lstart, &lend);
+        for (k = 1; k <= ipowers; k++)
+        {
+            ldone[k] = min(lend, lstart + k * lbelow);
+        }
+        for (ltileend = lstart; ltileend < lend; ltileend += ltile)
+        {
+            ledge = min(lend, ltileend + ltile);
+            for (k = 1; k <= ipowers; k++)
+            {
+                const INTG lupper = max(ldone[k], min(lend - k * labove, 
+                    ledge - (k - 1) * labove));
+                dpowerrows(ourucds, dpowers, k, dscale, ldone[k], lupper);
+                ldone[k] = lupper;
+            }
+        }
+        for (k = 1; k <= ipowers; k++)
+        {
+            #pragma omp barrier
+            dpowerrows(ourucds, dpowers, k, dscale, lstart, 
+                min(lend, lstart + k * lbelow));
+            dpowerrows(ourucds, dpowers, k, dscale, max(ldone[k], 
+                min(lend, lstart + k * lbelow)), lend);
+        }
+    }
+    return dpowers;
+}
+
+/*
+// UCDSNARROWKERNEL(NAME, STORAGE, TYPE, ELEMS, WIDEN) writes out a copy of
+// multiply_ucdsrow for narrow storage, where the elements are TYPEs in
+// ourucds->ELEMS and WIDEN turns one into a FLPT.
+*/
+
+#define UCDSNARROWKERNEL(NAME, STORAGE, TYPE, ELEMS, WIDEN) \
+FLPT * NAME(const ucds *ourucds, const FLPT *dvector, FLPT * dret) \
+{ \
+    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL) || \
+        (ourucds->istorage != STORAGE)) \
+    { \
+        return NULL; \
+    } \
+    const INTG lmatsize = ourucds->lmatsize; \
+    const INTG lnumdiag = ourucds->lnumdiag; \
+    const INTG * ldiagindices = ourucds->ldiagindices; \
+    const TYPE * pdiagelems = ourucds->ELEMS; \
+    _Pragma("omp parallel") \
+    { \
+        INTG i, j; /* Iteration variables */ \
+        INTG lrevindex; /* Current diagonal index to evaluate. */ \
+        INTG lstart, lend; /* The block of rows this thread owns. */ \
+        INTG miniter, maxiter; /* Interior rows of the block. */ \
+        const TYPE * pdiag; /* The current diagonal. */ \
+        rowblock(lmatsize, &lstart, &lend); \
+        miniter = min(lend, max(lstart, ourucds->linteriorstart)); \
+        maxiter = max(miniter, min(lend, ourucds->linteriorend)); \
+        for (j = miniter; j < maxiter; j++) \
+        { \
+            dret[j] = 0.0; \
+        } \
+        for (i = 0; i < lnumdiag; i++) \
+        { \
+            lrevindex = ldiagindices[i]; \
+            pdiag = &(pdiagelems[i*lmatsize]); \
+            for (j = miniter; j < maxiter; j++) \
+            { \
+                dret[j] += WIDEN(pdiag[j + lrevindex]) * \
+                    dvector[j + lrevindex]; \
+            } \
+        } \
+        ucdsgatherrows(ourucds, dvector, dret, lstart, miniter); \
+        ucdsgatherrows(ourucds, dvector, dret, maxiter, lend); \
+    } \
+    return dret; \
+}
+
+#define UCDSWIDENSINGLE(X) ((FLPT) (X))
+#define UCDSWIDENBF16(X) ((FLPT) fbf16(X))
+
+UCDSNARROWKERNEL(multiply_ucdssingle, UCDSSINGLE, float, fdiagelems, 
+    UCDSWIDENSINGLE)
+UCDSNARROWKERNEL(multiply_ucdsbf16, UCDSBF16, uint16_t, udiagelems, 
+    UCDSWIDENBF16)
+
+FLPT * multiply_ucds27(const ucds *ourucds, const FLPT *dvector, FLPT * dret)
+{
+    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL) ||
+        (ourucds->istorage != UCDSFULL))
+    {
+        return NULL;
+    }
+    if (bdeterministic)
+    {
+        return multiply_ucdsrow(ourucds, dvector, dret); /* No atomics. */
+    }
+
+    const INTG idiagnum = LARGEDIAG;
+    INTG i, j; /* Iteration variables */
+    INTG lrevindex; /* Current diagonal index to evaluate. */
+    const INTG miniter = ourucds->linteriorstart; /* Rows where every */
+    const INTG maxiter = ourucds->linteriorend; /* diagonal is in range. */
+    const FLPT * ddiag; /* The current diagonal. */
+    
+    doverwritevector(maxiter - miniter, 0.0, &(dret[miniter]));
+    
+    #pragma omp parallel for private(lrevindex, ddiag, j)
+    for (i = 0; i < idiagnum; i++)
+    {
+        lrevindex = ourucds->ldiagindices[i];
+        ddiag = &(ourucds->ddiagelems[i*ourucds->lmatsize]);
+        //#pragma omp parallel for
+        for (j = miniter; j < maxiter; j++)
+        {
+            #pragma omp atomic
+            dret[j] += ddiag[j + lrevindex] * dvector[j + lrevindex];
+        }
+    }
+    ucdsgatherrows(ourucds, dvector, dret, 0, miniter);
+    ucdsgatherrows(ourucds, dvector, dret, maxiter, ourucds->lmatsize);
+    return dret; 
+}
+
+FLPT * multiply_ucdsalt27(const ucds *ourucds, const FLPT *dvector, FLPT * dret)
+{
+    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL) ||
+        (ourucds->istorage != UCDSFULL))
+    {
+        return NULL;
+    }
+
+    const INTG idiagnum = LARGEDIAG;
+    INTG i, j; /* Iteration variables */
+    INTG lrevindex; /* Current diagonal index to evaluate. */
+    const INTG miniter = ourucds->linteriorstart; /* Rows where every */
+    const INTG maxiter = ourucds->linteriorend; /* diagonal is in range. */
+    const FLPT * ddiag; /* The current diagonal. */
+    
+    doverwritevector(maxiter - miniter, 0.0, &(dret[miniter]));
+    
+    //#pragma omp parallel for private(lrevindex, ddiag, j)
+    for (i = 0; i < idiagnum; i++)
+    {
+        lrevindex = ourucds->ldiagindices[i];
+        ddiag = &(ourucds->ddiagelems[i*ourucds->lmatsize]);
+        #pragma omp parallel for schedule(static)
+        for (j = miniter; j < maxiter; j++)
+        {
+            dret[j] += ddiag[j + lrevindex] * dvector[j + lrevindex];
+        }
+    }
+    ucdsgatherrows(ourucds, dvector, dret, 0, miniter);
+    ucdsgatherrows(ourucds, dvector, dret, maxiter, ourucds->lmatsize);
+    return dret; 
+}
+
+FLPT * multiply_ucds5(const ucds *ourucds, const FLPT *dvector, FLPT * dret)
+{
+    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL) ||
+        (ourucds->istorage != UCDSFULL))
+    {
+        return NULL;
+    }
+    if (bdeterministic)
+    {
+        return multiply_ucdsrow(ourucds, dvector, dret); /* No atomics. */
+    }
+
+    const INTG idiagnum = MIDDIAG;
+    INTG i, j; /* Iteration variables */
+    INTG lrevindex; /* Current diagonal index to evaluate. */
+    const INTG miniter = ourucds->linteriorstart; /* Rows where every */
+    const INTG maxiter = ourucds->linteriorend; /* diagonal is in range. */
+    const FLPT * ddiag; /* The current diagonal. */
+    
+    doverwritevector(maxiter - miniter, 0.0, &(dret[miniter]));
+    
+    #pragma omp parallel for private(lrevindex, ddiag, j)
+    for (i = 0; i < idiagnum; i++)
+    {
+        lrevindex = ourucds->ldiagindices[i];
+        ddiag = &(ourucds->ddiagelems[i*ourucds->lmatsize]);
+        //#pragma omp parallel for
+        for (j = miniter; j < maxiter; j++)
+        {
+            #pragma omp atomic
+            dret[j] += ddiag[j + lrevindex] * dvector[j + lrevindex];
+        }
+    }
+    ucdsgatherrows(ourucds, dvector, dret, 0, miniter);
+    ucdsgatherrows(ourucds, dvector, dret, maxiter, ourucds->lmatsize);
+    return dret; 
+}
+
+FLPT * multiply_ucdsalt5(const ucds *ourucds, const FLPT *dvector, FLPT * dret)
+{
+    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL) ||
+        (ourucds->istorage != UCDSFULL))
+    {
+        return NULL;
+    }
+
+    const INTG idiagnum = MIDDIAG;
+    INTG i, j; /* Iteration variables */
+    INTG lrevindex; /* Current diagonal index to evaluate. */
+    const INTG miniter = ourucds->linteriorstart; /* Rows where every */
+    const INTG maxiter = ourucds->linteriorend; /* diagonal is in range. */
+    const FLPT * ddiag; /* The current diagonal. */
+    
+    doverwritevector(maxiter - miniter, 0.0, &(dret[miniter]));
+    
+    //#pragma omp parallel for private(lrevindex, ddiag, j)
+    for (i = 0; i < idiagnum; i++)
+    {
+        lrevindex = ourucds->ldiagindices[i];
+        ddiag = &(ourucds->ddiagelems[i*ourucds->lmatsize]);
+        #pragma omp parallel for schedule(static)
+        for (j = miniter; j < maxiter; j++)
+        {
+            dret[j] += ddiag[j + lrevindex] * dvector[j + lrevindex];
+        }
+    }
+    ucdsgatherrows(ourucds, dvector, dret, 0, miniter);
+    ucdsgatherrows(ourucds, dvector, dret, maxiter, ourucds->lmatsize);
+    return dret; 
+}
+
+FLPT * multiply_ucdsd27(const ucds *ourucds, const FLPT *dvector, FLPT * dret)
+{
+    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL) ||
+        (ourucds->istorage != UCDSFULL))
+    {
+        return NULL;
+    }
+    if (bdeterministic)
+    {
+        return multiply_ucdsrow(ourucds, dvector, dret); /* No atomics. */
+    }
+
+//    const INTG idiagnum = LARGEDIAG;
+    INTG i, j; /* Iteration variables */
+    INTG lrevindex; /* Current diagonal index to evaluate. */
+    const INTG miniter = ourucds->linteriorstart; /* Rows where every */
+    const INTG maxiter = ourucds->linteriorend; /* diagonal is in range. */
+    const FLPT * ddiag; /* The current diagonal. */
+    
+    doverwritevector(maxiter - miniter, 0.0, &(dret[miniter]));
+    
+    #pragma omp parallel for private(lrevindex, ddiag, j)
+    for (i = 0; i < LARGEDIAG; i++)
+    {
+        lrevindex = ourucds->ldiagindices[i];
+        ddiag = &(ourucds->ddiagelems[i*ourucds->lmatsize]);
+        //#pragma omp parallel for
+        for (j = miniter; j < maxiter; j++)
+        {
+            #pragma omp atomic
+            dret[j] += ddiag[j + lrevindex] * dvector[j + lrevindex];
+        }
+    }
+    ucdsgatherrows(ourucds, dvector, dret, 0, miniter);
+    ucdsgatherrows(ourucds, dvector, dret, maxiter, ourucds->lmatsize);
+    return dret; 
+}
+
+FLPT * multiply_ucdsaltd27(const ucds *ourucds, const FLPT *dvector, FLPT * dret)
+{
+    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL) ||
+        (ourucds->istorage != UCDSFULL))
+    {
+        return NULL;
+    }
+
+//    const INTG idiagnum = LARGEDIAG;
+    INTG i, j; /* Iteration variables */
+    INTG lrevindex; /* Current diagonal index to evaluate. */
+    const INTG miniter = ourucds->linteriorstart; /* Rows where every */
+    const INTG maxiter = ourucds->linteriorend; /* diagonal is in range. */
+    const FLPT * ddiag; /* The current diagonal. */
+    
+    doverwritevector(maxiter - miniter, 0.0, &(dret[miniter]));
+    
+    //#pragma omp parallel for private(lrevindex, ddiag, j)
+    for (i = 0; i < LARGEDIAG; i++)
+    {
+        lrevindex = ourucds->ldiagindices[i];
+        ddiag = &(ourucds->ddiagelems[i*ourucds->lmatsize]);
+        #pragma omp parallel for schedule(static)
+        for (j = miniter; j < maxiter; j++)
+        {
+            dret[j] += ddiag[j + lrevindex] * dvector[j + lrevindex];
+        }
+    }
+    ucdsgatherrows(ourucds, dvector, dret, 0, miniter);
+    ucdsgatherrows(ourucds, dvector, dret, maxiter, ourucds->lmatsize);
+    return dret; 
+}
+
+FLPT * multiply_ucdsd5(const ucds *ourucds, const FLPT *dvector, FLPT * dret)
+{
+    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL) ||
+        (ourucds->istorage != UCDSFULL))
+    {
+        return NULL;
+    }
+    if (bdeterministic)
+    {
+        return multiply_ucdsrow(ourucds, dvector, dret); /* No atomics. */
+    }
+
+//    const INTG idiagnum = MIDDIAG;
+    INTG i, j; /* Iteration variables */
+    INTG lrevindex; /* Current diagonal index to evaluate. */
+    const INTG miniter = ourucds->linteriorstart; /* Rows where every */
+    const INTG maxiter = ourucds->linteriorend; /* diagonal is in range. */
+    const FLPT * ddiag; /* The current diagonal. */
+    
+    doverwritevector(maxiter - miniter, 0.0, &(dret[miniter]));
+    
+    #pragma omp parallel for private(lrevindex, ddiag, j)
+    for (i = 0; i < MIDDIAG; i++)
+    {
+        lrevindex = ourucds->ldiagindices[i];
+        ddiag = &(ourucds->ddiagelems[i*ourucds->lmatsize]);
+        //#pragma omp parallel for
+        for (j = miniter; j < maxiter; j++)
+        {
+            #pragma omp atomic
+            dret[j] += ddiag[j + lrevindex] * dvector[j + lrevindex];
+        }
+    }
+    ucdsgatherrows(ourucds, dvector, dret, 0, miniter);
+    ucdsgatherrows(ourucds, dvector, dret, maxiter, ourucds->lmatsize);
+    return dret; 
+}
+
+FLPT * multiply_ucdsaltd5(const ucds *ourucds, const FLPT *dvector, FLPT * dret)
+{
+    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL) ||
+        (ourucds->istorage != UCDSFULL))
+    {
+        return NULL;
+    }
+
+//    const INTG idiagnum = MIDDIAG;
+    INTG i, j; /* Iteration variables */
+    INTG lrevindex; /* Current diagonal index to evaluate. */
+    const INTG miniter = ourucds->linteriorstart; /* Rows where every */
+    const INTG maxiter = ourucds->linteriorend; /* diagonal is in range. */
+    const FLPT * ddiag; /* The current diagonal. */
+    
+    doverwritevector(maxiter - miniter, 0.0, &(dret[miniter]));
+    
+    //#pragma omp parallel for private(lrevindex, ddiag, j)
+    for (i = 0; i < MIDDIAG; i++)
+    {
+        lrevindex = ourucds->ldiagindices[i];
+        ddiag = &(ourucds->ddiagelems[i*ourucds->lmatsize]);
+        #pragma omp parallel for schedule(static)
+        for (j = miniter; j < maxiter; j++)
+        {
+            dret[j] += ddiag[j + lrevindex] * dvector[j + lrevindex];
+        }
+    }
+    ucdsgatherrows(ourucds, dvector, dret, 0, miniter);
+    ucdsgatherrows(ourucds, dvector, dret, maxiter, ourucds->lmatsize);
+    return dret; 
+}
+
+/*
+// The explicit SIMD kernels. Each one works on the interior rows a vector
+// at a time: a register holds dret[j .. j + width - 1], and every diagonal
+// is added to it with one load from the diagonal and one from dvector.
+// Four vectors are kept in flight so the adds of one diagonal do not wait
+// on each other. Rows left over at the end of the interior, and the
+// boundary rows, go through ucdsgatherrows. The instruction set is chosen
+// with gcc's target attribute, so the rest of the file does not need
+// -mavx2 and so on, and each kernel checks the CPU before it runs.
+*/
+
+#define UCDSCPUNONE 0
+#define UCDSCPUSSE 1
+#define UCDSCPUAVX2 2
+#define UCDSCPUAVX512 3
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#include <immintrin.h>
+
+/* This probes CPUID the first time it is called and remembers the answer. */
+
+static INTG ucdscpulevel(void)
+{
+    static INTG icpulevel = -1; /* Not yet probed. */
+    if (icpulevel < 0)
+    {
+        INTG ilevel = UCDSCPUNONE; /* What we find. */
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse2"))
+        {
+            ilevel = UCDSCPUSSE;
+        }
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        {
+            ilevel = UCDSCPUAVX2;
+        }
+        if (__builtin_cpu_supports("avx512f"))
+        {
+            ilevel = UCDSCPUAVX512;
+        }
+        icpulevel = ilevel;
+    }
+    return icpulevel;
+}
+
+/* 
+// These map the vector operations onto the intrinsics for FLPT. SSE has
+// no fused multiply-add, so it multiplies and adds separately.
+*/
+
+#ifdef BIGFLOAT
+    #define SSEVECT __m128d
+    #define SSEWIDTH 2
+    #define SSEZERO() _mm_setzero_pd()
+    #define SSELOAD(p) _mm_loadu_pd(p)
+    #define SSESTORE(p, v) _mm_storeu_pd((p), (v))
+    #define SSEFMA(a, b, c) _mm_add_pd(_mm_mul_pd((a), (b)), (c))
+    #define AVX2VECT __m256d
+    #define AVX2WIDTH 4
+    #define AVX2ZERO() _mm256_setzero_pd()
+    #define AVX2LOAD(p) _mm256_loadu_pd(p)
+    #define AVX2STORE(p, v) _mm256_storeu_pd((p), (v))
+    #define AVX2FMA(a, b, c) _mm256_fmadd_pd((a), (b), (c))
+    #define AVX512VECT __m512d
+    #define AVX512WIDTH 8
+    #define AVX512ZERO() _mm512_setzero_pd()
+    #define AVX512LOAD(p) _mm512_loadu_pd(p)
+    #define AVX512STORE(p, v) _mm512_storeu_pd((p), (v))
+    #define AVX512FMA(a, b, c) _mm512_fmadd_pd((a), (b), (c))
+#else
+    #define SSEVECT __m128
+    #define SSEWIDTH 4
+    #define SSEZERO() _mm_setzero_ps()
+    #define SSELOAD(p) _mm_loadu_ps(p)
+    #define SSESTORE(p, v) _mm_storeu_ps((p), (v))
+    #define SSEFMA(a, b, c) _mm_add_ps(_mm_mul_ps((a), (b)), (c))
+    #define AVX2VECT __m256
+    #define AVX2WIDTH 8
+    #define AVX2ZERO() _mm256_setzero_ps()
+    #define AVX2LOAD(p) _mm256_loadu_ps(p)
+    #define AVX2STORE(p, v) _mm256_storeu_ps((p), (v))
+    #define AVX2FMA(a, b, c) _mm256_fmadd_ps((a), (b), (c))
+    #define AVX512VECT __m512
+    #define AVX512WIDTH 16
+    #define AVX512ZERO() _mm512_setzero_ps()
+    #define AVX512LOAD(p) _mm512_loadu_ps(p)
+    #define AVX512STORE(p, v) _mm512_storeu_ps((p), (v))
+    #define AVX512FMA(a, b, c) _mm512_fmadd_ps((a), (b), (c))
+#endif
+
+/* 
+// UCDSSIMDKERNEL writes out one kernel. NAME is the function, TARGET the
+// gcc target string, LEVEL the ucdscpulevel it needs and ISA the prefix
+// of the operation macros above.
+*/
+
+#define UCDSSIMDKERNEL(NAME, TARGET, LEVEL, ISA) \
+__attribute__((target(TARGET))) \
+FLPT * NAME(const ucds *ourucds, const FLPT *dvector, FLPT * dret) \
+{ \
+    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL) || \
+        (ourucds->istorage != UCDSFULL) || (ucdscpulevel() < LEVEL)) \
+    { \
+        return NULL; \
+    } \
+    const INTG lmatsize = ourucds->lmatsize; \
+    const INTG lnumdiag = ourucds->lnumdiag; \
+    const INTG * ldiagindices = ourucds->ldiagindices; \
+    const FLPT * ddiagelems = ourucds->ddiagelems; \
+    const INTG miniter = ourucds->linteriorstart; \
+    const INTG lnovects = (ourucds->linteriorend - miniter) / ISA##WIDTH; \
+    const INTG lnoquads = lnovects / 4; \
+    const INTG maxiter = miniter + (lnovects * ISA##WIDTH); \
+    INTG i, j; \
+    _Pragma("omp parallel for private(i) schedule(static)") \
+    for (j = 0; j < lnoquads; j++) \
+    { \
+        INTG lrow = miniter + (j * 4 * ISA##WIDTH); \
+        INTG loff; \
+        ISA##VECT dacc0 = ISA##ZERO(); \
+        ISA##VECT dacc1 = ISA##ZERO(); \
+        ISA##VECT dacc2 = ISA##ZERO(); \
+        ISA##VECT dacc3 = ISA##ZERO(); \
+        for (i = 0; i < lnumdiag; i++) \
+        { \
+            loff = lrow + ldiagindices[i]; \
+            const FLPT * ddiag = &(ddiagelems[i*lmatsize + loff]); \
+            const FLPT * dvect = &(dvector[loff]); \
+            dacc0 = ISA##FMA(ISA##LOAD(ddiag), ISA##LOAD(dvect), dacc0); \
+            dacc1 = ISA##FMA(ISA##LOAD(ddiag + ISA##WIDTH), \
+                ISA##LOAD(dvect + ISA##WIDTH), dacc1); \
+            dacc2 = ISA##FMA(ISA##LOAD(ddiag + 2 * ISA##WIDTH), \
+                ISA##LOAD(dvect + 2 * ISA##WIDTH), dacc2); \
+            dacc3 = ISA##FMA(ISA##LOAD(ddiag + 3 * ISA##WIDTH), \
+                ISA##LOAD(dvect + 3 * ISA##WIDTH), dacc3); \
+        } \
+        ISA##STORE(&(dret[lrow]), dacc0); \
+        ISA##STORE(&(dret[lrow + ISA##WIDTH]), dacc1); \
+        ISA##STORE(&(dret[lrow + 2 * ISA##WIDTH]), dacc2); \
+        ISA##STORE(&(dret[lrow + 3 * ISA##WIDTH]), dacc3); \
+    } \
+    for (j = lnoquads * 4; j < lnovects; j++) \
+    { \
+        INTG lrow = miniter + (j * ISA##WIDTH); \
+        INTG loff; \
+        ISA##VECT dacc0 = ISA##ZERO(); \
+        for (i = 0; i < lnumdiag; i++) \
+        { \
+            loff = lrow + ldiagindices[i]; \
+            dacc0 = ISA##FMA(ISA##LOAD(&(ddiagelems[i*lmatsize + loff])), \
+                ISA##LOAD(&(dvector[loff])), dacc0); \
+        } \
+        ISA##STORE(&(dret[lrow]), dacc0); \
+    } \
+    ucdsgatherrows(ourucds, dvector, dret, 0, miniter); \
+    ucdsgatherrows(ourucds, dvector, dret, maxiter, lmatsize); \
+    return dret; \
+}
+
+UCDSSIMDKERNEL(multiply_ucdssse, "sse2", UCDSCPUSSE, SSE)
+UCDSSIMDKERNEL(multiply_ucdsavx2, "avx2,fma", UCDSCPUAVX2, AVX2)
+UCDSSIMDKERNEL(multiply_ucdsavx512, "avx512f", UCDSCPUAVX512, AVX512)
+
+#else /* Not x86, so there are no SIMD kernels to run. */
+
+static INTG ucdscpulevel(void)
+{
+    return UCDSCPUNONE;
+}
+
+FLPT * multiply_ucdssse(const ucds *ourucds, const FLPT *dvector, FLPT * dret)
+{
+    return NULL;
+}
+
+FLPT * multiply_ucdsavx2(const ucds *ourucds, const FLPT *dvector, FLPT * dret)
+{
+    return NULL;
+}
+
+FLPT * multiply_ucdsavx512(const ucds *ourucds, const FLPT *dvector, 
+    FLPT * dret)
+{
+    return NULL;
+}
+
+#endif
+
+fpmult best_multiply_ucds(void)
+{
+    switch (ucdscpulevel())
+    {
+        case UCDSCPUAVX512:
+            return &multiply_ucdsavx512;
+        case UCDSCPUAVX2:
+            return &multiply_ucdsavx2;
+        case UCDSCPUSSE:
+            return &multiply_ucdssse;
+        default:
+            return &multiply_ucdsrow;
+    }
+}
+
+/*
+// The ucdstilesize function works out how many rows multiply_ucdstiled 
+// should do at a time. A tile of rows touches dvector from the tile's 
+// first row plus the lowest diagonal index to its last row plus the 
+// highest, and that window (with the tile of dret) should stay in cache
+// while each diagonal passes over it. Half of L2 is used if the window
+// fits there; otherwise it is each thread's share of L3.
+*/
+
+static INTG ucdstilesize(const ucds *ourucds)
+{
+    const INTG lspan = ourucds->ldiagindices[ourucds->lnumdiag - 1] - 
+        ourucds->ldiagindices[0]; /* Width of the band of diagonals. */
+    INTG inothreads = 1; /* Threads sharing the L3 cache. */
+    INTG lbudget; /* Elements of dvector and dret that fit in cache. */
+    INTG ltile; /* The tile size. */
+#ifdef _OPENMP
+    inothreads = omp_get_max_threads();
+#endif
+    lbudget = icachesize(2) / (2 * sizeof(FLPT));
+    ltile = (lbudget - lspan) / 2;
+    if (ltile < UCDSMINTILE)
+    {
+        lbudget = icachesize(3) / (2 * sizeof(FLPT) * inothreads);
+        ltile = (lbudget - lspan) / 2;
+    }
+    
+/* Keep every thread busy, even if that means tiles shrink a bit. */    
+    
+    ltile = min(ltile, (ourucds->linteriorend - ourucds->linteriorstart + 
+        inothreads - 1) / inothreads);
+    return max(UCDSMINTILE, ltile);
+}
+
+/*
+// The ucdsaddfour function adds diagonals ifirst to ifirst + 3 to rows
+// [lfrom, lto) of dret, which must all be interior rows. Doing four at a
+// time means dret is loaded and stored once for every four diagonals.
+*/
+
+static void ucdsaddfour(const ucds *ourucds, const INTG ifirst, 
+    const FLPT *dvector, FLPT * dret, const INTG lfrom, const INTG lto)
+{
+    const INTG lmatsize = ourucds->lmatsize;
+    const INTG * ldiagindices = &(ourucds->ldiagindices[ifirst]);
+    const FLPT * ddiag0 = &(ourucds->ddiagelems[ifirst*lmatsize]);
+    const FLPT * ddiag1 = ddiag0 + lmatsize;
+    const FLPT * ddiag2 = ddiag1 + lmatsize;
+    const FLPT * ddiag3 = ddiag2 + lmatsize;
+    const INTG loff0 = ldiagindices[0], loff1 = ldiagindices[1];
+    const INTG loff2 = ldiagindices[2], loff3 = ldiagindices[3];
+    INTG j; /* Iteration variable. */
+    #pragma GCC ivdep
+    for (j = lfrom; j < lto; j++)
+    {
+        dret[j] += (ddiag0[j + loff0] * dvector[j + loff0]) + 
+            (ddiag1[j + loff1] * dvector[j + loff1]) +
+            (ddiag2[j + loff2] * dvector[j + loff2]) + 
+            (ddiag3[j + loff3] * dvector[j + loff3]);
+    }
+}
+
+/*
+// The ducdstiled function does the work of multiply_ucdstiled and
+// multiply_ucdstileddot. If bdot is true, each piece of dret is also
+// multiplied into dvector while it is still in the L1 cache, and the
+// function returns the dot product (and 0 otherwise).
+*/
+
+static FLPT ducdstiled(const ucds *ourucds, const FLPT *dvector, 
+    FLPT * dret, const INTG bdot)
+{
+    const INTG lmatsize = ourucds->lmatsize;
+    const INTG lnumdiag = ourucds->lnumdiag;
+    const INTG * ldiagindices = ourucds->ldiagindices;
+    const FLPT * ddiagelems = ourucds->ddiagelems;
+    const INTG miniter = ourucds->linteriorstart;
+    const INTG maxiter = ourucds->linteriorend;
+    const INTG ltile = ucdstilesize(ourucds);
+    const INTG lnotiles = (maxiter - miniter + ltile - 1) / ltile;
+    
+/* 
+// Within a tile, rows are done in pieces that keep their part of dret in
+// the L1 cache while the diagonals are added to it.
+*/    
+    
+    const INTG lsubtile = max(UCDSCONSTTILE, icachesize(1) / 
+        (4 * sizeof(FLPT)));
+    INTG i, j, k; /* Iteration variables */
+    INTG lrow, lrowend; /* The rows in the tile. */
+    INTG lsub, lsubend; /* The rows in the piece of the tile. */
+    INTG lrevindex; /* Current diagonal index to evaluate. */
+    const FLPT * ddiag; /* The current diagonal. */
+    FLPT dsum = 0.0; /* The dot product. */
+    
+    #pragma omp parallel for private(i, j, lrow, lrowend, lsub, lsubend, \
+        lrevindex, ddiag) reduction(+:dsum) schedule(static)
+    for (k = 0; k < lnotiles; k++)
+    {
+        lrow = miniter + (k * ltile);
+        lrowend = min(maxiter, lrow + ltile);
+        for (lsub = lrow; lsub < lrowend; lsub += lsubtile)
+        {
+            lsubend = min(lrowend, lsub + lsubtile);
+            for (j = lsub; j < lsubend; j++)
+            {
+                dret[j] = 0.0;
+            }
+            for (i = 0; i + 3 < lnumdiag; i += 4)
+            {
+                ucdsaddfour(ourucds, i, dvector, dret, lsub, lsubend);
+            }
+            for (; i < lnumdiag; i++)
+            {
+                lrevindex = ldiagindices[i];
+                ddiag = &(ddiagelems[i*lmatsize]);
+                for (j = lsub; j < lsubend; j++)
+                {
+                    dret[j] += ddiag[j + lrevindex] * dvector[j + lrevindex];
+                }
+            }
+            if (bdot)
+            {
+                for (j = lsub; j < lsubend; j++)
+                {
+                    dsum += dret[j] * dvector[j];
+                }
+            }
+        }
+    }
+    ucdsgatherrows(ourucds, dvector, dret, 0, miniter);
+    ucdsgatherrows(ourucds, dvector, dret, maxiter, lmatsize);
+    if (bdot)
+    {
+        dsum += dedgedot(dvector, dret, 0, miniter) + 
+            dedgedot(dvector, dret, maxiter, lmatsize);
+    }
+    return dsum; 
+}
+
+FLPT * multiply_ucdstiled(const ucds *ourucds, const FLPT *dvector, 
+    FLPT * dret)
+{
+    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL) ||
+        (ourucds->istorage != UCDSFULL))
+    {
+        return NULL;
+    }
+    ducdstiled(ourucds, dvector, dret, 0);
+    return dret;
+}
+
+FLPT * multiply_ucdstileddot(const ucds *ourucds, const FLPT *dvector, 
+    FLPT * dret, FLPT * ddot)
+{
+    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL) ||
+        (ddot == NULL) || (ourucds->istorage != UCDSFULL))
+    {
+        return NULL;
+    }
+    if (bdeterministic)
+    {
+        ducdstiled(ourucds, dvector, dret, 0);
+        *ddot = ddotprod(ourucds->lmatsize, dvector, dret);
+        return dret;
+    }
+    *ddot = ducdstiled(ourucds, dvector, dret, 1);
+    return dret;
+}
+
+FLPT * multiply_ucdsconst(const ucds *ourucds, const FLPT *dvector, 
+    FLPT * dret)
+{
+    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL) ||
+        (ourucds->istorage != UCDSCONST))
+    {
+        return NULL;
+    }
+
+    const INTG lmatsize = ourucds->lmatsize;
+    const INTG lnumdiag = ourucds->lnumdiag;
+    const INTG * ldiagindices = ourucds->ldiagindices;
+    const FLPT * dcoeffs = ourucds->ddiagelems;
+    const INTG miniter = ourucds->linteriorstart;
+    const INTG maxiter = ourucds->linteriorend;
+    const INTG lnotiles = (maxiter - miniter + UCDSCONSTTILE - 1) / 
+        UCDSCONSTTILE;
+    INTG i, j, k; /* Iteration variables */
+    INTG lrow, lrowend; /* The rows in the tile. */
+    INTG lrevindex; /* Current diagonal index to evaluate. */
+    FLPT dcoeff; /* The coefficient of the current diagonal. */
+    
+/* 
+// The interior is done a tile at a time, so the piece of dret being
+// summed into stays in the L1 cache while every diagonal is added.
+*/    
+    
+    #pragma omp parallel for private(i, j, lrow, lrowend, lrevindex, dcoeff) \
+        schedule(static)
+    for (k = 0; k < lnotiles; k++)
+    {
+        lrow = miniter + (k * UCDSCONSTTILE);
+        lrowend = min(maxiter, lrow + UCDSCONSTTILE);
+        for (j = lrow; j < lrowend; j++)
+        {
+            dret[j] = 0.0;
+        }
+        for (i = 0; i < lnumdiag; i++)
+        {
+            dcoeff = dcoeffs[i];
+            lrevindex = ldiagindices[i];
+            for (j = lrow; j < lrowend; j++)
+            {
+                dret[j] += dcoeff * dvector[j + lrevindex];
+            }
+        }
+    }
+    
+    ucdsgatherrows(ourucds, dvector, dret, 0, miniter);
+    ucdsgatherrows(ourucds, dvector, dret, maxiter, lmatsize);
+    return dret; 
+}
+
+/*
+// The fixed diagonal count kernels. UCDSFIXEDKERNEL writes out a kernel
+// for exactly N diagonals: the loop over the diagonals has a constant trip
+// count and is unrolled completely, leaving a loop over rows that gcc
+// vectorises. The rows are shared out in tiles of UCDSFIXEDTILE, and the
+// ivdep pragma tells gcc that dret does not overlap the diagonals or
+// dvector, which it cannot check cheaply with so many pointers. Edge rows
+// go through ucdsgatherrows as usual.
+*/
+
+#define UCDSFIXEDTILE 1024
+
+#define UCDSFIXEDKERNEL(N) \
+static FLPT * multiply_ucdsfixed##N(const ucds *ourucds, \
+    const FLPT *dvector, FLPT * dret) \
+{ \
+    if ((ourucds == NULL) || (dvector == NULL) || (dret == NULL) || \
+        (ourucds->istorage != UCDSFULL) || (ourucds->lnumdiag != N)) \
+    { \
+        return NULL; \
+    } \
+    const INTG miniter = ourucds->linteriorstart; \
+    const INTG maxiter = ourucds->linteriorend; \
+    const INTG lnotiles = (maxiter - miniter + UCDSFIXEDTILE - 1) / \
+        UCDSFIXEDTILE; \
+    const FLPT * ddiags[N]; \
+    const FLPT * dvects[N]; \
+    INTG i, k; \
+    for (i = 0; i < N; i++) \
+    { \
+        ddiags[i] = &(ourucds->ddiagelems[i*ourucds->lmatsize + \
+            ourucds->ldiagindices[i] + miniter]); \
+        dvects[i] = &(dvector[ourucds->ldiagindices[i] + miniter]); \
+    } \
+    _Pragma("omp parallel for schedule(static)") \
+    for (k = 0; k < lnotiles; k++) \
+    { \
+        const INTG lrow = k * UCDSFIXEDTILE; \
+        const INTG lrowend = min(maxiter - miniter, lrow + UCDSFIXEDTILE); \
+        FLPT * dout = &(dret[miniter]); \
+        INTG j, l; \
+        _Pragma("GCC ivdep") \
+        for (j = lrow; j < lrowend; j++) \
+        { \
+            FLPT dsum = 0.0; \
+            _Pragma("GCC unroll 81") \
+            for (l = 0; l < N; l++) \
+            { \
+                dsum += ddiags[l][j] * dvects[l][j]; \
+            } \
+            dout[j] = dsum; \
+        } \
+    } \
+    ucdsgatherrows(ourucds, dvector, dret, 0, miniter); \
+    ucdsgatherrows(ourucds, dvector, dret, maxiter, ourucds->lmatsize); \
+    return dret; \
+}
+
+UCDSFIXEDKERNEL(3)
+UCDSFIXEDKERNEL(5)
+UCDSFIXEDKERNEL(7)
+UCDSFIXEDKERNEL(9)
+UCDSFIXEDKERNEL(11)
+UCDSFIXEDKERNEL(13)
+UCDSFIXEDKERNEL(15)
+UCDSFIXEDKERNEL(17)
+UCDSFIXEDKERNEL(19)
+UCDSFIXEDKERNEL(21)
+UCDSFIXEDKERNEL(23)
+UCDSFIXEDKERNEL(25)
+UCDSFIXEDKERNEL(27)
+UCDSFIXEDKERNEL(29)
+UCDSFIXEDKERNEL(31)
+UCDSFIXEDKERNEL(33)
+UCDSFIXEDKERNEL(35)
+UCDSFIXEDKERNEL(37)
+UCDSFIXEDKERNEL(39)
+UCDSFIXEDKERNEL(41)
+UCDSFIXEDKERNEL(43)
+UCDSFIXEDKERNEL(45)
+UCDSFIXEDKERNEL(47)
+UCDSFIXEDKERNEL(49)
+UCDSFIXEDKERNEL(51)
+UCDSFIXEDKERNEL(53)
+UCDSFIXEDKERNEL(55)
+UCDSFIXEDKERNEL(57)
+UCDSFIXEDKERNEL(59)
+UCDSFIXEDKERNEL(61)
+UCDSFIXEDKERNEL(63)
+UCDSFIXEDKERNEL(65)
+UCDSFIXEDKERNEL(67)
+UCDSFIXEDKERNEL(69)
+UCDSFIXEDKERNEL(71)
+UCDSFIXEDKERNEL(73)
+UCDSFIXEDKERNEL(75)
+UCDSFIXEDKERNEL(77)
+UCDSFIXEDKERNEL(79)
+UCDSFIXEDKERNEL(81)
+
+/* The table of them, in order of the number of diagonals. */
+
+static const fpmult fpfixedmults[] = {
+    &multiply_ucdsfixed3, &multiply_ucdsfixed5, &multiply_ucdsfixed7,
+    &multiply_ucdsfixed9, &multiply_ucdsfixed11, &multiply_ucdsfixed13,
+    &multiply_ucdsfixed15, &multiply_ucdsfixed17, &multiply_ucdsfixed19,
+    &multiply_ucdsfixed21, &multiply_ucdsfixed23, &multiply_ucdsfixed25,
+    &multiply_ucdsfixed27, &multiply_ucdsfixed29, &multiply_ucdsfixed31,
+    &multiply_ucdsfixed33, &multiply_ucdsfixed35, &multiply_ucdsfixed37,
+    &multiply_ucdsfixed39, &multiply_ucdsfixed41, &multiply_ucdsfixed43,
+    &multiply_ucdsfixed45, &multiply_ucdsfixed47, &multiply_ucdsfixed49,
+    &multiply_ucdsfixed51, &multiply_ucdsfixed53, &multiply_ucdsfixed55,
+    &multiply_ucdsfixed57, &multiply_ucdsfixed59, &multiply_ucdsfixed61,
+    &multiply_ucdsfixed63, &multiply_ucdsfixed65, &multiply_ucdsfixed67,
+    &multiply_ucdsfixed69, &multiply_ucdsfixed71, &multiply_ucdsfixed73,
+    &multiply_ucdsfixed75, &multiply_ucdsfixed77, &multiply_ucdsfixed79,
+    &multiply_ucdsfixed81
+};
+
+fpmult fixed_multiply_ucds(const INTG lnumdiag)
+{
+    if ((lnumdiag < UCDSMINFIXED) || (lnumdiag > UCDSMAXFIXED) || 
+        ((lnumdiag % 2) == 0))
+    {
+        return NULL;
+    }
+    return fpfixedmults[(lnumdiag - UCDSMINFIXED) / 2];
+}
+
+fpmult select_multiply_ucds(const ucds *ourucds)
+{
+    fpmult fpfixed; /* The fixed count kernel, if there is one. */
+    if (ourucds == NULL)
+    {
+        return NULL;
+    }
+    switch (ourucds->istorage)
+    {
+        case UCDSCONST:
+            return &multiply_ucdsconst;
+        case UCDSSINGLE:
+            return &multiply_ucdssingle;
+        case UCDSBF16:
+            return &multiply_ucdsbf16;
+    }
+    fpfixed = fixed_multiply_ucds(ourucds->lnumdiag);
+    if (fpfixed != NULL)
+    {
+        return fpfixed;
+    }
+    return best_multiply_ucds();
+}
+
+fpmultdot fused_multiply_ucds(const fpmult fpucdsmult)
+{
+    if (fpucdsmult == &multiply_ucdsrow)
+    {
+        return &multiply_ucdsrowdot;
+    }
+    if (fpucdsmult == &multiply_ucdstiled)
+    {
+        return &multiply_ucdstileddot;
+    }
+    return NULL;
+}
+
+/*
+// The ucdsmultirows function does the work of multiply_ucds_multi for
+// rows [lfrom, lto), with inovects vectors. UCDSMULTIROWS(K) writes out
+// a copy of it for exactly K vectors, so that gcc can vectorise the
+// interleaved loops. When the K elements of a row are narrower than
+// UCDSMULTIROWBYTES, interior rows are done a diagonal at a time, each
+// pass running over a contiguous stretch of drets and dvectors; the
+// block of rows is small enough to stay in L1 across passes. Wider
+// rows are done a row at a time, with the K sums held in registers.
+// Boundary rows are done a row at a time with bounds tests. For UCDSCONST
+// storage, every element of diagonal i is ddiagelems[i], so lcolstride
+// is 0 rather than 1.
+*/
+
+#define UCDSMULTIROWS(NAME, K) \
+static void NAME(const ucds *ourucds, const INTG inovects, \
+    const FLPT *dvectors, FLPT * drets, const INTG lfrom, const INTG lto) \
+{ \
+    const INTG lmatsize = ourucds->lmatsize; \
+    const INTG bconst = (ourucds->istorage == UCDSCONST); \
+    const INTG ldiagstride = bconst ? 1 : lmatsize; \
+    const INTG lcolstride = bconst ? 0 : 1; \
+    const INTG linstart = max(lfrom, min(lto, ourucds->linteriorstart)); \
+    const INTG linend = max(linstart, min(lto, ourucds->linteriorend)); \
+    INTG i, j, v; \
+    INTG lcol; \
+    FLPT dcoeff; \
+    const FLPT * dcolvects; \
+    FLPT dsums[UCDSMAXRHS]; \
+    if (K * sizeof(FLPT) < UCDSMULTIROWBYTES) \
+    { \
+        for (j = linstart * K; j < linend * K; j++) \
+        { \
+            drets[j] = 0.0; \
+        } \
+        for (i = 0; i < ourucds->lnumdiag; i++) \
+        { \
+            const INTG lrev = ourucds->ldiagindices[i]; \
+            const FLPT * ddiag = &(ourucds->ddiagelems[i * ldiagstride]); \
+            if (bconst) \
+            { \
+                dcoeff = ddiag[0]; \
+                _Pragma("GCC ivdep") \
+                for (j = linstart; j < linend; j++) \
+                { \
+                    for (v = 0; v < K; v++) \
+                    { \
+                        drets[j * K + v] += dcoeff * \
+                            dvectors[(j + lrev) * K + v]; \
+                    } \
+                } \
+            } \
+            else \
+            { \
+                _Pragma("GCC ivdep") \
+                for (j = linstart; j < linend; j++) \
+                { \
+                    for (v = 0; v < K; v++) \
+                    { \
+                        drets[j * K + v] += ddiag[j + lrev] * \
+                            dvectors[(j + lrev) * K + v]; \
+                    } \
+                } \
+            } \
+        } \
+    } \
+    else \
+    { \
+        for (j = linstart; j < linend; j++) \
+        { \
+            for (v = 0; v < K; v++) \
+            { \
+                dsums[v] = 0.0; \
+            } \
+            for (i = 0; i < ourucds->lnumdiag; i++) \
+            { \
+                lcol = j + ourucds->ldiagindices[i]; \
+                dcoeff = ourucds->ddiagelems[(i * ldiagstride) + \
+                    (lcol * lcolstride)]; \
+                dcolvects = &(dvectors[lcol * K]); \
+                for (v = 0; v < K; v++) \
+                { \
+                    dsums[v] += dcoeff * dcolvects[v]; \
+                } \
+            } \
+            for (v = 0; v < K; v++) \
+            { \
+                drets[j * K + v] = dsums[v]; \
+            } \
+        } \
+    } \
+    for (j = lfrom; j < lto; j++) \
+    { \
+        if ((j == linstart) && (linend > linstart)) \
+        { \
+            j = linend - 1; \
+            continue; \
+        } \
+        for (v = 0; v < K; v++) \
+        { \
+            dsums[v] = 0.0; \
+        } \
+        for (i = 0; i < ourucds->lnumdiag; i++) \
+        { \
+            lcol = j + ourucds->ldiagindices[i]; \
+            if ((lcol < 0) || (lcol >= lmatsize)) \
+            { \
+                continue; \
+            } \
+            dcoeff = ourucds->ddiagelems[(i * ldiagstride) + \
+                (lcol * lcolstride)]; \
+            dcolvects = &(dvectors[lcol * K]); \
+            for (v = 0; v < K; v++) \
+            { \
+                dsums[v] += dcoeff * dcolvects[v]; \
+            } \
+        } \
+        for (v = 0; v < K; v++) \
+        { \
+            drets[j * K + v] = dsums[v]; \
+        } \
+    } \
+}
+
+UCDSMULTIROWS(ucdsmultirows, inovects)
+UCDSMULTIROWS(ucdsmultirows2, 2)
+UCDSMULTIROWS(ucdsmultirows4, 4)
+UCDSMULTIROWS(ucdsmultirows8, 8)
+UCDSMULTIROWS(ucdsmultirows16, 16)
+
+/*
+// The ucdsmultiblock function sets rows [lfrom, lto) of drets with the 
+// UCDSMULTIROWS function for inovects.
+*/
+
+static void ucdsmultiblock(const ucds *ourucds, const INTG inovects, 
+    const FLPT *dvectors, FLPT * drets, const INTG lfrom, const INTG lto)
+{
+    switch (inovects)
+    {
+        case 2:
+            ucdsmultirows2(ourucds, inovects, dvectors, drets, lfrom, lto);
+            break;
+        case 4:
+            ucdsmultirows4(ourucds, inovects, dvectors, drets, lfrom, lto);
+            break;
+        case 8:
+            ucdsmultirows8(ourucds, inovects, dvectors, drets, lfrom, lto);
+            break;
+        case 16:
+            ucdsmultirows16(ourucds, inovects, dvectors, drets, lfrom, lto);
+            break;
+        default:
+            ucdsmultirows(ourucds, inovects, dvectors, drets, lfrom, lto);
+    }
+}
+
+FLPT * multiply_ucds_multi(const ucds *ourucds, const INTG inovects, 
+    const FLPT *dvectors, FLPT * drets)
+{
+    if ((ourucds == NULL) || (dvectors == NULL) || (drets == NULL) ||
+        (inovects < 1) || (inovects > UCDSMAXRHS) || 
+        ((ourucds->istorage != UCDSFULL) && (ourucds->istorage != UCDSCONST)))
+    {
+        return NULL;
+    }
+    
+/* One vector is ordinary multiplication. */    
+    
+    if (inovects == 1)
+    {
+        return select_multiply_ucds(ourucds)(ourucds, dvectors, drets);
+    }
+    
+    const INTG lmatsize = ourucds->lmatsize;
+    const INTG lblock = UCDSMULTITILE / inovects; /* Rows per block. */
+    const INTG lnoblocks = (lmatsize + lblock - 1) / lblock;
+    INTG k; /* Over blocks of rows. */
+    INTG lrow, lrowend; /* The rows in the block. */
+    
+    #pragma omp parallel for private(lrow, lrowend) schedule(static)
+    for (k = 0; k < lnoblocks; k++)
+    {
+        lrow = k * lblock;
+        lrowend = min(lmatsize, lrow + lblock);
+        ucdsmultiblock(ourucds, inovects, dvectors, drets, lrow, lrowend);
+    }
+    return drets; 
+}
+
+void printucds(const char * name, ucds * ourucds)
+{
+    printf("name: %s, matrix size: %d, number of diagonals: %d, ", name, 
+        ourucds->lmatsize, ourucds->lnumdiag);
+    printintvector("diagindices", ourucds->lnumdiag, ourucds->ldiagindices);
+    if (ourucds->istorage == UCDSCONST)
+    {
+        printvector("values", ourucds->lnumdiag, ourucds->ddiagelems);
+    }
+    else if (ourucds->istorage == UCDSFULL)
+    {
+        printvector("values", ourucds->lnumdiag * ourucds->lmatsize,
+            ourucds->ddiagelems);
+    }
+    else
+    {
+        
+/* Narrow elements are widened to print them. */        
+        
+        INTG i, j; /* Iteration variables. */
+        FLPT * dwide = dassign(ourucds->lnumdiag * ourucds->lmatsize);
+        if (dwide == NULL)
+        {
+            return;
+        }
+        for (i = 0; i < ourucds->lnumdiag; i++)
+        {
+            for (j = 0; j < ourucds->lmatsize; j++)
+            {
+                dwide[i*ourucds->lmatsize + j] = ducdselem(ourucds, i, j);
+            }
+        }
+        printvector("values", ourucds->lnumdiag * ourucds->lmatsize, dwide);
+        free(dwide);
+    }
+}
+
+
+/* The following are the vector plan routines. */
+
+vplan * init_vplan(vplan * ourplan, const INTG lvectsize)
+{
+    if ((ourplan == NULL) || (lvectsize < 0))
+    {
+        return NULL;
+    }
+    ourplan->lvectsize = lvectsize;
+    ourplan->inoterms = 0;
+    ourplan->dmatcoeff = 0.0;
+    ourplan->ourucds = NULL;
+    ourplan->dmatvector = NULL;
+    return ourplan;
+}
+
+vplan * addterm_vplan(vplan * ourplan, const FLPT dcoeff, 
+    const FLPT * dvector)
+{
+    if ((ourplan == NULL) || (dvector == NULL) || 
+        (ourplan->inoterms >= VPLANMAXTERMS))
+    {
+        return NULL;
+    }
+    ourplan->dcoeffs[ourplan->inoterms] = dcoeff;
+    ourplan->dterms[ourplan->inoterms] = dvector;
+    ourplan->inoterms++;
+    return ourplan;
+}
+
+vplan * addmult_vplan(vplan * ourplan, const FLPT dcoeff, 
+    const ucds * ourucds, const FLPT * dvector)
+{
+    if ((ourplan == NULL) || (ourucds == NULL) || (dvector == NULL) ||
+        (ourplan->ourucds != NULL) || (ourucds->istorage != UCDSFULL) ||
+        (ourucds->lmatsize != ourplan->lvectsize))
+    {
+        return NULL;
+    }
+    ourplan->dmatcoeff = dcoeff;
+    ourplan->ourucds = ourucds;
+    ourplan->dmatvector = dvector;
+    return ourplan;
+}
+
+/*
+// The dplanblock function evaluates rows [lstart, lend) of ourplan into
+// dret, VPLANTILE rows at a time, and returns the part of dret.dret from
+// those rows. Each tile is built up in dtile, which stays in the L1 
+// cache: first the matrix term (its interior rows a diagonal at a time,
+// and its boundary rows with ducdsrowsum), then each vector term in turn.
+// So every vector is read once, and dret is only written once a tile is
+// done, which lets it be one of the terms.
+*/
+
+static FLPT dplanblock(const vplan * ourplan, FLPT * dret, 
+    const INTG lstart, const INTG lend)
+{
+    FLPT dtile[VPLANTILE]; /* The tile being built. */
+    FLPT dsum = 0.0; /* The dot product. */
+    INTG i, j, k; /* Iteration variables. */
+    INTG lfrom, lto; /* The rows of the tile. */
+    INTG miniter, maxiter; /* Interior rows of the tile. */
+    const ucds * ourucds = ourplan->ourucds;
+    
+    for (lfrom = lstart; lfrom < lend; lfrom += VPLANTILE)
+    {
+        lto = min(lend, lfrom + VPLANTILE);
+        if (ourucds != NULL)
+        {
+            const FLPT * dvector = ourplan->dmatvector;
+            miniter = min(lto, max(lfrom, ourucds->linteriorstart));
+            maxiter = max(miniter, min(lto, ourucds->linteriorend));
+            for (j = lfrom; j < miniter; j++)
+            {
+                dtile[j - lfrom] = ducdsrowsum(ourucds, dvector, j);
+            }
+            for (j = miniter; j < maxiter; j++)
+            {
+                dtile[j - lfrom] = 0.0;
+            }
+            FLPT * dinterior = &(dtile[miniter - lfrom]);
+            for (i = 0; (i < ourucds->lnumdiag) && (miniter < maxiter); i++)
+            {
+                
+/* The pointers start at the first interior row, for a plain loop. */                
+                
+                const INTG loffset = miniter + ourucds->ldiagindices[i];
+                const FLPT * ddiag = 
+                    &(ourucds->ddiagelems[i * ourucds->lmatsize + loffset]);
+                const FLPT * dshifted = &(dvector[loffset]);
+                for (j = 0; j < maxiter - miniter; j++)
+                {
+                    dinterior[j] += ddiag[j] * dshifted[j];
+                }
+            }
+            for (j = maxiter; j < lto; j++)
+            {
+                dtile[j - lfrom] = ducdsrowsum(ourucds, dvector, j);
+            }
+            for (j = lfrom; j < lto; j++)
+            {
+                dtile[j - lfrom] *= ourplan->dmatcoeff;
+            }
+        }
+        else
+        {
+            for (j = lfrom; j < lto; j++)
+            {
+                dtile[j - lfrom] = 0.0;
+            }
+        }
+        for (k = 0; k < ourplan->inoterms; k++)
+        {
+            const FLPT dcoeff = ourplan->dcoeffs[k];
+            const FLPT * dterm = ourplan->dterms[k];
+            for (j = lfrom; j < lto; j++)
+            {
+                dtile[j - lfrom] += dcoeff * dterm[j];
+            }
+        }
+        #pragma omp simd reduction(+:dsum)
+        for (j = lfrom; j < lto; j++)
+        {
+            dret[j] = dtile[j - lfrom];
+            dsum += dtile[j - lfrom] * dtile[j - lfrom];
+        }
+    }
+    return dsum;
+}
+
+FLPT * eval_vplan(const vplan * ourplan, FLPT * dret)
+{
+    if ((ourplan == NULL) || (dret == NULL) || 
+        (dret == ourplan->dmatvector))
+    {
+        return NULL;
+    }
+    #pragma omp parallel
+    {
+        INTG lstart, lend; /* The block of rows this thread owns. */
+        rowblock(ourplan->lvectsize, &lstart, &lend);
+        dplanblock(ourplan, dret, lstart, lend);
+    }
+    return dret;
+}
+
+FLPT evaldot_vplan(const vplan * ourplan, FLPT * dret)
+{
+    FLPT dsum = 0.0; /* The result. */
+    if ((ourplan == NULL) || (dret == NULL) || 
+        (dret == ourplan->dmatvector))
+    {
+        return NAN;
+    }
+    if (bdeterministic)
+    {
+        eval_vplan(ourplan, dret);
+        return ddotprod(ourplan->lvectsize, dret, dret);
+    }
+    #pragma omp parallel reduction(+:dsum)
+    {
+        INTG lstart, lend; /* The block of rows this thread owns. */
+        rowblock(ourplan->lvectsize, &lstart, &lend);
+        dsum += dplanblock(ourplan, dret, lstart, lend);
+    }
+    return dsum;
+}
+    
+/*
+// The following implementation is from 5.1, p.42 of Henk A. van der Vorst,
+// "Iterative Krylov Methods for Large Linear Systems".
+*/
+/*
+FLPT * dconjgrad(const ucds * ucdsa, const FLPT * dvectb, const FLPT *dvectx0,
+    FLPT * dvectx, fpmult fpucdsmult, fpnorm fpdnorm, 
+    INTG imode, const FLPT derror, INTG * inoiter)
+{
+    FLPT alpha, beta = 0; // Variables used in the equation. 
+    INTG icount = 1; // The iteration count. 
+    INTG ivectorsize = ucdsa->lmatsize; // The size of matrices and vectors. 
+    INTG isquareroot = floor(sqrt(ivectorsize * 1.0));
+    FLPT * dpvector;
+    FLPT * dqvector;
+    FLPT * dbetapproduct;
+    FLPT * drvectors[2]; // Needed for r_even and r_odd storage. 
+    FLPT rhos[2] = {1.0, 1.0}; // Needed for the rhos. 
+    FLPT dnorm;
+    FLPT * derrorcorrect;
+    
+// Time to initialise. 
+    dpvector = dassign(ivectorsize);
+    dqvector = dassign(ivectorsize);
+    dbetapproduct = dassign(ivectorsize);
+    drvectors[0] = dassign(ivectorsize);
+    drvectors[1] = dassign(ivectorsize);
+    derrorcorrect = dassign(ivectorsize);
+    doverwritevector(ivectorsize, 0.0, dvectx);
+    fpucdsmult(ucdsa, dvectx0, dqvector);
+    dvectsub (ivectorsize, dvectb, dqvector, drvectors[0]);
+    FLPT delta0 = dselfdprod(ivectorsize, drvectors[0]);
+    while(1)
+    {
+        rhos[(icount - 1) % 2] = dselfdprod(ivectorsize, drvectors[(icount - 1) % 2]);
+        if (icount == 1)
+        {
+            dveccopy(ivectorsize, dpvector, drvectors[(icount - 1) % 2]);
+        }
+        else
+        {
+            beta = rhos[(icount - 1) % 2]/rhos[icount % 2];
+            dscalarprod (ivectorsize, beta, dpvector, dbetapproduct);
+            dvectadd (ivectorsize, drvectors[(icount - 1) % 2], dbetapproduct, dpvector);
+            dveccopy(ivectorsize, dpvector, drvectors[(icount - 1) % 2]);
+        }
+        fpucdsmult(ucdsa, dpvector, dqvector);
+        alpha = rhos[(icount - 1) % 2]/ddotprod(ivectorsize, dpvector, dqvector); 
+        daddinsitu (ivectorsize, dvectx, alpha, dpvector);
+        if ((icount % isquareroot) == 0)
+        {
+            fpucdsmult(ucdsa, dvectx, derrorcorrect);
+            daddtwosums (ivectorsize, drvectors[icount % 2], dvectb,
+                1.0, derrorcorrect, -1.0);            
+        }
+        else
+        {
+            daddtwosums (ivectorsize, drvectors[icount % 2], drvectors[(icount - 1) % 2],
+                1.0, dqvector, -1.0 * alpha);
+        }
+        dnorm = dvectnorm (ivectorsize, imode, drvectors[icount % 2]);
+        if (dnorm < (derror)) // ?
+        {
+            printf("Delta0: %f; Delta0e2: %f; Norm; %f; Rho %f, %f\n", delta0, delta0 * derror * derror,
+                dnorm, rhos[(icount - 1) % 2], rhos[(icount) % 2]);
+            free(dpvector);
+            free(dqvector);
+            free(dbetapproduct);
+            free(drvectors[0]);
+            free(drvectors[1]);
+            free(derrorcorrect);
+            if (inoiter != NULL)
+            {
+                *inoiter = icount;
+            }
+            return dvectx;
+        }
+        icount = icount + 1;
+    }
+}
+
+*/
+
+cgworkspace * create_cgworkspace(const INTG lvectsize)
+{
+    return create_cgworkspacebasis(lvectsize, 0);
+}
+
+cgworkspace * create_cgworkspacebasis(const INTG lvectsize, 
+    const INTG inobasis)
+{
+    if ((lvectsize < 1) || (inobasis < 0))
+    {
+        return NULL;
+    }
+    cgworkspace * ourws = (cgworkspace *)malloc(1 * sizeof(cgworkspace));
+    if (ourws == NULL)
+    {
+        return NULL;
+    }
+    ourws->lvectsize = lvectsize;
+    ourws->dqvector = dassignlocal(lvectsize);
+    ourws->drvector = dassignlocal(lvectsize);
+    ourws->ddvector = dassignlocal(lvectsize);
+    ourws->dbandaproduct = dassignlocal(lvectsize);
+    ourws->dzvector = dassignlocal(lvectsize);
+    ourws->dinvdiag = dassignlocal(lvectsize);
+    ourws->dsvector = dassignlocal(lvectsize);
+    ourws->dwvector = dassignlocal(lvectsize);
+    ourws->inobasis = inobasis;
+    ourws->dbasis = (inobasis > 0) ? dassignlocal(inobasis * lvectsize) :
+        NULL;
+    ourws->inogram = 0;
+    ourws->dgrampartials = NULL;
+    ourws->tlastsolve = 0;
+    ourws->ttotalsolve = 0;
+    ourws->inosolves = 0;
+    ourws->ilastiter = 0;
+    if ((ourws->dqvector == NULL) || (ourws->drvector == NULL) ||
+        (ourws->ddvector == NULL) || (ourws->dbandaproduct == NULL) ||
+        (ourws->dzvector == NULL) || (ourws->dinvdiag == NULL) ||
+        (ourws->dsvector == NULL) || (ourws->dwvector == NULL) ||
+        ((inobasis > 0) && (ourws->dbasis == NULL)))
+    {
+        destroy_cgworkspace(ourws);
+        return NULL;
+    }
+    return ourws;
+}
+
+void destroy_cgworkspace(cgworkspace * ourws)
+{
+    if (ourws == NULL)
+    {
+        return;
+    }
+    vunassign(ourws->dqvector);
+    vunassign(ourws->drvector);
+    vunassign(ourws->ddvector);
+    vunassign(ourws->dbandaproduct);
+    vunassign(ourws->dzvector);
+    vunassign(ourws->dinvdiag);
+    vunassign(ourws->dsvector);
+    vunassign(ourws->dwvector);
+    vunassign(ourws->dbasis);
+    vunassign(ourws->dgrampartials);
+    free(ourws);
+}
+
+cgworkspace * create_cgworkspaceblock(const INTG lvectsize, 
+    const INTG inovects)
+{
+    if ((inovects < 1) || (inovects > UCDSMAXRHS))
+    {
+        return NULL;
+    }
+    cgworkspace * ourws = create_cgworkspacebasis(lvectsize, 3 * inovects);
+    if (ourws == NULL)
+    {
+        return NULL;
+    }
+    ourws->inogram = inovects;
+    ourws->dgrampartials = dassignlocal(6 * inovects * inovects * 
+        ((lvectsize + UCDSDETBLOCK - 1) / UCDSDETBLOCK));
+    if (ourws->dgrampartials == NULL)
+    {
+        destroy_cgworkspace(ourws);
+        return NULL;
+    }
+    return ourws;
+}
+
+// This is from painless conjugate gradient
+
+/*
+// The dcgsolve function does the work of dconjgradws (if bjacobi is 0
+// and ourprec NULL), dpconjgradws (if bjacobi is 1) and dprecconjgradws
+// (with ourprec). Without a preconditioner, z is r, so the same steps 
+// serve all three.
+*/
+
+static FLPT * dcgsolve(cgworkspace * ourws, const ucds * ucdsa, 
+    const FLPT * dvectb, const FLPT *dvectx0, FLPT * dvectx, 
+    fpmult fpucdsmult, const FLPT derror, INTG * inoiter, 
+    const INTG bjacobi, const ucdsprecond * ourprec)
+{
+    if ((ourws == NULL) || (ucdsa == NULL) || 
+        (ourws->lvectsize != ucdsa->lmatsize) || ((ourprec != NULL) &&
+        (ourprec->lmatsize != ucdsa->lmatsize)))
+    {
+        return NULL;
+    }
+    struct timespec start, end; // For timing the solve.
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    FLPT alpha, beta = 0; // Variables used in the equation.
+    FLPT deltanew, deltaold, delta0 = 0;    
+    FLPT ddq; // dTq.
+    fpmultdot fpfused = fused_multiply_ucds(fpucdsmult); // Or NULL.
+    INTG icount = 0; // The iteration count. :
+    INTG ivectorsize = ucdsa->lmatsize; // The size of matrices and vectors. 
+    INTG isquareroot = floor(sqrt(ivectorsize * 1.0)); // The square root of the size.
+    FLPT * dqvector = ourws->dqvector;
+    FLPT * drvector = ourws->drvector;
+    FLPT * ddvector = ourws->ddvector;
+    FLPT * dbandaproduct = ourws->dbandaproduct;
+    FLPT * dzvector = (bjacobi || (ourprec != NULL)) ? ourws->dzvector : 
+        drvector; // z = M^-1 r.
+    FLPT * dinvdiag = ourws->dinvdiag; // M^-1, for the preconditioner.
+    if (bjacobi && (jacobi_ucds(ucdsa, dinvdiag) == NULL))
+    {
+        return NULL; // There is no main diagonal, or a zero on it.
+    }
+    vplan residplan; // r = b - Ax, without forming Ax.
+    INTG bplan = 0; // Only in place of multiply_ucdsrow, with the same sums.
+    if (fpucdsmult == &multiply_ucdsrow)
+    {
+        bplan = (addmult_vplan(addterm_vplan(init_vplan(&residplan, 
+            ivectorsize), 1.0, dvectb), -1.0, ucdsa, dvectx) != NULL);
+        if (!bplan)
+        {
+            return NULL; // Like multiply_ucdsrow, the plan needs UCDSFULL.
+        }
+    }
+    dveccopy (ivectorsize, dvectx, dvectx0); // x = x0
+    if (bplan)
+    {
+        deltanew = evaldot_vplan(&residplan, drvector); // r = b - Ax, rTr
+    }
+    else
+    {
+        if (fpucdsmult(ucdsa, dvectx0, dbandaproduct) == NULL) // bandvector = Ax.
+        {
+            return NULL; // fpucdsmult does not suit the storage of ucdsa.
+        }
+        dvectsub (ivectorsize, dvectb, dbandaproduct, drvector); // r = b - Ax
+        deltanew = dselfdprod(ivectorsize, drvector); //deltanew = rTr
+    }
+    if (bjacobi)
+    {
+        deltanew = djacobidot(ivectorsize, dinvdiag, drvector, dzvector); // z = M^-1 r, deltanew = rTz
+    }
+    else if (ourprec != NULL)
+    {
+        apply_ucdsprecond(ourprec, drvector, dzvector); // z = M^-1 r
+        deltanew = ddotprod(ivectorsize, drvector, dzvector); // deltanew = rTz
+    }
+    dveccopy (ivectorsize, ddvector, dzvector); // d = z
+    delta0 = deltanew; // delta0 = deltanew
+    printf("Start loop:\n");
+    while((deltanew > derror) || (deltanew > (derror * derror * derror * derror * delta0))) // deltanew > e2delta0 
+    {
+  //      printf("Delta0: %f; Deltanew: %f; error; %f\n", delta0, deltanew, derror);
+        if (fpfused != NULL)
+        {
+            fpfused(ucdsa, ddvector, dqvector, &ddq); // q = Ad, with dTq.
+        }
+        else
+        {
+            fpucdsmult(ucdsa, ddvector, dqvector); // q = Ad.
+            ddq = ddotprod (ivectorsize, ddvector, dqvector);
+        }
+        alpha = deltanew / ddq; // alpha = deltanew / dTq
+        deltaold = deltanew;
+        if ((icount % isquareroot) == 0)
+        {
+            daddinsitu (ivectorsize, dvectx, alpha, ddvector); // x = x + alpha.d
+            if (bplan)
+            {
+                deltanew = evaldot_vplan(&residplan, drvector); // r = b - Ax, rTr
+            }
+            else
+            {
+                fpucdsmult(ucdsa, dvectx, dbandaproduct); // bandvector = Ax.
+                dvectsub (ivectorsize, dvectb, dbandaproduct, drvector); // r = b - Ax           
+                deltanew = dselfdprod(ivectorsize, drvector); //deltanew = rTr
+            }
+            if (bjacobi)
+            {
+                deltanew = djacobidot(ivectorsize, dinvdiag, drvector, dzvector); // z = M^-1 r, deltanew = rTz
+            }
+            else if (ourprec != NULL)
+            {
+                apply_ucdsprecond(ourprec, drvector, dzvector); // z = M^-1 r
+                deltanew = ddotprod(ivectorsize, drvector, dzvector); // deltanew = rTz
+            }
+        }
+        else if (bjacobi)
+        {
+            // As below, with z = M^-1 r, and deltanew = rTz.
+            deltanew = dpcgupdate (ivectorsize, alpha, ddvector, dqvector, 
+                dinvdiag, dvectx, drvector, dzvector);
+        }
+        else
+        {
+            // x = x + alpha.d, r = r - alpha.q and deltanew = rTr in one pass.
+            deltanew = dcgupdate (ivectorsize, alpha, ddvector, dqvector, 
+                dvectx, drvector);
+            if (ourprec != NULL)
+            {
+                apply_ucdsprecond(ourprec, drvector, dzvector); // z = M^-1 r
+                deltanew = ddotprod(ivectorsize, drvector, dzvector); // deltanew = rTz
+            }
+        }        
+
+        beta = deltanew / deltaold;
+        dtruesaxpy (ivectorsize, 1.0, dzvector, beta, ddvector); // d = z + beta.d
+        icount = icount + 1;
+  //      printf("alpha: %f; beta: %f\n", alpha, beta);
+        if (icount > ivectorsize)
+        {
+            break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ourws->tlastsolve = timespecDiff(&end, &start);
+    ourws->ttotalsolve += ourws->tlastsolve;
+    ourws->inosolves++;
+    ourws->ilastiter = icount;
+    if (inoiter != NULL)
+    {
+        *inoiter = icount;
+    }
+    return dvectx;
+
+}
+
+FLPT * dconjgradws(cgworkspace * ourws, const ucds * ucdsa, 
+    const FLPT * dvectb, const FLPT *dvectx0, FLPT * dvectx, 
+    fpmult fpucdsmult, fpnorm fpdnorm, INTG imode, const FLPT derror, 
+    INTG * inoiter)
+{
+    return dcgsolve(ourws, ucdsa, dvectb, dvectx0, dvectx, fpucdsmult, 
+        derror, inoiter, 0, NULL);
+}
+
+FLPT * dpconjgradws(cgworkspace * ourws, const ucds * ucdsa, 
+    const FLPT * dvectb, const FLPT *dvectx0, FLPT * dvectx, 
+    fpmult fpucdsmult, fpnorm fpdnorm, INTG imode, const FLPT derror, 
+    INTG * inoiter)
+{
+    return dcgsolve(ourws, ucdsa, dvectb, dvectx0, dvectx, fpucdsmult, 
+        derror, inoiter, 1, NULL);
+}
+
+FLPT * dprecconjgradws(cgworkspace * ourws, const ucdsprecond * ourprec, 
+    const ucds * ucdsa, const FLPT * dvectb, const FLPT *dvectx0, 
+    FLPT * dvectx, fpmult fpucdsmult, fpnorm fpdnorm, INTG imode, 
+    const FLPT derror, INTG * inoiter)
+{
+    if (ourprec == NULL)
+    {
+        return NULL;
+    }
+    return dcgsolve(ourws, ucdsa, dvectb, dvectx0, dvectx, fpucdsmult, 
+        derror, inoiter, 0, ourprec);
 }
 
-    
-/*
-// The following implementation is from 5.1, p.42 of Henk A. van der Vorst,
-// "Iterative Krylov Methods for Large Linear Systems".
-*/
-/*
 FLPT * dconjgrad(const ucds * ucdsa, const FLPT * dvectb, const FLPT *dvectx0,
     FLPT * dvectx, fpmult fpucdsmult, fpnorm fpdnorm, 
     INTG imode, const FLPT derror, INTG * inoiter)
 {
-    FLPT alpha, beta = 0; // Variables used in the equation. 
-    INTG icount = 1; // The iteration count. 
-    INTG ivectorsize = ucdsa->lmatsize; // The size of matrices and vectors. 
-    INTG isquareroot = floor(sqrt(ivectorsize * 1.0));
-    FLPT * dpvector;
-    FLPT * dqvector;
-    FLPT * dbetapproduct;
-    FLPT * drvectors[2]; // Needed for r_even and r_odd storage. 
-    FLPT rhos[2] = {1.0, 1.0}; // Needed for the rhos. 
-    FLPT dnorm;
-    FLPT * derrorcorrect;
-    
-// Time to initialise. 
-    dpvector = dassign(ivectorsize);
-    dqvector = dassign(ivectorsize);
-    dbetapproduct = dassign(ivectorsize);
-    drvectors[0] = dassign(ivectorsize);
-    drvectors[1] = dassign(ivectorsize);
-    derrorcorrect = dassign(ivectorsize);
-    doverwritevector(ivectorsize, 0.0, dvectx);
-    fpucdsmult(ucdsa, dvectx0, dqvector);
-    dvectsub (ivectorsize, dvectb, dqvector, drvectors[0]);
-    FLPT delta0 = dselfdprod(ivectorsize, drvectors[0]);
-    while(1)
+    if (ucdsa == NULL)
+    {
+        return NULL;
+    }
+    cgworkspace * ourws = create_cgworkspace(ucdsa->lmatsize);
+    FLPT * dret = dconjgradws(ourws, ucdsa, dvectb, dvectx0, dvectx, 
+        fpucdsmult, fpdnorm, imode, derror, inoiter);
+    destroy_cgworkspace(ourws);
+    return dret;
+}
+
+FLPT * dpconjgrad(const ucds * ucdsa, const FLPT * dvectb, 
+    const FLPT *dvectx0, FLPT * dvectx, fpmult fpucdsmult, fpnorm fpdnorm, 
+    INTG imode, const FLPT derror, INTG * inoiter)
+{
+    if (ucdsa == NULL)
+    {
+        return NULL;
+    }
+    cgworkspace * ourws = create_cgworkspace(ucdsa->lmatsize);
+    FLPT * dret = dpconjgradws(ourws, ucdsa, dvectb, dvectx0, dvectx, 
+        fpucdsmult, fpdnorm, imode, derror, inoiter);
+    destroy_cgworkspace(ourws);
+    return dret;
+}
+
+/*
+// The dteamsum function is called by every thread of a parallel region,
+// each with its own dpartial, and returns the sum of them to every 
+// thread. The threads write into dslots (one per thread), wait at a 
+// barrier, and then each adds up the slots in the same order, so all
+// get the same result. A caller must alternate between two sets of
+// slots, so that no thread overwrites a slot that another still reads.
+*/
+
+static FLPT dteamsum(FLPT * dslots, const FLPT dpartial)
+{
+    INTG i; /* Iteration variable. */
+    INTG inothreads = 1; /* Threads in the team. */
+    FLPT dsum = 0.0; /* The result. */
+#ifdef _OPENMP
+    inothreads = omp_get_num_threads();
+    dslots[omp_get_thread_num()] = dpartial;
+#else
+    dslots[0] = dpartial;
+#endif
+    #pragma omp barrier
+    for (i = 0; i < inothreads; i++)
+    {
+        dsum += dslots[i];
+    }
+    return dsum;
+}
+
+FLPT * dconjgradpar(cgworkspace * ourws, const ucds * ucdsa, 
+    const FLPT * dvectb, const FLPT *dvectx0, FLPT * dvectx, 
+    const FLPT derror, INTG * inoiter)
+{
+    if ((ourws == NULL) || (ucdsa == NULL) || (dvectb == NULL) ||
+        (dvectx0 == NULL) || (dvectx == NULL) || 
+        (ourws->lvectsize != ucdsa->lmatsize) || 
+        (ucdsa->istorage != UCDSFULL))
+    {
+        return NULL;
+    }
+    if (bdeterministic) /* The team sums depend on the number of threads. */
+    {
+        return dconjgradws(ourws, ucdsa, dvectb, dvectx0, dvectx, 
+            &multiply_ucdsrow, dvectnorm, 2, derror, inoiter);
+    }
+#ifdef _OPENMP
+    const INTG inoslots = omp_get_max_threads();
+#else
+    const INTG inoslots = 1;
+#endif
+    FLPT * dslots = dassign(2 * inoslots); /* Two sets for dteamsum. */
+    if (dslots == NULL)
+    {
+        return NULL;
+    }
+    struct timespec start, end; // For timing the solve.
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    const INTG ivectorsize = ucdsa->lmatsize; // The size of matrices and vectors. 
+    const INTG isquareroot = floor(sqrt(ivectorsize * 1.0)); // The square root of the size.
+    FLPT * dqvector = ourws->dqvector;
+    FLPT * drvector = ourws->drvector;
+    FLPT * ddvector = ourws->ddvector;
+    FLPT * dbandaproduct = ourws->dbandaproduct;
+    INTG icount = 0; // The iteration count, as worked out by thread 0.
+    
+/*
+// Every thread works on its own block of rows (from rowblock) for the
+// whole solve, and they meet at a barrier only where one needs rows of
+// another: in the dot products, and before each multiplication, which 
+// reads the neighbouring rows of d (or x). Every thread works out the
+// same alpha, beta and deltas, so they all leave the loop together.
+*/    
+    
+    #pragma omp parallel
+    {
+        FLPT alpha, beta; // Variables used in the equation.
+        FLPT deltanew, deltaold, delta0;
+        FLPT dpartial; // This thread's part of a dot product.
+        INTG iset = 0; // Which set of slots dteamsum uses next.
+        INTG imycount = 0; // The iteration count.
+        INTG lstart, lend; // The block of rows this thread owns.
+        INTG j; // Iteration variable.
+        rowblock(ivectorsize, &lstart, &lend);
+        
+        drowblockdot(ucdsa, dvectx0, dbandaproduct, lstart, lend); // bandvector = Ax.
+        dpartial = 0.0;
+        for (j = lstart; j < lend; j++)
+        {
+            drvector[j] = dvectb[j] - dbandaproduct[j]; // r = b - Ax
+            ddvector[j] = drvector[j]; // d = r
+            dvectx[j] = dvectx0[j]; // x = x0
+            dpartial += drvector[j] * drvector[j];
+        }
+        deltanew = dteamsum(&(dslots[iset * inoslots]), dpartial); //deltanew = rTr
+        iset = 1 - iset;
+        delta0 = deltanew; // delta0 = deltanew
+        #pragma omp single nowait
+        printf("Start loop:\n");
+        while((deltanew > derror) || (deltanew > (derror * derror * derror * derror * delta0))) // deltanew > e2delta0 
+        {
+            #pragma omp barrier
+            dpartial = drowblockdot(ucdsa, ddvector, dqvector, lstart, lend); // q = Ad.
+            alpha = deltanew / dteamsum(&(dslots[iset * inoslots]), dpartial); // alpha = deltanew / dTq
+            iset = 1 - iset;
+            deltaold = deltanew;
+            dpartial = 0.0;
+            if ((imycount % isquareroot) == 0)
+            {
+                for (j = lstart; j < lend; j++)
+                {
+                    dvectx[j] += alpha * ddvector[j]; // x = x + alpha.d
+                }
+                #pragma omp barrier
+                drowblockdot(ucdsa, dvectx, dbandaproduct, lstart, lend); // bandvector = Ax.
+                for (j = lstart; j < lend; j++)
+                {
+                    drvector[j] = dvectb[j] - dbandaproduct[j]; // r = b - Ax
+                    dpartial += drvector[j] * drvector[j];
+                }
+            }
+            else
+            {
+                for (j = lstart; j < lend; j++)
+                {
+                    dvectx[j] += alpha * ddvector[j]; // x = x + alpha.d
+                    drvector[j] -= alpha * dqvector[j]; // r = r - alpha.q
+                    dpartial += drvector[j] * drvector[j];
+                }
+            }
+            deltanew = dteamsum(&(dslots[iset * inoslots]), dpartial); //deltanew = rTr
+            iset = 1 - iset;
+            beta = deltanew / deltaold;
+            for (j = lstart; j < lend; j++)
+            {
+                ddvector[j] = drvector[j] + beta * ddvector[j]; // d = r + beta.d
+            }
+            imycount = imycount + 1;
+            if (imycount > ivectorsize)
+            {
+                break;
+            }
+        }
+        #pragma omp master
+        icount = imycount;
+    }
+    vunassign(dslots);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ourws->tlastsolve = timespecDiff(&end, &start);
+    ourws->ttotalsolve += ourws->tlastsolve;
+    ourws->inosolves++;
+    ourws->ilastiter = icount;
+    if (inoiter != NULL)
+    {
+        *inoiter = icount;
+    }
+    return dvectx;
+}
+
+/*
+// The dteamsums function is dteamsum for inosums sums at once: each
+// thread passes its partials in dsums (which it gets back as the totals),
+// and dslots has inosums slots per thread. The same rules apply.
+*/
+
+static void dteamsums(FLPT * dslots, const INTG inosums, FLPT * dsums)
+{
+    INTG i, k; /* Iteration variables. */
+    INTG inothreads = 1; /* Threads in the team. */
+    INTG imyslot = 0; /* The first slot of this thread. */
+#ifdef _OPENMP
+    inothreads = omp_get_num_threads();
+    imyslot = omp_get_thread_num() * inosums;
+#endif
+    for (k = 0; k < inosums; k++)
+    {
+        dslots[imyslot + k] = dsums[k];
+    }
+    #pragma omp barrier
+    for (k = 0; k < inosums; k++)
+    {
+        dsums[k] = 0.0;
+        for (i = 0; i < inothreads; i++)
+        {
+            dsums[k] += dslots[(i * inosums) + k];
+        }
+    }
+}
+
+FLPT * dconjgradpipe(cgworkspace * ourws, const ucds * ucdsa, 
+    const FLPT * dvectb, const FLPT *dvectx0, FLPT * dvectx, 
+    const FLPT derror, INTG * inoiter)
+{
+    if ((ourws == NULL) || (ucdsa == NULL) || (dvectb == NULL) ||
+        (dvectx0 == NULL) || (dvectx == NULL) || 
+        (ourws->lvectsize != ucdsa->lmatsize) || 
+        (ucdsa->istorage != UCDSFULL))
+    {
+        return NULL;
+    }
+    if (bdeterministic) /* The team sums depend on the number of threads. */
+    {
+        return dconjgradws(ourws, ucdsa, dvectb, dvectx0, dvectx, 
+            &multiply_ucdsrow, dvectnorm, 2, derror, inoiter);
+    }
+#ifdef _OPENMP
+    const INTG inoslots = omp_get_max_threads();
+#else
+    const INTG inoslots = 1;
+#endif
+    FLPT * dslots = dassign(4 * inoslots); /* Two sets of two sums. */
+    if (dslots == NULL)
+    {
+        return NULL;
+    }
+    struct timespec start, end; // For timing the solve.
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    const INTG ivectorsize = ucdsa->lmatsize; // The size of matrices and vectors. 
+    const INTG isquareroot = floor(sqrt(ivectorsize * 1.0)); // The square root of the size.
+    FLPT * dqvector = ourws->dqvector; // q = Aw.
+    FLPT * drvector = ourws->drvector; // r = b - Ax.
+    FLPT * ddvector = ourws->ddvector; // p, the search direction.
+    FLPT * dwvectors[2] = {ourws->dbandaproduct, ourws->dwvector}; // w = Ar.
+    FLPT * dzvector = ourws->dzvector; // z = Aq.
+    FLPT * dsvector = ourws->dsvector; // s = Ap.
+    INTG icount = 0; // The iteration count, as worked out by thread 0.
+    
+/*
+// As in dconjgradpar, every thread keeps its own block of rows. The 
+// recurrences of Ghysels and Vanroose keep w = Ar, s = Ap and z = As up
+// to date alongside r and p, so that r.r and w.r (from which alpha and 
+// beta follow) can be summed in the same pass as the vector updates. 
+// Their barrier is the one that the next multiplication (q = Aw) needs
+// anyway, so each iteration has one barrier, where dconjgradpar has 
+// three. For that, the new w goes in a second vector, as other threads
+// may still be reading the old one for their part of q. Every sqrt(n)
+// iterations, r, w, s and z are worked out afresh from x and p, which
+// costs two more barriers.
+*/    
+    
+    #pragma omp parallel
+    {
+        FLPT alpha = 1.0, beta = 0.0; // Variables used in the equation.
+        FLPT gamma, gammaold = 1.0, delta0; // gamma = rTr.
+        FLPT dsums[2]; // rTr and wTr, first for this thread, then for all.
+        INTG iset = 0; // Which set of slots dteamsums uses next.
+        INTG iw = 0; // Which of dwvectors holds w.
+        INTG imycount = 0; // The iteration count.
+        INTG lstart, lend; // The block of rows this thread owns.
+        INTG j; // Iteration variable.
+        rowblock(ivectorsize, &lstart, &lend);
+        
+        drowblockdot(ucdsa, dvectx0, dqvector, lstart, lend); // q = Ax.
+        for (j = lstart; j < lend; j++)
+        {
+            drvector[j] = dvectb[j] - dqvector[j]; // r = b - Ax
+            dvectx[j] = dvectx0[j]; // x = x0
+            ddvector[j] = 0.0; // With beta 0, p = r and so on.
+            dsvector[j] = 0.0;
+            dzvector[j] = 0.0;
+        }
+        #pragma omp barrier
+        dsums[1] = drowblockdot(ucdsa, drvector, dwvectors[iw], lstart, 
+            lend); // w = Ar, wTr
+        dsums[0] = 0.0;
+        for (j = lstart; j < lend; j++)
+        {
+            dsums[0] += drvector[j] * drvector[j];
+        }
+        dteamsums(&(dslots[iset * 2 * inoslots]), 2, dsums);
+        iset = 1 - iset;
+        gamma = dsums[0];
+        delta0 = gamma; // delta0 = gamma
+        #pragma omp single nowait
+        printf("Start loop:\n");
+        while((gamma > derror) || (gamma > (derror * derror * derror * derror * delta0))) // gamma > e2delta0 
+        {
+            const FLPT * dwvector = dwvectors[iw]; // w.
+            FLPT * dwnext = dwvectors[1 - iw]; // The next w.
+            drowblockdot(ucdsa, dwvector, dqvector, lstart, lend); // q = Aw.
+            if (imycount > 0)
+            {
+                beta = gamma / gammaold;
+                alpha = gamma / (dsums[1] - (beta * gamma / alpha));
+            }
+            else
+            {
+                alpha = gamma / dsums[1];
+            }
+            gammaold = gamma;
+            dsums[0] = 0.0;
+            dsums[1] = 0.0;
+            for (j = lstart; j < lend; j++)
+            {
+                dzvector[j] = dqvector[j] + beta * dzvector[j]; // z = q + beta.z
+                dsvector[j] = dwvector[j] + beta * dsvector[j]; // s = w + beta.s
+                ddvector[j] = drvector[j] + beta * ddvector[j]; // p = r + beta.p
+                dvectx[j] += alpha * ddvector[j]; // x = x + alpha.p
+                drvector[j] -= alpha * dsvector[j]; // r = r - alpha.s
+                dwnext[j] = dwvector[j] - alpha * dzvector[j]; // w = w - alpha.z
+                dsums[0] += drvector[j] * drvector[j];
+                dsums[1] += dwnext[j] * drvector[j];
+            }
+            iw = 1 - iw;
+            imycount = imycount + 1;
+            if ((imycount % isquareroot) == 0)
+            {
+                #pragma omp barrier
+                drowblockdot(ucdsa, dvectx, dqvector, lstart, lend); // q = Ax.
+                drowblockdot(ucdsa, ddvector, dsvector, lstart, lend); // s = Ap.
+                for (j = lstart; j < lend; j++)
+                {
+                    drvector[j] = dvectb[j] - dqvector[j]; // r = b - Ax
+                }
+                #pragma omp barrier
+                dsums[1] = drowblockdot(ucdsa, drvector, dwnext, lstart, 
+                    lend); // w = Ar, wTr
+                drowblockdot(ucdsa, dsvector, dzvector, lstart, lend); // z = As.
+                dsums[0] = 0.0;
+                for (j = lstart; j < lend; j++)
+                {
+                    dsums[0] += drvector[j] * drvector[j];
+                }
+            }
+            dteamsums(&(dslots[iset * 2 * inoslots]), 2, dsums); // rTr, wTr
+            iset = 1 - iset;
+            gamma = dsums[0];
+            if (imycount > ivectorsize)
+            {
+                break;
+            }
+        }
+        #pragma omp master
+        icount = imycount;
+    }
+    vunassign(dslots);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ourws->tlastsolve = timespecDiff(&end, &start);
+    ourws->ttotalsolve += ourws->tlastsolve;
+    ourws->inosolves++;
+    ourws->ilastiter = icount;
+    if (inoiter != NULL)
+    {
+        *inoiter = icount;
+    }
+    return dvectx;
+}
+
+/*
+// The bgramucds function sets dgram (of inovects * inovects) to the dot
+// products of each pair of the inovects vectors (of size lvectsize, one
+// after another) in dvects. The rows are cut into blocks of UCDSDETBLOCK,
+// whatever the number of threads, and each block works out all of its
+// products while its rows are in cache; the block sums for each pair 
+// are then added with dsumpartials, so the result does not depend on the
+// threads. It returns 1, or 0 if there is no memory for the block sums.
+*/
+
+static INTG bgramucds(const INTG lvectsize, const INTG inovects, 
+    const FLPT * dvects, FLPT * dgram)
+{
+    INTG a, b, l; /* Iteration variables. */
+    const INTG lnoblocks = (lvectsize + UCDSDETBLOCK - 1) / UCDSDETBLOCK;
+    const INTG inopairs = inovects * (inovects + 1) / 2;
+    FLPT * dpartials = dassign(lnoblocks * inopairs); /* Pair by pair. */
+    if (dpartials == NULL)
+    {
+        return 0;
+    }
+    #pragma omp parallel for private(a, b) schedule(static)
+    for (l = 0; l < lnoblocks; l++)
+    {
+        const INTG lfrom = l * UCDSDETBLOCK;
+        const INTG lto = min(lvectsize, lfrom + UCDSDETBLOCK);
+        INTG ipair = 0; /* The pair (a, b). */
+        for (a = 0; a < inovects; a++)
+        {
+            const FLPT * dfirst = &(dvects[a * lvectsize]);
+            for (b = a; b < inovects; b++)
+            {
+                const FLPT * dsecond = &(dvects[b * lvectsize]);
+                FLPT dsum = 0.0; /* The sum for the block. */
+                INTG j; /* Iteration variable. */
+                #pragma omp simd reduction(+:dsum)
+                for (j = lfrom; j < lto; j++)
+                {
+                    dsum += dfirst[j] * dsecond[j];
+                }
+                dpartials[(ipair * lnoblocks) + l] = dsum;
+                ipair++;
+            }
+        }
+    }
+    l = 0;
+    for (a = 0; a < inovects; a++)
+    {
+        for (b = a; b < inovects; b++)
+        {
+            dgram[(a * inovects) + b] = dsumpartials(lnoblocks, 
+                &(dpartials[l * lnoblocks]));
+            dgram[(b * inovects) + a] = dgram[(a * inovects) + b];
+            l++;
+        }
+    }
+    vunassign(dpartials);
+    return 1;
+}
+
+/*
+// The dgramform function returns uT G v for coordinates u and v (of 
+// size inovects) and the matrix G of bgramucds.
+*/
+
+static inline FLPT dgramform(const INTG inovects, const FLPT * dgram, 
+    const FLPT * du, const FLPT * dv)
+{
+    INTG a, b; /* Iteration variables. */
+    FLPT dsum = 0.0; /* The result. */
+    for (a = 0; a < inovects; a++)
+    {
+        FLPT drow = 0.0; /* Row a of G times v. */
+        for (b = 0; b < inovects; b++)
+        {
+            drow += dgram[(a * inovects) + b] * dv[b];
+        }
+        dsum += du[a] * drow;
+    }
+    return dsum;
+}
+
+FLPT * dconjgradsstep(cgworkspace * ourws, const ucds * ucdsa, 
+    const FLPT * dvectb, const FLPT *dvectx0, FLPT * dvectx, 
+    const INTG isteps, const FLPT derror, INTG * inoiter)
+{
+    if ((ourws == NULL) || (ucdsa == NULL) || (dvectb == NULL) ||
+        (dvectx0 == NULL) || (dvectx == NULL) || (isteps < 1) ||
+        (isteps > UCDSMAXSSTEP) || (ourws->lvectsize != ucdsa->lmatsize) || 
+        (ourws->inobasis < (2 * isteps) + 1) || (ucdsa->istorage != UCDSFULL))
+    {
+        return NULL;
+    }
+    const INTG ivectorsize = ucdsa->lmatsize; // The size of matrices and vectors. 
+    const INTG inovects = 2 * isteps + 1; // The basis: p, Ap, ..., r, Ar, ...
+    FLPT * dbasis = ourws->dbasis;
+    struct timespec start, end; // For timing the solve.
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    INTG i, j, k; // Iteration variables.
+    const INTG isquareroot = floor(sqrt(ivectorsize * 1.0)); // The square root of the size.
+    FLPT * drvector = ourws->drvector;
+    FLPT * ddvector = ourws->ddvector;
+    FLPT * dbandaproduct = ourws->dbandaproduct;
+    FLPT dgram[(2 * UCDSMAXSSTEP + 1) * (2 * UCDSMAXSSTEP + 1)]; // G = VTV.
+    FLPT dxcoord[2 * UCDSMAXSSTEP + 1]; // x, r, d and Ad in the basis.
+    FLPT drcoord[2 * UCDSMAXSSTEP + 1];
+    FLPT ddcoord[2 * UCDSMAXSSTEP + 1];
+    FLPT dadcoord[2 * UCDSMAXSSTEP + 1];
+    FLPT alpha, beta, ddad, dscale = 0.0; // Variables used in the equation.
+    FLPT deltanew, deltaold, delta0;
+    INTG icount = 0; // The iteration count.
+    INTG ilastcheck = 0; // The count when r was last found from x.
+    INTG bfailed = 0; // Whether memory ran out, or d = r gives dTAd <= 0.
+    INTG brestarted = 0; // Whether d has just been reset to r.
+    INTG bfirstfail; // Whether not even the first step could be taken.
+    
+/* 
+// The basis is scaled by 1 / dscale, a bound (from the row sums) on the 
+// largest eigenvalue, so that its vectors stay of about the same size.
+// Then Av_k = dscale.v_(k+1) for each vector but the last of each part.
+*/    
+    
+    #pragma omp parallel for private(i) reduction(max:dscale) schedule(static)
+    for (j = 0; j < ivectorsize; j++)
+    {
+        FLPT drowsum = 0.0; /* The row sum. */
+        for (i = 0; i < ucdsa->lnumdiag; i++)
+        {
+            const INTG lcol = j + ucdsa->ldiagindices[i];
+            if ((lcol >= 0) && (lcol < ivectorsize))
+            {
+                drowsum += fabs(ucdsa->ddiagelems[(i * ivectorsize) + lcol]);
+            }
+        }
+        dscale = max(dscale, drowsum);
+    }
+    dscale = (dscale > 0.0) ? dscale : 1.0;
+    dveccopy (ivectorsize, dvectx, dvectx0); // x = x0
+    multiply_ucdsrow(ucdsa, dvectx, dbandaproduct); // bandvector = Ax.
+    dvectsub (ivectorsize, dvectb, dbandaproduct, drvector); // r = b - Ax
+    deltanew = dselfdprod(ivectorsize, drvector); //deltanew = rTr
+    dveccopy (ivectorsize, ddvector, drvector); // d = r
+    delta0 = deltanew; // delta0 = deltanew
+    printf("Start loop:\n");
+    while((deltanew > derror) || (deltanew > (derror * derror * derror * derror * delta0))) // deltanew > e2delta0 
+    {
+    
+/* 
+// V = [d, Ad, ..., A^s d, r, Ar, ..., A^(s-1) r] (scaled) by the matrix 
+// powers kernel, and one block of dot products for G = VTV.
+*/    
+    
+        matpowers_ucds(ucdsa, ddvector, isteps, 1.0 / dscale, dbasis);
+        matpowers_ucds(ucdsa, drvector, isteps - 1, 1.0 / dscale, 
+            &(dbasis[(isteps + 1) * ivectorsize]));
+        if (!bgramucds(ivectorsize, inovects, dbasis, dgram))
+        {
+            bfailed = 1;
+            break;
+        }
+        for (i = 0; i < inovects; i++)
+        {
+            dxcoord[i] = 0.0;
+            drcoord[i] = (i == isteps + 1) ? 1.0 : 0.0;
+            ddcoord[i] = (i == 0) ? 1.0 : 0.0;
+        }
+        bfirstfail = 0;
+        
+/* The s steps of CG, on the coordinates, with rTr and dTAd from G. */        
+        
+        for (k = 0; k < isteps; k++)
+        {
+            for (i = 0; i < inovects; i++) // Ad, by shifting each part up.
+            {
+                dadcoord[i] = ((i == 0) || (i == isteps + 1)) ? 0.0 : 
+                    dscale * ddcoord[i - 1];
+            }
+            ddad = dgramform(inovects, dgram, ddcoord, dadcoord); // dTAd
+            if (!(ddad > 0.0))
+            {
+                bfirstfail = (k == 0);
+                break; // Rounding has swamped G; see below.
+            }
+            alpha = deltanew / ddad; // alpha = deltanew / dTAd
+            deltaold = deltanew;
+            for (i = 0; i < inovects; i++)
+            {
+                dxcoord[i] += alpha * ddcoord[i]; // x = x + alpha.d
+                drcoord[i] -= alpha * dadcoord[i]; // r = r - alpha.Ad
+            }
+            deltanew = dgramform(inovects, dgram, drcoord, drcoord); // deltanew = rTr
+            beta = (deltanew > 0.0) ? (deltanew / deltaold) : 0.0; // Or d = r.
+            for (i = 0; i < inovects; i++)
+            {
+                ddcoord[i] = drcoord[i] + beta * ddcoord[i]; // d = r + beta.d
+            }
+            icount = icount + 1;
+            if (!(deltanew > 0.0))
+            {
+                break;
+            }
+            if (!((deltanew > derror) || (deltanew > (derror * derror * 
+                derror * derror * delta0))) || (icount > ivectorsize))
+            {
+                break;
+            }
+        }
+        
+/* 
+// If not even the first step could be taken, start again from d = r; if
+// d was r already, A is not positive definite (or rounding has swamped
+// it), so give up rather than build the same basis forever.
+*/        
+        
+        if (bfirstfail)
+        {
+            if (brestarted)
+            {
+                bfailed = 1;
+                break;
+            }
+            dveccopy (ivectorsize, ddvector, drvector); // d = r
+            brestarted = 1;
+            continue;
+        }
+        brestarted = 0;
+        
+/* Back from the coordinates: x = x + Vx', r = Vr', d = Vd'. */        
+        
+        #pragma omp parallel for private(i) schedule(static)
+        for (j = 0; j < ivectorsize; j++)
+        {
+            FLPT dx = dvectx[j], dr = 0.0, dd = 0.0; /* The sums. */
+            for (i = 0; i < inovects; i++)
+            {
+                const FLPT dv = dbasis[(i * ivectorsize) + j];
+                dx += dxcoord[i] * dv;
+                dr += drcoord[i] * dv;
+                dd += ddcoord[i] * dv;
+            }
+            dvectx[j] = dx;
+            drvector[j] = dr;
+            ddvector[j] = dd;
+        }
+        if ((icount / isquareroot) != (ilastcheck / isquareroot))
+        {
+            multiply_ucdsrow(ucdsa, dvectx, dbandaproduct); // bandvector = Ax.
+            #pragma omp parallel for schedule(static)
+            for (j = 0; j < ivectorsize; j++)
+            {
+                const FLPT dtrue = dvectb[j] - dbandaproduct[j]; // r = b - Ax
+                ddvector[j] += dtrue - drvector[j]; // d = r + beta.d, for it
+                drvector[j] = dtrue;
+            }
+            ilastcheck = icount;
+        }
+        deltanew = dselfdprod(ivectorsize, drvector); //deltanew = rTr, more exactly than from G
+        if (icount > ivectorsize)
+        {
+            break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ourws->tlastsolve = timespecDiff(&end, &start);
+    ourws->ttotalsolve += ourws->tlastsolve;
+    ourws->inosolves++;
+    ourws->ilastiter = icount;
+    if (inoiter != NULL)
+    {
+        *inoiter = icount;
+    }
+    return bfailed ? NULL : dvectx;
+}
+
+/*
+// The dgramsums function sets dgram (of inosums entries) from the block
+// sums in dpartials (lnoblocks for each entry) with dsumpartials, so that
+// the Gram matrices of the block CG do not depend on the threads.
+*/
+
+static void dgramsums(const INTG lnoblocks, const INTG inosums,
+    FLPT * dpartials, FLPT * dgram)
+{
+    INTG a; /* Iteration variable. */
+    for (a = 0; a < inosums; a++)
     {
-        rhos[(icount - 1) % 2] = dselfdprod(ivectorsize, drvectors[(icount - 1) % 2]);
-        if (icount == 1)
+        dgram[a] = dsumpartials(lnoblocks, &(dpartials[a * lnoblocks]));
+    }
+}
+
+/*
+// The dsmallfactor function makes an LDLT factorisation of SMS, for M (of
+// inovects * inovects) symmetric and positive semidefinite and S the
+// diagonal that scales the diagonal of M to ones. It puts L (below the 
+// diagonal) and D in dfactor, and S in dscales. A pivot below a small 
+// multiple of one is taken as zero, along with its column of L: the
+// vector it stands for has become dependent on the others, and keeping 
+// it would be mostly noise.
+*/
+
+static void dsmallfactor(const INTG inovects, const FLPT * dmat, 
+    FLPT * dfactor, FLPT * dscales)
+{
+    INTG a, b, c; /* Iteration variables. */
+    const FLPT dtiny = 1000.0 * ((sizeof(FLPT) == sizeof(float)) ? 
+        FLT_EPSILON : DBL_EPSILON);
+    for (a = 0; a < inovects; a++)
+    {
+        const FLPT ddiag = dmat[(a * inovects) + a];
+        dscales[a] = (ddiag > 0.0) ? (1.0 / sqrt(ddiag)) : 0.0;
+    }
+    for (a = 0; a < inovects; a++)
+    {
+        for (b = 0; b <= a; b++)
         {
-            dveccopy(ivectorsize, dpvector, drvectors[(icount - 1) % 2]);
+            FLPT dsum = dscales[a] * dmat[(a * inovects) + b] * dscales[b];
+            for (c = 0; c < b; c++) /* Less the sum of L_ac D_c L_bc. */
+            {
+                dsum -= dfactor[(a * inovects) + c] * 
+                    dfactor[(c * inovects) + c] * dfactor[(b * inovects) + c];
+            }
+            if (b < a)
+            {
+                const FLPT dpivot = dfactor[(b * inovects) + b];
+                dfactor[(a * inovects) + b] = (dpivot > 0.0) ? 
+                    (dsum / dpivot) : 0.0;
+            }
+            else
+            {
+                dfactor[(a * inovects) + a] = (dsum > dtiny) ? dsum : 0.0;
+            }
         }
-        else
+    }
+}
+
+/*
+// The dsmallsolve function overwrites the inovects * inovects matrix 
+// drhs with M^-1 drhs, through dsmallfactor; the solution is zero in the
+// direction of any pivot taken as zero.
+*/
+
+static void dsmallsolve(const INTG inovects, const FLPT * dmat, 
+    FLPT * drhs)
+{
+    INTG a, b, c; /* Iteration variables. */
+    FLPT dfactor[UCDSMAXRHS * UCDSMAXRHS]; /* L and D. */
+    FLPT dscales[UCDSMAXRHS]; /* S. */
+    dsmallfactor(inovects, dmat, dfactor, dscales);
+    for (c = 0; c < inovects; c++) /* Each column of drhs. */
+    {
+        for (a = 0; a < inovects; a++) /* L y = S rhs. */
         {
-            beta = rhos[(icount - 1) % 2]/rhos[icount % 2];
-            dscalarprod (ivectorsize, beta, dpvector, dbetapproduct);
-            dvectadd (ivectorsize, drvectors[(icount - 1) % 2], dbetapproduct, dpvector);
-            dveccopy(ivectorsize, dpvector, drvectors[(icount - 1) % 2]);
+            drhs[(a * inovects) + c] *= dscales[a];
+            for (b = 0; b < a; b++)
+            {
+                drhs[(a * inovects) + c] -= dfactor[(a * inovects) + b] * 
+                    drhs[(b * inovects) + c];
+            }
         }
-        fpucdsmult(ucdsa, dpvector, dqvector);
-        alpha = rhos[(icount - 1) % 2]/ddotprod(ivectorsize, dpvector, dqvector); 
-        daddinsitu (ivectorsize, dvectx, alpha, dpvector);
-        if ((icount % isquareroot) == 0)
+        for (a = 0; a < inovects; a++) /* D z = y. */
         {
-            fpucdsmult(ucdsa, dvectx, derrorcorrect);
-            daddtwosums (ivectorsize, drvectors[icount % 2], dvectb,
-                1.0, derrorcorrect, -1.0);            
+            const FLPT dpivot = dfactor[(a * inovects) + a];
+            drhs[(a * inovects) + c] = (dpivot > 0.0) ? 
+                (drhs[(a * inovects) + c] / dpivot) : 0.0;
         }
-        else
+        for (a = inovects - 1; a >= 0; a--) /* LT x' = z, x = S x'. */
         {
-            daddtwosums (ivectorsize, drvectors[icount % 2], drvectors[(icount - 1) % 2],
-                1.0, dqvector, -1.0 * alpha);
+            for (b = a + 1; b < inovects; b++)
+            {
+                drhs[(a * inovects) + c] -= dfactor[(b * inovects) + a] * 
+                    drhs[(b * inovects) + c];
+            }
         }
-        dnorm = dvectnorm (ivectorsize, imode, drvectors[icount % 2]);
-        if (dnorm < (derror)) // ?
+        for (a = 0; a < inovects; a++)
         {
-            printf("Delta0: %f; Delta0e2: %f; Norm; %f; Rho %f, %f\n", delta0, delta0 * derror * derror,
-                dnorm, rhos[(icount - 1) % 2], rhos[(icount) % 2]);
-            free(dpvector);
-            free(dqvector);
-            free(dbetapproduct);
-            free(drvectors[0]);
-            free(drvectors[1]);
-            free(derrorcorrect);
-            if (inoiter != NULL)
+            drhs[(a * inovects) + c] *= dscales[a];
+        }
+    }
+}
+
+/*
+// The dsmallorth function sets dtrans to T = S L^-T D^-1/2 from the 
+// dsmallfactor factorisation of the Gram matrix WTW of inovects vectors 
+// W, so that the vectors WT are orthonormal, except for those of the
+// pivots taken as zero, which are zero.
+*/
+
+static void dsmallorth(const INTG inovects, const FLPT * dgram, 
+    FLPT * dtrans)
+{
+    INTG a, b, c; /* Iteration variables. */
+    FLPT dfactor[UCDSMAXRHS * UCDSMAXRHS]; /* L and D. */
+    FLPT dscales[UCDSMAXRHS]; /* S. */
+    dsmallfactor(inovects, dgram, dfactor, dscales);
+    for (c = 0; c < inovects; c++) /* LT y = D^-1/2 e_c, column by column. */
+    {
+        const FLPT dpivot = dfactor[(c * inovects) + c];
+        for (a = inovects - 1; a >= 0; a--)
+        {
+            FLPT dvalue = ((a == c) && (dpivot > 0.0)) ? 
+                (1.0 / sqrt(dpivot)) : 0.0;
+            for (b = a + 1; b < inovects; b++)
             {
-                *inoiter = icount;
+                dvalue -= dfactor[(b * inovects) + a] * 
+                    dtrans[(b * inovects) + c];
             }
-            return dvectx;
+            dtrans[(a * inovects) + c] = dvalue;
+        }
+    }
+    for (a = 0; a < inovects; a++)
+    {
+        for (c = 0; c < inovects; c++)
+        {
+            dtrans[(a * inovects) + c] *= dscales[a];
         }
-        icount = icount + 1;
     }
 }
 
+/*
+// The dsmallmult function sets dresult to dleft (or its transpose, if 
+// btranspose) times dright, all inovects * inovects matrices.
 */
 
-// This is from painless conjugate gradient
+static void dsmallmult(const INTG inovects, const FLPT * dleft, 
+    const INTG btranspose, const FLPT * dright, FLPT * dresult)
+{
+    INTG a, b, c; /* Iteration variables. */
+    for (a = 0; a < inovects; a++)
+    {
+        for (b = 0; b < inovects; b++)
+        {
+            FLPT dsum = 0.0;
+            for (c = 0; c < inovects; c++)
+            {
+                dsum += (btranspose ? dleft[(c * inovects) + a] : 
+                    dleft[(a * inovects) + c]) * dright[(c * inovects) + b];
+            }
+            dresult[(a * inovects) + b] = dsum;
+        }
+    }
+}
 
-FLPT * dconjgrad(const ucds * ucdsa, const FLPT * dvectb, const FLPT *dvectx0,
-    FLPT * dvectx, fpmult fpucdsmult, fpnorm fpdnorm, 
-    INTG imode, const FLPT derror, INTG * inoiter)
+/*
+// The UCDSBLOCKGRAMS macro makes a function NAME that adds to dsums the
+// products of rows [lfrom, lto) of the interleaved vectors W (dwvects),
+// Q (dqvects) and R (drvects) that dblockmultgram needs, for K vectors 
+// each. For each vector a in turn, the products of its W and Q with all
+// K vectors are summed over the rows, so that the sums stay in registers
+// and the constant K lets the compiler unroll and vectorise the loop over
+// them. Of RTR, only the diagonal is summed; as WTW, WTQ (= WTAW) and QTQ
+// are symmetric, only their upper triangles are used.
+*/
+
+#define UCDSBLOCKGRAMS(NAME, K) \
+static void NAME(const INTG inovects, const FLPT * dwvects, \
+    const FLPT * dqvects, const FLPT * drvects, const INTG lfrom, \
+    const INTG lto, FLPT * dsums) \
+{ \
+    const INTG inoprods = K * K; \
+    INTG a, b, i; \
+    for (a = 0; a < K; a++) \
+    { \
+        FLPT dww[K], dwq[K], dwr[K], dqq[K], dqr[K], drr = 0.0; \
+        for (b = 0; b < K; b++) \
+        { \
+            dww[b] = dwq[b] = dwr[b] = dqq[b] = dqr[b] = 0.0; \
+        } \
+        for (i = lfrom; i < lto; i++) \
+        { \
+            const FLPT dwa = dwvects[(i * K) + a]; \
+            const FLPT dqa = dqvects[(i * K) + a]; \
+            for (b = 0; b < K; b++) \
+            { \
+                dww[b] += dwa * dwvects[(i * K) + b]; \
+                dwq[b] += dwa * dqvects[(i * K) + b]; \
+                dwr[b] += dwa * drvects[(i * K) + b]; \
+                dqq[b] += dqa * dqvects[(i * K) + b]; \
+                dqr[b] += dqa * drvects[(i * K) + b]; \
+            } \
+            drr += drvects[(i * K) + a] * drvects[(i * K) + a]; \
+        } \
+        for (b = 0; b < K; b++) \
+        { \
+            dsums[(a * K) + b] += dww[b]; \
+            dsums[inoprods + (a * K) + b] += dwq[b]; \
+            dsums[(2 * inoprods) + (a * K) + b] += dwr[b]; \
+            dsums[(3 * inoprods) + (a * K) + b] += dqq[b]; \
+            dsums[(4 * inoprods) + (a * K) + b] += dqr[b]; \
+        } \
+        dsums[(5 * inoprods) + (a * K) + a] += drr; \
+    } \
+}
+
+/*
+// The dblockgrams function does as the UCDSBLOCKGRAMS functions for any 
+// inovects. As its loops cannot be unrolled, it sums each product over 
+// the rows in turn, and only the upper triangles of WTW, WTQ and QTQ.
+*/
+
+static void dblockgrams(const INTG inovects, const FLPT * dwvects,
+    const FLPT * dqvects, const FLPT * drvects, const INTG lfrom,
+    const INTG lto, FLPT * dsums)
 {
-    FLPT alpha, beta = 0; // Variables used in the equation.
-    FLPT deltanew, deltaold, delta0 = 0;    
-    INTG icount = 0; // The iteration count. :
-    INTG ivectorsize = ucdsa->lmatsize; // The size of matrices and vectors. 
-    INTG isquareroot = floor(sqrt(ivectorsize * 1.0)); // The square root of the size.
-    FLPT * dqvector = dassign(ivectorsize);
-    FLPT * drvector = dassign(ivectorsize);
-    FLPT * ddvector = dassign(ivectorsize);
-    FLPT * dbandaproduct = dassign(ivectorsize);
-    fpucdsmult(ucdsa, dvectx0, dbandaproduct); // bandvector = Ax.
-    dvectsub (ivectorsize, dvectb, dbandaproduct, drvector); // r = b - Ax
-    dveccopy (ivectorsize, ddvector, drvector); // d = r
-    dveccopy (ivectorsize, dvectx, dvectx0); // x = x0
-    deltanew = dselfdprod(ivectorsize, drvector); //deltanew = rTr
-    delta0 = deltanew; // delta0 = deltanew
-    printf("Start loop:\n");
-    while((deltanew > derror) || (deltanew > (derror * derror * derror * derror * delta0))) // deltanew > e2delta0 
+    const INTG inoprods = inovects * inovects;
+    INTG a, b, i; /* Iteration variables. */
+    for (a = 0; a < inovects; a++)
     {
-  //      printf("Delta0: %f; Deltanew: %f; error; %f\n", delta0, deltanew, derror);
-        fpucdsmult(ucdsa, ddvector, dqvector); // q = Ad.
-        alpha = deltanew / ddotprod (ivectorsize, ddvector, dqvector); // alpha = deltanew / dTq
-        dtruesaxpy (ivectorsize, alpha, ddvector, 1.0, dvectx); // x = x + alpha.d
-        if ((icount % isquareroot) == 0)
+        for (b = 0; b < inovects; b++)
         {
-            fpucdsmult(ucdsa, dvectx, dbandaproduct); // bandvector = Ax.
-            dvectsub (ivectorsize, dvectb, dbandaproduct, drvector); // r = b - Ax           
+            FLPT dww = 0.0, dwq = 0.0, dqq = 0.0, dwr = 0.0, dqr = 0.0;
+            if (b >= a)
+            {
+                for (i = lfrom; i < lto; i++)
+                {
+                    const FLPT dwa = dwvects[(i * inovects) + a];
+                    const FLPT dqa = dqvects[(i * inovects) + a];
+                    const FLPT drb = drvects[(i * inovects) + b];
+                    dww += dwa * dwvects[(i * inovects) + b];
+                    dwq += dwa * dqvects[(i * inovects) + b];
+                    dqq += dqa * dqvects[(i * inovects) + b];
+                    dwr += dwa * drb;
+                    dqr += dqa * drb;
+                }
+            }
+            else
+            {
+                for (i = lfrom; i < lto; i++)
+                {
+                    const FLPT drb = drvects[(i * inovects) + b];
+                    dwr += dwvects[(i * inovects) + a] * drb;
+                    dqr += dqvects[(i * inovects) + a] * drb;
+                }
+            }
+            dsums[(a * inovects) + b] += dww;
+            dsums[inoprods + (a * inovects) + b] += dwq;
+            dsums[(2 * inoprods) + (a * inovects) + b] += dwr;
+            dsums[(3 * inoprods) + (a * inovects) + b] += dqq;
+            dsums[(4 * inoprods) + (a * inovects) + b] += dqr;
         }
-        else
+        FLPT drr = 0.0;
+        for (i = lfrom; i < lto; i++)
         {
-            dtruesaxpy (ivectorsize, -1.0 * alpha, dqvector, 1.0, drvector); // r = r - alpha.q
-        }        
+            drr += drvects[(i * inovects) + a] * drvects[(i * inovects) + a];
+        }
+        dsums[(5 * inoprods) + (a * inovects) + a] += drr;
+    }
+}
+
+UCDSBLOCKGRAMS(dblockgrams2, 2)
+UCDSBLOCKGRAMS(dblockgrams4, 4)
+UCDSBLOCKGRAMS(dblockgrams8, 8)
+UCDSBLOCKGRAMS(dblockgrams16, 16)
+
+/*
+// The dblockmultgram function is the first of the two passes over the 
+// vectors in each iteration of the block CG. It sets the interleaved 
+// vectors dqvects to A times dwvects (A being ucdsa) and, for each tile
+// of rows while it is still in cache, sums the products the iteration 
+// needs: dgrams is set to the six inovects * inovects matrices WTW, WTQ,
+// WTR, QTQ, QTR and RTR (only the diagonal of which is set), one after 
+// another, for W dwvects, Q dqvects and R drvects. As in bgramucds, the
+// sums are taken in blocks of UCDSDETBLOCK rows, kept in dpartials, and
+// added with dgramsums, so they do not depend on the threads.
+*/
+
+static void dblockmultgram(const ucds * ucdsa, const INTG inovects, 
+    const FLPT * dwvects, const FLPT * drvects, FLPT * dqvects, 
+    FLPT * dpartials, FLPT * dgrams)
+{
+    INTG l; /* Iteration variable. */
+    const INTG lvectsize = ucdsa->lmatsize;
+    const INTG lnoblocks = (lvectsize + UCDSDETBLOCK - 1) / UCDSDETBLOCK;
+    const INTG inoprods = inovects * inovects;
+    const INTG ltile = max(1, min(UCDSDETBLOCK, UCDSMULTITILE / inovects));
+    INTG a, b; /* Iteration variables. */
+    #pragma omp parallel for schedule(static)
+    for (l = 0; l < lnoblocks; l++)
+    {
+        const INTG lto = min(lvectsize, (l + 1) * UCDSDETBLOCK);
+        FLPT dsums[6 * UCDSMAXRHS * UCDSMAXRHS]; /* The block's sums. */
+        INTG c, lrow; /* Iteration variables. */
+        for (c = 0; c < 6 * inoprods; c++)
+        {
+            dsums[c] = 0.0;
+        }
+        for (lrow = l * UCDSDETBLOCK; lrow < lto; lrow += ltile)
+        {
+            const INTG lrowend = min(lto, lrow + ltile);
+            ucdsmultiblock(ucdsa, inovects, dwvects, dqvects, lrow, lrowend);
+            switch (inovects)
+            {
+                case 2:
+                    dblockgrams2(inovects, dwvects, dqvects, drvects, lrow,
+                        lrowend, dsums);
+                    break;
+                case 4:
+                    dblockgrams4(inovects, dwvects, dqvects, drvects, lrow,
+                        lrowend, dsums);
+                    break;
+                case 8:
+                    dblockgrams8(inovects, dwvects, dqvects, drvects, lrow,
+                        lrowend, dsums);
+                    break;
+                case 16:
+                    dblockgrams16(inovects, dwvects, dqvects, drvects, lrow,
+                        lrowend, dsums);
+                    break;
+                default:
+                    dblockgrams(inovects, dwvects, dqvects, drvects, lrow,
+                        lrowend, dsums);
+            }
+        }
+        for (c = 0; c < 6 * inoprods; c++)
+        {
+            dpartials[(c * lnoblocks) + l] = dsums[c];
+        }
+    }
+    dgramsums(lnoblocks, 6 * inoprods, dpartials, dgrams);
+    for (a = 0; a < inovects; a++) /* The lower triangles, from the upper. */
+    {
+        for (b = 0; b < a; b++)
+        {
+            dgrams[(a * inovects) + b] = dgrams[(b * inovects) + a];
+            dgrams[inoprods + (a * inovects) + b] = 
+                dgrams[inoprods + (b * inovects) + a];
+            dgrams[(3 * inoprods) + (a * inovects) + b] = 
+                dgrams[(3 * inoprods) + (b * inovects) + a];
+        }
+    }
+}
+
+/*
+// The UCDSBLOCKUPDATE macro makes a function NAME for the second pass of
+// each iteration of the block CG, with K vectors. For each row, it sets 
+// X = X + W.alpha, R = R - Q.alpha and then W = R + W.beta (with the old
+// W), for the inovects * inovects matrices dalpha and dbeta. The new
+// values are worked out UCDSBLOCKCOLS columns at a time, so they stay in
+// registers, and the new W is only stored once its old row is used up.
+*/
+
+#define UCDSBLOCKCOLS 4
+
+#define UCDSBLOCKUPDATE(NAME, K) \
+static void NAME(const INTG lvectsize, const INTG inovects, \
+    const FLPT * dalpha, const FLPT * dbeta, const FLPT * dqvects, \
+    FLPT * dvectsx, FLPT * drvects, FLPT * dwvects) \
+{ \
+    FLPT dalphas[UCDSMAXRHS * UCDSMAXRHS], dbetas[UCDSMAXRHS * UCDSMAXRHS]; \
+    INTG i; \
+    for (i = 0; i < K * K; i++) \
+    { \
+        dalphas[i] = dalpha[i]; \
+        dbetas[i] = dbeta[i]; \
+    } \
+    _Pragma("omp parallel for schedule(static)") \
+    for (i = 0; i < lvectsize; i++) \
+    { \
+        INTG a, c, v; \
+        const FLPT * dwrow = &(dwvects[i * K]); \
+        const FLPT * dqrow = &(dqvects[i * K]); \
+        FLPT dwnew[UCDSMAXRHS]; /* The new row of W, but its last columns. */ \
+        for (c = 0; c < K; c += UCDSBLOCKCOLS) \
+        { \
+            const INTG cend = min(K, c + UCDSBLOCKCOLS); \
+            FLPT dx[UCDSBLOCKCOLS], dr[UCDSBLOCKCOLS]; \
+            FLPT dwbeta[UCDSBLOCKCOLS]; \
+            for (v = c; v < cend; v++) \
+            { \
+                dx[v - c] = dvectsx[(i * K) + v] + (dwrow[0] * dalphas[v]); \
+                dr[v - c] = drvects[(i * K) + v] - (dqrow[0] * dalphas[v]); \
+                dwbeta[v - c] = dwrow[0] * dbetas[v]; \
+            } \
+            for (a = 1; a < K; a++) \
+            { \
+                for (v = c; v < cend; v++) \
+                { \
+                    dx[v - c] += dwrow[a] * dalphas[(a * K) + v]; \
+                    dr[v - c] -= dqrow[a] * dalphas[(a * K) + v]; \
+                    dwbeta[v - c] += dwrow[a] * dbetas[(a * K) + v]; \
+                } \
+            } \
+            for (v = c; v < cend; v++) \
+            { \
+                dvectsx[(i * K) + v] = dx[v - c]; \
+                drvects[(i * K) + v] = dr[v - c]; \
+                if (cend == K) /* No later columns need the old W. */ \
+                { \
+                    dwvects[(i * K) + v] = dr[v - c] + dwbeta[v - c]; \
+                } \
+                else \
+                { \
+                    dwnew[v] = dr[v - c] + dwbeta[v - c]; \
+                } \
+            } \
+        } \
+        for (v = 0; v < ((K - 1) / UCDSBLOCKCOLS) * UCDSBLOCKCOLS; v++) \
+        { \
+            dwvects[(i * K) + v] = dwnew[v]; \
+        } \
+    } \
+}
+
+UCDSBLOCKUPDATE(dblockupdaterows, inovects)
+UCDSBLOCKUPDATE(dblockupdaterows2, 2)
+UCDSBLOCKUPDATE(dblockupdaterows4, 4)
+UCDSBLOCKUPDATE(dblockupdaterows8, 8)
+UCDSBLOCKUPDATE(dblockupdaterows16, 16)
+
+/*
+// The dblockupdate function calls the UCDSBLOCKUPDATE function for 
+// inovects.
+*/
+
+static void dblockupdate(const INTG lvectsize, const INTG inovects, 
+    const FLPT * dalpha, const FLPT * dbeta, const FLPT * dqvects, 
+    FLPT * dvectsx, FLPT * drvects, FLPT * dwvects)
+{
+    switch (inovects)
+    {
+        case 2:
+            dblockupdaterows2(lvectsize, inovects, dalpha, dbeta, dqvects,
+                dvectsx, drvects, dwvects);
+            break;
+        case 4:
+            dblockupdaterows4(lvectsize, inovects, dalpha, dbeta, dqvects,
+                dvectsx, drvects, dwvects);
+            break;
+        case 8:
+            dblockupdaterows8(lvectsize, inovects, dalpha, dbeta, dqvects,
+                dvectsx, drvects, dwvects);
+            break;
+        case 16:
+            dblockupdaterows16(lvectsize, inovects, dalpha, dbeta, dqvects,
+                dvectsx, drvects, dwvects);
+            break;
+        default:
+            dblockupdaterows(lvectsize, inovects, dalpha, dbeta, dqvects,
+                dvectsx, drvects, dwvects);
+    }
+}
+
+FLPT * dconjgradblockws(cgworkspace * ourws, const ucds * ucdsa, 
+    const INTG inovects, const FLPT * dvectsb, const FLPT * dvectsx0, 
+    FLPT * dvectsx, const FLPT derror, INTG * inoiter)
+{
+    if ((ourws == NULL) || (ucdsa == NULL) || (dvectsb == NULL) || 
+        (dvectsx0 == NULL) || (dvectsx == NULL) || (inovects < 1) || 
+        (inovects > UCDSMAXRHS) || (ourws->lvectsize != ucdsa->lmatsize) ||
+        (ourws->inobasis < 3 * inovects) || (ourws->inogram < inovects) ||
+        ((ucdsa->istorage != UCDSFULL) && (ucdsa->istorage != UCDSCONST)))
+    {
+        return NULL;
+    }
+    struct timespec start, end; // For timing the solve.
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    const INTG ivectorsize = ucdsa->lmatsize; // The size of matrices and vectors. 
+    const INTG lsize = ivectorsize * inovects; // The size of each block.
+    const INTG inoprods = inovects * inovects; // The size of each small matrix.
+    const INTG isquareroot = floor(sqrt(ivectorsize * 1.0)); // The square root of the size.
+    FLPT * dqvectors = ourws->dbasis; // Q = AW.
+    FLPT * drvectors = &(ourws->dbasis[lsize]); // R = B - AX.
+    FLPT * dwvectors = &(ourws->dbasis[2 * lsize]); // W, so that P = WT.
+    FLPT dgrams[6 * UCDSMAXRHS * UCDSMAXRHS]; // WTW, WTQ, WTR, QTQ, QTR, RTR.
+    const FLPT * dgramww = dgrams;
+    const FLPT * dgramwq = &(dgrams[inoprods]);
+    const FLPT * dgramwr = &(dgrams[2 * inoprods]);
+    const FLPT * dgramqq = &(dgrams[3 * inoprods]);
+    const FLPT * dgramqr = &(dgrams[4 * inoprods]);
+    const FLPT * dgramrr = &(dgrams[5 * inoprods]);
+    FLPT dtrans[UCDSMAXRHS * UCDSMAXRHS]; // T, so that P = WT.
+    FLPT dptap[UCDSMAXRHS * UCDSMAXRHS]; // PTAP = TT WTQ T.
+    FLPT dalpha[UCDSMAXRHS * UCDSMAXRHS]; // alpha, for W.
+    FLPT dbeta[UCDSMAXRHS * UCDSMAXRHS]; // beta, for W.
+    FLPT dsmall[UCDSMAXRHS * UCDSMAXRHS]; // Working space.
+    FLPT delta0[UCDSMAXRHS]; // The first rTr of each system.
+    INTG icount = 0; // The iteration count.
+    INTG bdone = 0; // Whether every system has met the test of dconjgrad.
+    INTG v; // Iteration variable.
+    dveccopy (lsize, dvectsx, dvectsx0); // X = X0
+    multiply_ucds_multi(ucdsa, inovects, dvectsx, dqvectors); // Q = AX.
+    dvectsub (lsize, dvectsb, dqvectors, drvectors); // R = B - AX
+    dveccopy (lsize, dwvectors, drvectors); // W = R
+    while (1)
+    {
+        dblockmultgram(ucdsa, inovects, dwvectors, drvectors, dqvectors, 
+            ourws->dgrampartials, dgrams); // Q = AW, and the Gram matrices.
+        if (icount == 0)
+        {
+            for (v = 0; v < inovects; v++)
+            {
+                delta0[v] = dgramrr[(v * inovects) + v];
+            }
+        }
+        bdone = 1; // The test of dconjgrad, for every system.
+        for (v = 0; v < inovects; v++)
+        {
+            const FLPT dnew = dgramrr[(v * inovects) + v]; // rTr for system v.
+            if ((dnew > derror) || (dnew > (derror * derror * derror * 
+                derror * delta0[v])))
+            {
+                bdone = 0;
+            }
+        }
+        if (bdone || (icount > ivectorsize))
+        {
+            break;
+        }
         
-        deltaold = deltanew;
-        deltanew = dselfdprod(ivectorsize, drvector); //deltanew = rTr
-        beta = deltanew / deltaold;
-        dtruesaxpy (ivectorsize, 1.0, drvector, beta, ddvector); // d = r + beta.d
+/* 
+// alpha (for P) = (PTAP)^-1 PTR, and for W it is T times that. The new R
+// is R - Q.alpha, so QTR for it is QTR - QTQ.alpha, and beta (for P) = 
+// -(PTAP)^-1 PTAR = -(PTAP)^-1 TT QTR. Then W = R + P.beta = R + WT.beta.
+*/        
+        
+        dsmallorth(inovects, dgramww, dtrans);
+        dsmallmult(inovects, dtrans, 1, dgramwq, dsmall);
+        dsmallmult(inovects, dsmall, 0, dtrans, dptap); // PTAP = TT WTQ T
+        dsmallmult(inovects, dtrans, 1, dgramwr, dsmall); // PTR = TT WTR
+        dsmallsolve(inovects, dptap, dsmall);
+        dsmallmult(inovects, dtrans, 0, dsmall, dalpha); // T alpha
+        dsmallmult(inovects, dgramqq, 0, dalpha, dsmall);
+        for (v = 0; v < inoprods; v++)
+        {
+            dsmall[v] = dgramqr[v] - dsmall[v]; // QTR for the new R
+        }
+        dsmallmult(inovects, dtrans, 1, dsmall, dbeta); // PTAR = TT QTR
+        dsmallsolve(inovects, dptap, dbeta);
+        dsmallmult(inovects, dtrans, 0, dbeta, dsmall); // -T beta
+        for (v = 0; v < inoprods; v++)
+        {
+            dbeta[v] = -dsmall[v];
+        }
+        dblockupdate(ivectorsize, inovects, dalpha, dbeta, dqvectors, 
+            dvectsx, drvectors, dwvectors);
         icount = icount + 1;
-  //      printf("alpha: %f; beta: %f\n", alpha, beta);
-        if (icount > ivectorsize)
+        if ((icount % isquareroot) == 0)
         {
-            break;
+            multiply_ucds_multi(ucdsa, inovects, dvectsx, dqvectors); // Q = AX.
+            dvectsub (lsize, dvectsb, dqvectors, drvectors); // R = B - AX
         }
     }
-    free(drvector);
-    free(dqvector);
-    free(ddvector);
-    free(dbandaproduct);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ourws->tlastsolve = timespecDiff(&end, &start);
+    ourws->ttotalsolve += ourws->tlastsolve;
+    ourws->inosolves++;
+    ourws->ilastiter = icount;
     if (inoiter != NULL)
     {
         *inoiter = icount;
     }
-    return dvectx;
+    return dvectsx;
+}
+
+/*
+// The bblockwins function returns whether dconjgradblock should solve 
+// inovects systems in ucdsa together. Block CG does more arithmetic per 
+// system than dconjgradws, so it only wins when dconjgradws is held up 
+// by memory: when its matrix and five vectors do not fit in cache (see 
+// UCDSBLOCKMINBYTES), and for the counts with unrolled sums (2, 4 and 8,
+// but not 4 with floats). The rest is left to dconjgradapart, which also
+// needs ucdsa to be UCDSFULL.
+*/
+
+static INTG bblockwins(const ucds * ucdsa, const INTG inovects)
+{
+    const INTG bsingle = (sizeof(FLPT) == sizeof(float));
+    const double dbytes = (ucdsa->lnumdiag + 5.0) * ucdsa->lmatsize * 
+        sizeof(FLPT); /* What dconjgradws moves each iteration. */
+    if (ucdsa->istorage != UCDSFULL)
+    {
+        return 1;
+    }
+    return (dbytes >= UCDSBLOCKMINBYTES) && ((inovects == 2) || 
+        ((inovects == 4) && !bsingle) || (inovects == 8));
+}
+
+/*
+// The dconjgradapart function does the work of dconjgradblock one system
+// at a time, with dconjgradws. *inoiter is set to the most iterations 
+// any of them took.
+*/
+
+static FLPT * dconjgradapart(const ucds * ucdsa, const INTG inovects, 
+    const FLPT * dvectsb, const FLPT * dvectsx0, FLPT * dvectsx, 
+    const FLPT derror, INTG * inoiter)
+{
+    const INTG lvectsize = ucdsa->lmatsize;
+    cgworkspace * ourws = create_cgworkspacebasis(lvectsize, 3 * inovects);
+    if (ourws == NULL)
+    {
+        return NULL;
+    }
+    FLPT * dvectorsb[UCDSMAXRHS]; /* B, X0 and X for each system. */
+    FLPT * dvectorsx0[UCDSMAXRHS];
+    FLPT * dvectorsx[UCDSMAXRHS];
+    FLPT * dresult = dvectsx;
+    INTG icount = 0, imaxiter = 0;
+    INTG v; /* Iteration variable. */
+    for (v = 0; v < inovects; v++)
+    {
+        dvectorsb[v] = &(ourws->dbasis[v * lvectsize]);
+        dvectorsx0[v] = &(ourws->dbasis[(inovects + v) * lvectsize]);
+        dvectorsx[v] = &(ourws->dbasis[((2 * inovects) + v) * lvectsize]);
+    }
+    ddeinterleave(lvectsize, inovects, dvectsb, dvectorsb);
+    ddeinterleave(lvectsize, inovects, dvectsx0, dvectorsx0);
+    for (v = 0; v < inovects; v++)
+    {
+        if (dconjgradws(ourws, ucdsa, dvectorsb[v], dvectorsx0[v], 
+            dvectorsx[v], &multiply_ucdsrow, dvectnorm, 2, derror, 
+            &icount) == NULL)
+        {
+            dresult = NULL;
+            break;
+        }
+        imaxiter = max(imaxiter, icount);
+    }
+    if (dresult != NULL)
+    {
+        dinterleave(lvectsize, inovects, dvectorsx, dvectsx);
+        if (inoiter != NULL)
+        {
+            *inoiter = imaxiter;
+        }
+    }
+    destroy_cgworkspace(ourws);
+    return dresult;
+}
 
+FLPT * dconjgradblock(const ucds * ucdsa, const INTG inovects, 
+    const FLPT * dvectsb, const FLPT * dvectsx0, FLPT * dvectsx, 
+    const FLPT derror, INTG * inoiter)
+{
+    if ((ucdsa == NULL) || (inovects < 1) || (inovects > UCDSMAXRHS))
+    {
+        return NULL;
+    }
+    if (!bblockwins(ucdsa, inovects))
+    {
+        return dconjgradapart(ucdsa, inovects, dvectsb, dvectsx0, dvectsx,
+            derror, inoiter);
+    }
+    cgworkspace * ourws = create_cgworkspaceblock(ucdsa->lmatsize, 
+        inovects);
+    FLPT * dresult = dconjgradblockws(ourws, ucdsa, inovects, dvectsb, 
+        dvectsx0, dvectsx, derror, inoiter);
+    destroy_cgworkspace(ourws);
+    return dresult;
 }
     
     
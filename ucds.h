@@ -32,8 +32,103 @@
 
 #define MINDIAGT27 14
 
+/* 
+// The ways the elements of a ucds can be stored (see the istorage member
+// of ucds below).
+*/
+
+#define UCDSFULL 0
+#define UCDSCONST 1
+#define UCDSSINGLE 2
+#define UCDSBF16 3
+
+/* The number of rows multiply_ucdsconst works on at a time. */
+
+#define UCDSCONSTTILE 512
+
+/* The most vectors multiply_ucds_multi can multiply at once. */
+
+#define UCDSMAXRHS 16
+
+/* 
+// The number of elements of each of the interleaved vectors that
+// multiply_ucds_multi works on at a time.
+*/
+
+#define UCDSMULTITILE 4096
+
+/* 
+// The width in bytes of the interleaved elements of a row from which
+// multiply_ucds_multi keeps sums for a row in registers.
+*/
+
+#define UCDSMULTIROWBYTES 64
+
+/* The default number of elements in the leaves of dpairwise. */
+
+#define UCDSPAIRLEAF 4096
+
+/* The smallest number of rows multiply_ucdstiled works on at a time. */
+
+#define UCDSMINTILE 1024
+
+/* The range of (odd) diagonal counts with fixed count kernels. */
+
+#define UCDSMINFIXED 3
+#define UCDSMAXFIXED 81
+
+/* The number of elements per block in deterministic reductions. */
+
+#define UCDSDETBLOCK 2048
+
+/* 
+// The most products matpowers_ucds works out, and steps dconjgradsstep
+// takes, at once.
+*/
+
+#define UCDSMAXPOWERS 16
+#define UCDSMAXSSTEP 8
+
+/* 
+// The fewest bytes (the matrix and five vectors) dconjgradws must move 
+// each iteration for dconjgradblock to solve its systems together. Where
+// it was tuned, dconjgradws took three to four times as long per byte 
+// above some 21 MiB as below, and block CG only won above it.
+*/
+
+#define UCDSBLOCKMINBYTES (21 * 1024 * 1024)
+
+/* The kinds of preconditioner create_ucdsprecond makes. */
+
+#define UCDSPRECSSOR 1
+#define UCDSPRECIC0 2
+
+/* 
+// The fewest rows per level (on average) for which apply_ucdsprecond 
+// runs its triangular solves level by level in parallel.
+*/
+
+#define UCDSMINLEVELROWS 64
+
 /* The following are definitions for vector related routines. */
 
+/*
+// The setdeterministic function turns deterministic mode on (bdetermine
+// nonzero) or off (the default); getdeterministic returns the mode. In
+// deterministic mode, the sums in ddotprod, dcgupdate, dvectnorm,
+// dreducenorm, dscalednorm and the fused multiplications are taken over
+// fixed blocks of UCDSDETBLOCK elements, and the block sums are added
+// pairwise in a fixed order, so a result does not depend on the number
+// of threads or how they are scheduled. The multiplication routines that
+// add into dret with atomics use multiply_ucdsrow instead. The max
+// reductions, daltnorm and dpairwise are deterministic in either mode.
+// The mode costs one small allocation per reduction.
+*/
+
+void setdeterministic(const INTG bdetermine);
+
+INTG getdeterministic(void);
+
 /*
 // The dsetvector routine creates and initialises a vector, so that
 // all values are set to one constant. The code is expressed as a
@@ -49,7 +144,7 @@ FLPT * dsetvector(const INTG isize, const FLPT dvalue);
 
 /*
 // The drandomvector does the same, except that the values are random
-// (between 0 and 1).
+// whole numbers from 0 to 9.
 */
 
 FLPT * drandomvector(const INTG isize);
@@ -62,10 +157,19 @@ FLPT * drandomvector(const INTG isize);
 
 FLPT * doverwritevector(const INTG isize, const FLPT dvalue, FLPT* dret);
 
-/* The doverwriterandom tries it with random vectors. */
+/* 
+// The doverwriterandom tries it with random vectors. Element i of a
+// random vector is found from i, the seed, and the number of random
+// vectors made since the seed was set, with a counter-based (SplitMix64)
+// generator. So the vectors are made in parallel, and are the same for 
+// any number of threads. The setrandomseed function sets the seed (the 
+// default is 0) and starts the sequence of vectors again.
+*/
 
 FLPT * doverwriterandom(const INTG isize, FLPT* dret);
 
+void setrandomseed(const uint64_t useed);
+
 /* 
 // The dveccopy copies a vector from one value to another. Arguments:
 // lvectsize: the size of the vector.
@@ -181,6 +285,48 @@ FLPT * daddinsitu (const INTG lvectsize, FLPT * doverwrite,
 FLPT * daddtwosums (const INTG lvectsize, FLPT * dadjust, 
     const FLPT *dleftvec, const FLPT dleftconst, 
     const FLPT * drightvec, const FLPT drightconst);
+
+/*
+// The dcgupdate function does the vector updates of a conjugate gradient
+// step in one pass: dvectx += dalpha * ddvector, drvector -= dalpha *
+// dqvector, and it returns the new drvector.drvector. Done separately,
+// these take three passes and seven vector streams; here they take one
+// pass and six. The direction update d = r + beta * d cannot join them, 
+// as beta needs the finished dot product.
+*/
+
+FLPT dcgupdate (const INTG lvectsize, const FLPT dalpha, 
+    const FLPT * ddvector, const FLPT * dqvector, FLPT * dvectx, 
+    FLPT * drvector);
+
+/*
+// The dpcgupdate function is dcgupdate for Jacobi preconditioned CG: as
+// well as updating dvectx and drvector, it sets dzvector to dinvdiag * 
+// drvector (element by element; dinvdiag holds the inverse of the main
+// diagonal, see jacobi_ucds), and it returns drvector.dzvector. The
+// djacobidot function does the last two steps alone.
+*/
+
+FLPT dpcgupdate (const INTG lvectsize, const FLPT dalpha, 
+    const FLPT * ddvector, const FLPT * dqvector, const FLPT * dinvdiag,
+    FLPT * dvectx, FLPT * drvector, FLPT * dzvector);
+
+FLPT djacobidot (const INTG lvectsize, const FLPT * dinvdiag, 
+    const FLPT * drvector, FLPT * dzvector);
+/*
+// The dinterleave function copies inovects vectors, each of size lvectsize,
+// into one "interleaved" vector dinterleaved of size lvectsize * inovects:
+// element i of vector j goes to dinterleaved[i*inovects + j]. The function
+// returns dinterleaved. The ddeinterleave function does the opposite, and
+// returns dvectors.
+*/
+
+FLPT * dinterleave (const INTG lvectsize, const INTG inovects, 
+    FLPT ** dvectors, FLPT * dinterleaved);
+
+FLPT ** ddeinterleave (const INTG lvectsize, const INTG inovects, 
+    const FLPT * dinterleaved, FLPT ** dvectors);
+
 /* 
 // The dvectnorm function calculates the norm of a vector. Arguments:
 // lvectsize: the size of the vector.
@@ -197,13 +343,70 @@ FLPT dvectnorm (const INTG lvectsize, const INTG mode,
 
 /* 
 // The daltnorm function is an alternative implementation of the vector
-// norm. It uses recursion instead of iteration. The arguments are
-// otherwise the same.
+// norm. It uses recursion instead of iteration (see dpairwise): the 
+// vector is halved until the pieces are no longer than the leaf size,
+// each piece is reduced with a SIMD loop, and the results are combined
+// back up the tree. The arguments are otherwise the same.
 */
 
 FLPT daltnorm (const INTG lvectsize, const INTG mode, 
     const FLPT * dvectin);
 
+/*
+// The fpleaf typedef is for functions that reduce lvectsize values of a
+// vector to one value (such as a sum), and the fpcombine typedef for
+// functions that combine two such results into one.
+*/
+
+typedef FLPT (* fpleaf) (const INTG, const FLPT *);
+
+typedef FLPT (* fpcombine) (const FLPT, const FLPT);
+
+/*
+// The dpairwise function reduces dvectin (of size lvectsize) to a value
+// by pairwise (tree) reduction. The vector is halved again and again, 
+// with one half of each split made an OpenMP task, until the pieces are
+// at most the leaf size. fpleaffn reduces each such piece, and
+// fpcombinefn combines the results of two halves, so the combining
+// function should be associative. The shape of the tree, and so the
+// rounding of the result, does not depend on the number of threads.
+//
+// The setpairwiseleaf function sets the leaf size (at least 1; the
+// default is UCDSPAIRLEAF) and getpairwiseleaf returns it. Smaller
+// leaves make more tasks; larger leaves make longer SIMD loops.
+*/
+
+FLPT dpairwise(const INTG lvectsize, const FLPT * dvectin, 
+    const fpleaf fpleaffn, const fpcombine fpcombinefn);
+
+void setpairwiseleaf(const INTG lleafsize);
+
+INTG getpairwiseleaf(void);
+
+/* 
+// The dreducenorm function is a faster implementation of the vector norm,
+// with the same arguments as dvectnorm. Each norm is one OpenMP SIMD
+// reduction: a sum of absolute values, a sum of squares (multiplied out,
+// rather than through pow), or a max reduction of absolute values. The
+// infinity norm of dvectnorm takes a critical section for every element
+// instead. dvectnorm is kept for comparison.
+*/
+
+FLPT dreducenorm (const INTG lvectsize, const INTG mode, 
+    const FLPT * dvectin);
+
+/* 
+// The dscalednorm function returns the 2-norm of dvectin without overflow
+// or underflow in the squares: the elements are divided by the largest
+// absolute value (found with dreducenorm) before squaring, and the result
+// multiplied back. It takes two passes over dvectin rather than one. If
+// the largest absolute value is 0, infinite or NaN, it is returned. The
+// elements are divided by it, not multiplied by its reciprocal, which
+// overflows when it is subnormal.
+*/
+
+FLPT dscalednorm (const INTG lvectsize, const FLPT * dvectin);
+
 /* Some thing: A */
 
 
@@ -230,6 +433,19 @@ FLPT * dvecoverwrite (const INTG lvectsize, FLPT * doverwrite,
 // array is ldiagindex*lmatsize, and the first element of the i-th diagonal
 // is at ddiagelems[i*lmatsize].
 //
+// - linteriorstart, linteriorend: the "interior" rows [linteriorstart,
+// linteriorend), where every diagonal lies inside the matrix. These are
+// worked out by create_ucds. Multiplication functions run these rows
+// without bounds tests, and deal with the remaining rows separately.
+//
+// - istorage: how ddiagelems is laid out. For UCDSFULL, it is as above.
+// For UCDSCONST (a "stencil" matrix, where every element of a diagonal
+// is the same), ddiagelems only holds lnumdiag values, one per diagonal.
+// For UCDSSINGLE and UCDSBF16 (see narrow_ucds), ddiagelems is NULL and
+// the elements are held in fdiagelems (as float) or udiagelems (as
+// bfloat16: the top 16 bits of a float) in the same layout as UCDSFULL.
+// Multiplication functions return NULL for storage they do not handle.
+//
 // Example: the following matrix: 
 //
 //                                [ 1 2 ]
@@ -244,6 +460,11 @@ typedef struct {
     INTG lnumdiag;
     INTG * ldiagindices; 
     FLPT *ddiagelems; 
+    INTG linteriorstart;
+    INTG linteriorend;
+    INTG istorage;
+    float * fdiagelems;
+    uint16_t * udiagelems;
 } ucds;
 
 /* 
@@ -265,11 +486,110 @@ typedef struct {
 // or contains repeated values.
 // Note 3: The destroy_ucds function can be used to deallocate the ucds
 // created here.
+// Note 4: the elements of ddiagelems start as zero. They are zeroed in
+// parallel with the row split of multiply_ucdsrow, so that on NUMA
+// machines each page lands on the node of the thread that multiplies
+// those rows (see dassignlocal).
 */
 
 ucds* create_ucds(const INTG lmatsize, INTG * ldiagindices, 
     const INTG lnumdiag);
 
+/* 
+// The create_ucdsconst function is like create_ucds, except that the ucds
+// created has UCDSCONST storage: ddiagelems has one value per diagonal,
+// rather than lmatsize.
+*/
+
+ucds* create_ucdsconst(const INTG lmatsize, INTG * ldiagindices, 
+    const INTG lnumdiag);
+
+/* 
+// The narrow_ucds function makes a copy of a UCDSFULL ucds with its
+// elements in a narrower format, to cut the memory traffic of
+// multiplication: istorage is UCDSSINGLE (float, half the size of a
+// double) or UCDSBF16 (bfloat16, 2 bytes). The vectors and the sums in
+// multiply_ucdssingle and multiply_ucdsbf16 are still FLPT, so the only
+// error is in rounding the elements (to nearest, ties to even). The copy
+// shares ldiagindices with ourucds. The function returns NULL if ourucds
+// is not UCDSFULL, istorage is not one of the two, or memory runs out.
+*/
+
+ucds* narrow_ucds(const ucds * ourucds, const INTG istorage);
+
+/* 
+// The jacobi_ucds function sets dinvdiag (of size lmatsize) to the 
+// inverses of the elements on the main (zero offset) diagonal of 
+// ourucds, whatever its storage: the Jacobi preconditioner. It returns 
+// dinvdiag, or NULL if ourucds has no main diagonal or a zero on it.
+*/
+
+FLPT * jacobi_ucds(const ucds * ourucds, FLPT * dinvdiag);
+
+/* 
+// A ucdsprecond is a preconditioner M = (D + L) D^-1 (D + L)^T for a 
+// symmetric ucds A, where D is diagonal and L strictly lower triangular.
+// L keeps the pattern of A: its diagonals are the negative offsets of 
+// A's ldiagindices. ourfactor holds L and D as a UCDSFULL ucds with those
+// offsets and 0 (in the layout of any ucds), and dinvdiag holds D^-1.
+//
+// The create_ucdsprecond function makes one for ucdsa (of any storage)
+// with itype either:
+//
+// - UCDSPRECSSOR: symmetric successive over-relaxation, where L is the 
+//   lower part of A and D is its main diagonal over domega (which must 
+//   lie in (0, 2); 1 gives symmetric Gauss-Seidel).
+// - UCDSPRECIC0: incomplete Cholesky with no fill, where L and D are
+//   chosen so that M matches A on the pattern of A (domega is ignored).
+//
+// It returns NULL if ucdsa has no main diagonal, domega is out of range,
+// a pivot of D is not positive (IC(0) can break down on matrices that
+// are not diagonally dominant), or memory runs out. destroy_ucdsprecond
+// frees one (and accepts NULL).
+//
+// The apply_ucdsprecond function sets dzvector to M^-1 drvector by a
+// forward solve with D + L and a backward solve with (D + L)^T. Rows are
+// split into levels (wavefronts): a row's level is one more than that of
+// the rows it needs, found from the nonzero elements of L, so the rows
+// of a level can be solved in parallel with a barrier between levels.
+// The levels are found once, by create_ucdsprecond. When there are too 
+// few rows per level (see UCDSMINLEVELROWS; as for a matrix whose first
+// subdiagonal has no zeros), the solves run in row order on one thread.
+// The function returns dzvector, or NULL if an argument is NULL.
+*/
+
+typedef struct {
+    INTG lmatsize;
+    INTG itype;
+    INTG inumlower;
+    ucds * ourfactor;
+    FLPT * dinvdiag;
+    INTG inofwdlevels;
+    INTG * lfwdstart;
+    INTG * lfwdrows;
+    INTG inobacklevels;
+    INTG * lbackstart;
+    INTG * lbackrows;
+} ucdsprecond;
+
+ucdsprecond * create_ucdsprecond(const ucds * ucdsa, const INTG itype, 
+    const FLPT domega);
+
+void destroy_ucdsprecond(ucdsprecond * ourprec);
+
+FLPT * apply_ucdsprecond(const ucdsprecond * ourprec, 
+    const FLPT * drvector, FLPT * dzvector);
+
+/* 
+// The dtobf16 function rounds a value to bfloat16 (to nearest, ties to
+// even), and dfrombf16 converts it back. Rounding is done as a float, so
+// under BIGFLOAT a double is rounded to float first.
+*/
+
+uint16_t dtobf16(const FLPT dvalue);
+
+FLPT dfrombf16(const uint16_t uvalue);
+
 /* 
 // mmatrix_ucds generates a "sample" M-matrix in ucds form. A M-matrix is 
 // a matrix which is strictly diagonally dominant, but all off-diagonal 
@@ -291,6 +611,16 @@ ucds* create_ucds(const INTG lmatsize, INTG * ldiagindices,
 ucds * mmatrix_ucds(const INTG lmatsize, INTG * ldiagindices, FLPT *
     ddiagvals, const INTG lnumdiag);
 
+/* 
+// The mmatrix_ucdsconst function is like mmatrix_ucds, except that it
+// creates the matrix with UCDSCONST storage. As every value in a diagonal
+// is the same, only ddiagvals is kept, so the matrix takes up almost no
+// memory and multiplying by it only reads and writes the vectors.
+*/
+
+ucds * mmatrix_ucdsconst(const INTG lmatsize, INTG * ldiagindices, FLPT *
+    ddiagvals, const INTG lnumdiag);
+
 // ? Does it make sense?
 
 /*
@@ -305,7 +635,29 @@ ucds * mmatrix_ucds(const INTG lmatsize, INTG * ldiagindices, FLPT *
 
 INTG createspdd(INTG inodiags, INTG * ldiagelems, FLPT * ddiagvals);
 
-/* The destroy_ucds function deallocates and destroys a ucds instance. */
+/*
+// The create3dstencil function is like createspdd, but creates the
+// diagonals of a 3D finite difference stencil on an inx * iny * nz grid
+// (numbered x first, then y, then z). The point (x, y, z) is coupled to 
+// (x + dx, y + dy, z + dz) on the diagonal dx + dy*inx + dz*inx*iny. 
+// Arguments:
+// inx, iny: the size of the grid in x and y (both at least 3).
+// inopoints: 7 (faces), 19 (faces and edges) or 27 (the whole cube).
+// ldiagelems: set to the inopoints indices for the diagonals (ascending).
+// ddiagvals: set to inopoints - 1 on the main diagonal, -1 elsewhere.
+//
+// The function returns 0 for failure, and 1 for success.
+// Note: like the rest of this code, the diagonals ignore the edges of 
+// the grid, so rows near them couple to the far side of the grid.
+*/
+
+INTG create3dstencil(INTG inx, INTG iny, INTG inopoints, INTG * ldiagelems, 
+    FLPT * ddiagvals);
+
+/* 
+// The destroy_ucds function deallocates and destroys a ucds instance. It
+// does nothing if ourucds is NULL.
+*/
 
 void destroy_ucds(ucds * ourucds);
 
@@ -336,6 +688,30 @@ FLPT * multiply_ucds(const ucds *ourucds, const FLPT *dvector, FLPT * dret);
 
 FLPT * multiply_ucdsalt(const ucds *ourucds, const FLPT *dvector, FLPT * dret);
 
+/* 
+// The multiply_ucdsrow function is another implementation of UCDS vector
+// multiplication. Rather than share out diagonals, it gives each OpenMP
+// thread a contiguous block of rows of dret. The thread zeroes its own
+// block and then gathers the contributions of every diagonal into it, so
+// no two threads write the same element and no atomics are needed. The
+// arguments are otherwise the same as multiply_ucds.
+*/
+
+FLPT * multiply_ucdsrow(const ucds *ourucds, const FLPT *dvector, FLPT * dret);
+
+/* 
+// The multiply_ucdssingle and multiply_ucdsbf16 functions are versions of
+// multiply_ucdsrow for UCDSSINGLE and UCDSBF16 storage (see narrow_ucds).
+// Each element is widened to FLPT as it is loaded. They return NULL for 
+// any other storage.
+*/
+
+FLPT * multiply_ucdssingle(const ucds *ourucds, const FLPT *dvector, 
+    FLPT * dret);
+
+FLPT * multiply_ucdsbf16(const ucds *ourucds, const FLPT *dvector, 
+    FLPT * dret);
+
 /* 
 // The multiply_ucds27 routine is like the multiply_ucds routine; the only
 // difference is that the number of diagonals is hardwired at 27 by const
@@ -371,6 +747,98 @@ FLPT * multiply_ucdsd5(const ucds *ourucds, const FLPT *dvector, FLPT * dret);
 FLPT * multiply_ucdsaltd27(const ucds *ourucds, const FLPT *dvector, FLPT * dret);
 FLPT * multiply_ucdsaltd5(const ucds *ourucds, const FLPT *dvector, FLPT * dret);
 
+/* 
+// The multiply_ucdssse, multiply_ucdsavx2 and multiply_ucdsavx512 functions
+// are UCDS multiplication written with SSE2, AVX2 (with FMA) and AVX-512
+// intrinsics, for whichever type FLPT is. They use OpenMP outer loop
+// parallelisation over blocks of rows, and do not depend on what the
+// compiler decides to vectorise. Each returns NULL if the CPU lacks the
+// instruction set (or is not x86). The arguments are otherwise the same
+// as multiply_ucds.
+*/
+
+FLPT * multiply_ucdssse(const ucds *ourucds, const FLPT *dvector, FLPT * dret);
+FLPT * multiply_ucdsavx2(const ucds *ourucds, const FLPT *dvector, FLPT * dret);
+FLPT * multiply_ucdsavx512(const ucds *ourucds, const FLPT *dvector, 
+    FLPT * dret);
+
+/* 
+// The multiply_ucdsconst function performs matrix vector multiplication for
+// a ucds with UCDSCONST storage (such as one from mmatrix_ucdsconst). It 
+// returns NULL for any other storage. The arguments are otherwise the same
+// as multiply_ucds. It can be passed to dconjgrad like the others.
+*/
+
+FLPT * multiply_ucdsconst(const ucds *ourucds, const FLPT *dvector, 
+    FLPT * dret);
+
+/* 
+// The multiply_ucdstiled function is for matrices whose diagonals are spread
+// far apart, such as 3D stencils, where the lowest and highest diagonals
+// are up to nx*ny + nx + 1 apart. It splits the rows into tiles and adds
+// every diagonal to one tile before moving on, so the part of dvector the
+// tile needs is read from memory once rather than once per diagonal. The
+// tile size is worked out from the L2 (or L3) cache size. It uses OpenMP
+// outer loop parallelisation over tiles. The arguments are the same as 
+// multiply_ucds.
+*/
+
+FLPT * multiply_ucdstiled(const ucds *ourucds, const FLPT *dvector, 
+    FLPT * dret);
+
+/* 
+// The multiply_ucdsrowdot and multiply_ucdstileddot functions are fused
+// versions of multiply_ucdsrow and multiply_ucdstiled. Besides setting
+// dret to the product, they set *ddot to dvector.dret (as ddotprod
+// would), summing each row while it is still in a register or the L1
+// cache. This saves a second pass over dvector and dret. The arguments 
+// are the same as multiply_ucds, plus ddot; they return NULL if ddot is
+// NULL.
+*/
+
+FLPT * multiply_ucdsrowdot(const ucds *ourucds, const FLPT *dvector, 
+    FLPT * dret, FLPT * ddot);
+
+FLPT * multiply_ucdstileddot(const ucds *ourucds, const FLPT *dvector, 
+    FLPT * dret, FLPT * ddot);
+
+/*
+// The matpowers_ucds function is the matrix powers kernel: it sets the
+// ipowers + 1 vectors (of size lmatsize, one after another) of dpowers 
+// to dvector, dscale.A.dvector, ..., (dscale.A)^ipowers dvector, for A 
+// ourucds (which must have UCDSFULL storage; dscale keeps the vectors 
+// from growing, and 1.0 gives the plain powers). Row j of each needs only
+// the rows of the one before within the lowest and highest offsets of j,
+// so each thread works out all the powers of its rows in one sweep, in
+// tiles sized for the level 2 cache, and only the rows near the edges of
+// its block wait on other threads. It returns dpowers, or NULL if an 
+// argument is NULL, ipowers is negative or above UCDSMAXPOWERS, or 
+// ourucds is not UCDSFULL.
+*/
+
+FLPT * matpowers_ucds(const ucds *ourucds, const FLPT *dvector, 
+    const INTG ipowers, const FLPT dscale, FLPT * dpowers);
+
+/* 
+// The multiply_ucds_multi function multiplies one matrix by several vectors
+// at once. The arguments are:
+//
+// - ourucds: a pointer to a ucds instance (either UCDSFULL or UCDSCONST).
+// - inovects: the number of vectors (from 1 to UCDSMAXRHS).
+// - dvectors: the vectors, interleaved (see dinterleave), so that element
+// i of vector v is at dvectors[i*inovects + v].
+// - drets: the results, interleaved in the same way. This must have
+// ourucds->lmatsize * inovects values allocated to it already.
+//
+// Each element of the matrix is read once and used for all the vectors,
+// rather than read once per vector. If successful, the function returns
+// drets. Otherwise, it returns NULL. It uses OpenMP outer loop 
+// parallelisation over rows.
+*/
+
+FLPT * multiply_ucds_multi(const ucds *ourucds, const INTG inovects, 
+    const FLPT *dvectors, FLPT * drets);
+
 /* This code is for testing. */
 
 /*
@@ -396,6 +864,52 @@ typedef FLPT * (* fpmult) (const ucds *, const FLPT *, FLPT *);
 
 typedef FLPT (* fpnorm) (const INTG, const INTG, const FLPT *);
 
+/* The fpmultmulti typedef is for functions like multiply_ucds_multi. */
+
+typedef FLPT * (* fpmultmulti) (const ucds *, const INTG, const FLPT *, 
+    FLPT *);
+
+/* The fpmultdot typedef is for functions like multiply_ucdsrowdot. */
+
+typedef FLPT * (* fpmultdot) (const ucds *, const FLPT *, FLPT *, FLPT *);
+
+/*
+// The best_multiply_ucds function returns the fastest of the SIMD
+// multiplication functions that this CPU can run. It probes the CPU
+// (with CPUID) the first time it is called only. It returns
+// multiply_ucdsrow when no SIMD kernel is available.
+*/
+
+fpmult best_multiply_ucds(void);
+
+/*
+// The fixed_multiply_ucds function returns a multiplication function 
+// written for exactly lnumdiag diagonals. Such functions are generated
+// for every odd number of diagonals from UCDSMINFIXED to UCDSMAXFIXED
+// (which takes in the 7 and 19 point 3D stencils), with the loop over
+// the diagonals unrolled. They use OpenMP outer loop parallelisation,
+// and return NULL for a ucds with a different number of diagonals. For
+// any other lnumdiag, fixed_multiply_ucds returns NULL.
+//
+// The select_multiply_ucds function picks a multiplication function for
+// ourucds: multiply_ucdsconst for UCDSCONST storage, multiply_ucdssingle
+// and multiply_ucdsbf16 for narrow storage, the fixed count 
+// function for its number of diagonals if there is one, and otherwise
+// best_multiply_ucds(). It returns NULL if ourucds is NULL.
+*/
+
+fpmult fixed_multiply_ucds(const INTG lnumdiag);
+
+fpmult select_multiply_ucds(const ucds *ourucds);
+
+/*
+// The fused_multiply_ucds function returns the fused multiplication and
+// dot product function (see multiply_ucdsrowdot) that goes with 
+// fpucdsmult, or NULL if there is none.
+*/
+
+fpmultdot fused_multiply_ucds(const fpmult fpucdsmult);
+
 typedef struct {
     INTG lnumdiag;
     INTG * ldiagindices;
@@ -420,6 +934,58 @@ mmtestbed * mmsetup(INTG lnumdiag, INTG ivectsize, mmtestbed * mmref);
 
 void mmdestroy(mmtestbed * mmref);
     
+/*
+// A vplan (vector plan) describes a vector expression of the form
+//
+//     dret = dmatcoeff * A * dmatvector + sum of dcoeffs[k] * dterms[k]
+//
+// with at most one UCDS matrix term and up to VPLANMAXTERMS vector terms,
+// such as r = b - Ax or d = r + beta * d. Evaluating a plan makes one 
+// pass over the vectors, where the routines above (dvectsub after a 
+// multiplication, or a chain of dsaxpy calls) make one pass each and 
+// need a vector for every part done, like dbandaproduct in dconjgrad.
+// A plan only holds pointers to its vectors, so it can be made once and
+// evaluated each time their values change.
+//
+// - init_vplan sets up ourplan (usually a local variable) for vectors of
+//   size lvectsize, with no terms.
+// - addterm_vplan adds the term dcoeff * dvector.
+// - addmult_vplan sets the matrix term to dcoeff * ourucds * dvector. 
+//   ourucds must have UCDSFULL storage and be of size lvectsize, and a 
+//   plan can only have one matrix term.
+// These return ourplan, or NULL if the term cannot be added.
+// - eval_vplan sets dret to the value of the plan and returns it.
+// - evaldot_vplan does the same, and returns dret.dret as well (NaN on 
+//   failure).
+// dret may be one of the vector terms (as in d = r + beta * d), but not
+// the vector multiplied by the matrix (the evaluation returns NULL).
+*/
+
+#define VPLANMAXTERMS 8
+#define VPLANTILE 1024
+
+typedef struct {
+    INTG lvectsize;
+    INTG inoterms;
+    FLPT dcoeffs[VPLANMAXTERMS];
+    const FLPT * dterms[VPLANMAXTERMS];
+    FLPT dmatcoeff;
+    const ucds * ourucds;
+    const FLPT * dmatvector;
+} vplan;
+
+vplan * init_vplan(vplan * ourplan, const INTG lvectsize);
+
+vplan * addterm_vplan(vplan * ourplan, const FLPT dcoeff, 
+    const FLPT * dvector);
+
+vplan * addmult_vplan(vplan * ourplan, const FLPT dcoeff, 
+    const ucds * ourucds, const FLPT * dvector);
+
+FLPT * eval_vplan(const vplan * ourplan, FLPT * dret);
+
+FLPT evaldot_vplan(const vplan * ourplan, FLPT * dret);
+
 /*
 // The printucds function prints an ucds instance to standard output. */
 
@@ -442,11 +1008,235 @@ void printucds(const char * name, ucds * ourucds);
 // if it is NULL
 //
 // If successful, the function returns dvectx (which represents the vector x).
-// Otherwise, it returns NULL.
+// Otherwise, it returns NULL. (This includes when fpucdsmult does not handle 
+// the storage of ucdsa - for example, multiply_ucds with a UCDSCONST ucds.)
+//
+// If fused_multiply_ucds has a fused function for fpucdsmult, it is used 
+// to work out q = Ad and dTq together. If fpucdsmult is multiply_ucdsrow,
+// r = b - Ax is worked out with a vplan, without forming Ax; for other
+// functions, Ax is formed with fpucdsmult, so a solve only ever uses the
+// multiplication it is given.
 */
 
 FLPT * dconjgrad(const ucds * ucdsa, const FLPT * dvectb, const FLPT *dvectx0,
     FLPT * dvectx, fpmult fpucdsmult, fpnorm fpdnorm, 
     INTG imode, const FLPT derror, INTG * inoiter);
 
+/*
+// A cgworkspace holds the vectors the conjugate gradient method works
+// with (q, r, d, the product Ax, and for dpconjgradws, z and the inverse
+// of the main diagonal; dconjgradpipe also uses s and w), so that many
+// systems of the same size can be solved without assigning memory for
+// each one. The vectors are assigned and zeroed (see dassignlocal) when
+// the workspace is made, so their pages are already faulted in before
+// any solve is timed. It may also hold inobasis more vectors, one after
+// another in dbasis (NULL if there are none), for the basis of 
+// dconjgradsstep or the blocks of dconjgradblockws, and room in 
+// dgrampartials for the block sums of the Gram matrices of 
+// dconjgradblockws for up to inogram systems. The workspace also keeps 
+// the time (in nanoseconds) and iterations of the last solve, and the 
+// total time and number of solves.
+//
+// create_cgworkspace makes a workspace for vectors of size lvectsize, and
+// returns NULL if it cannot. create_cgworkspacebasis does the same, with
+// inobasis vectors in dbasis. create_cgworkspaceblock makes one for 
+// dconjgradblockws with inovects (from 1 to UCDSMAXRHS) systems. 
+// destroy_cgworkspace frees any of them (and accepts NULL). dconjgradws 
+// is dconjgrad using the workspace ourws; it returns NULL if ourws is 
+// NULL or of a different size to ucdsa. dconjgrad makes a workspace for
+// each call.
+*/
+
+typedef struct {
+    INTG lvectsize;
+    FLPT * dqvector;
+    FLPT * drvector;
+    FLPT * ddvector;
+    FLPT * dbandaproduct;
+    FLPT * dzvector;
+    FLPT * dinvdiag;
+    FLPT * dsvector;
+    FLPT * dwvector;
+    INTG inobasis;
+    FLPT * dbasis;
+    INTG inogram;
+    FLPT * dgrampartials;
+    TLEN tlastsolve;
+    TLEN ttotalsolve;
+    INTG inosolves;
+    INTG ilastiter;
+} cgworkspace;
+
+cgworkspace * create_cgworkspace(const INTG lvectsize);
+
+cgworkspace * create_cgworkspacebasis(const INTG lvectsize, 
+    const INTG inobasis);
+
+cgworkspace * create_cgworkspaceblock(const INTG lvectsize, 
+    const INTG inovects);
+
+void destroy_cgworkspace(cgworkspace * ourws);
+
+FLPT * dconjgradws(cgworkspace * ourws, const ucds * ucdsa, 
+    const FLPT * dvectb, const FLPT *dvectx0, FLPT * dvectx, 
+    fpmult fpucdsmult, fpnorm fpdnorm, INTG imode, const FLPT derror, 
+    INTG * inoiter);
+
+/*
+// The dconjgradpar function is dconjgradws for a ucds with UCDSFULL 
+// storage (it returns NULL otherwise), run in one OpenMP parallel region
+// for the whole solve rather than one per vector operation. Each thread
+// keeps the rows that rowblock gives it, multiplies as multiply_ucdsrowdot
+// does, and the dot products are summed through per-thread slots and a 
+// barrier, so an iteration costs three barriers rather than about eight
+// forks and joins. This matters most for vectors small enough to fit in
+// cache. The dot products are added in thread order, so the result can
+// change with the number of threads; in deterministic mode (see 
+// setdeterministic), dconjgradws is called with multiply_ucdsrow instead.
+*/
+
+FLPT * dconjgradpar(cgworkspace * ourws, const ucds * ucdsa, 
+    const FLPT * dvectb, const FLPT *dvectx0, FLPT * dvectx, 
+    const FLPT derror, INTG * inoiter);
+
+/*
+// The dconjgradpipe function is dconjgradpar with the pipelined CG of 
+// Ghysels and Vanroose: it also keeps w = Ar, s = Ap and z = As up to 
+// date, so that both dot products of an iteration (r.r and w.r) are 
+// summed at once, at the barrier the next multiplication needs anyway.
+// That leaves one barrier per iteration, in return for three more vector
+// updates, so it helps most with many threads on small systems. Rounding
+// errors build up faster in the recurrences, so r, w, s and z are worked
+// out afresh every sqrt(n) iterations. Its arguments and results are
+// those of dconjgradpar, and in deterministic mode it is the same.
+*/
+
+FLPT * dconjgradpipe(cgworkspace * ourws, const ucds * ucdsa, 
+    const FLPT * dvectb, const FLPT *dvectx0, FLPT * dvectx, 
+    const FLPT derror, INTG * inoiter);
+
+/*
+// The dconjgradsstep function is s-step (communication avoiding) CG, for 
+// a ucds with UCDSFULL storage and isteps (s, from 1 to UCDSMAXSSTEP)
+// steps at a time. For each s steps, matpowers_ucds builds the basis 
+// V = [d, Ad, ..., A^s d, r, ..., A^(s-1) r], one block of dot products
+// gives G = VTV, and the s steps of CG are then taken on the coordinates
+// of x, r and d in V (with r.r and d.Ad found from G) before x, r and d
+// are rebuilt from V. So there are two sweeps over A and one reduction
+// for every s steps, rather than s sweeps and 2s reductions; in return,
+// there are about twice the multiplications. Small s (up to about 4) 
+// keeps G well conditioned. As in dconjgrad, r is worked out from x every
+// sqrt(n) steps. V is kept in the dbasis of ourws, which must have room
+// for 2s + 1 vectors (see create_cgworkspacebasis). If d.Ad from G is 
+// not positive at the first of the s steps, d is set to r and the basis
+// built again. The function takes and returns what dconjgradpar does, 
+// and also returns NULL if isteps is out of range, ourws has too small a
+// basis, memory runs out, or d.Ad is still not positive for d = r (so A
+// is not positive definite). Its sums do not depend on the number of 
+// threads.
+*/
+
+FLPT * dconjgradsstep(cgworkspace * ourws, const ucds * ucdsa, 
+    const FLPT * dvectb, const FLPT *dvectx0, FLPT * dvectx, 
+    const INTG isteps, const FLPT derror, INTG * inoiter);
+
+/*
+// The dconjgradblockws function is block CG: it solves AX = B for
+// inovects (from 1 to UCDSMAXRHS) right hand sides together. dvectsb,
+// dvectsx0 and dvectsx hold B, the start X0 and the result X as
+// interleaved vectors (see dinterleave). Each iteration makes two passes
+// over the blocks. The first multiplies A by the directions W (reading
+// the matrix once for every system) and, tile by tile while the rows are
+// in cache, sums the inovects * inovects Gram matrices WTW, WTQ, WTR, 
+// QTQ, QTR and RTR (for Q = AW). From these alone, alpha = (PTAP)^-1 PTR
+// and beta = -(PTAP)^-1 PTAR (for the new R) are found, where P = WT are
+// the directions made orthonormal, any that has become dependent on the
+// others being dropped (the breakdown free form of Ji and Li, after 
+// Dubrulle). The second pass updates X and R and builds the next W, row
+// by row. So an iteration moves about ten vectors per system, against 
+// about eleven and the whole matrix for an iteration of dconjgradws. The
+// products in the passes grow with the square of inovects, though (the 
+// sums are unrolled for 2, 4, 8 and 16 systems), so it only pays when 
+// dconjgradws is held up by memory. On one core, with five diagonals, it
+// took (in ms per iteration per system, against dconjgradws):
+//
+//   n = 2e5, in cache: doubles 4.1 vs 3.5 (2), 6.4 vs 3.4 (3), 5.6 vs 
+//   3.5 (4), 4.7 vs 3.2 (8), 11.3 vs 3.5 (16); floats 2.6 vs 1.2 (2), 
+//   7.6 vs 1.1 (3), 4.6 vs 1.0 (4), 3.5 vs 1.2 (8), 6.2 vs 1.2 (16).
+//   n = 1e6: doubles 19.6 vs 40.1 (2), 35.0 vs 40.8 (3), 29.0 vs 41.5 
+//   (4), 27.1 vs 40.7 (8), 54.9 vs 39.1 (16); floats 14.8 vs 21.5 (2), 
+//   39.4 vs 20.9 (3), 24.7 vs 20.3 (4), 20.9 vs 21.3 (8), 31.3 vs 21.3 
+//   (16).
+//
+// As the directions of every system are shared, it tends to take no 
+// more iterations than the slowest system solved apart, though not when 
+// the residuals of the systems come to lie along the same few 
+// eigenvectors (as for right hand sides that share a large part), when 
+// it can take more than twice as many. The loop stops when the rTr of 
+// every system passes the tests dconjgrad makes, or after n + 1 
+// iterations, and R is worked out from X every sqrt(n) iterations. Q, R 
+// and W are kept in ourws, which must come from create_cgworkspaceblock 
+// with at least inovects systems. The function sets *inoiter (if it is 
+// not NULL) to the number of iterations and returns dvectsx, or NULL if 
+// an argument is NULL, inovects is out of range, ourws does not suit 
+// ucdsa and inovects, or ucdsa is neither UCDSFULL nor UCDSCONST. Its 
+// sums do not depend on the number of threads. dconjgradblock is the 
+// same, with a workspace made for each call (it also returns NULL if 
+// there is no memory for one), but for UCDSFULL matrices it only solves 
+// the systems together where that was found to win above: for 2, 4 (but 
+// not with floats) and 8 systems, when dconjgradws would move at least 
+// UCDSBLOCKMINBYTES each iteration. Otherwise it solves them one at a 
+// time with dconjgradws, and sets *inoiter to the most iterations any 
+// of them took.
+*/
+
+FLPT * dconjgradblockws(cgworkspace * ourws, const ucds * ucdsa, 
+    const INTG inovects, const FLPT * dvectsb, const FLPT * dvectsx0, 
+    FLPT * dvectsx, const FLPT derror, INTG * inoiter);
+
+FLPT * dconjgradblock(const ucds * ucdsa, const INTG inovects, 
+    const FLPT * dvectsb, const FLPT * dvectsx0, FLPT * dvectsx, 
+    const FLPT derror, INTG * inoiter);
+
+/*
+// The dpconjgrad and dpconjgradws functions are dconjgrad and dconjgradws
+// with a Jacobi preconditioner M (the main diagonal of ucdsa, see 
+// jacobi_ucds). Each iteration sets z = M^-1 r with dpcgupdate, in the 
+// same pass as the updates of x and r, and uses r.z in place of r.r, so
+// it costs one more vector stream than dconjgrad. The loop stops when 
+// r.z passes the tests dconjgrad makes of r.r, so r.r itself may not 
+// pass them (on the scaled test matrix at n = 1000 and derror 1e-3, it
+// ends at about 5e-7, not 1e-9). On matrices with badly scaled rows, 
+// this can take far fewer iterations. The functions return NULL (as well
+// as for the reasons of dconjgrad) if ucdsa has no main diagonal or a 
+// zero on it.
+*/
+
+FLPT * dpconjgrad(const ucds * ucdsa, const FLPT * dvectb, 
+    const FLPT *dvectx0, FLPT * dvectx, fpmult fpucdsmult, fpnorm fpdnorm, 
+    INTG imode, const FLPT derror, INTG * inoiter);
+
+FLPT * dpconjgradws(cgworkspace * ourws, const ucds * ucdsa, 
+    const FLPT * dvectb, const FLPT *dvectx0, FLPT * dvectx, 
+    fpmult fpucdsmult, fpnorm fpdnorm, INTG imode, const FLPT derror, 
+    INTG * inoiter);
+
+/*
+// The dprecconjgradws function is dpconjgradws with the preconditioner
+// ourprec (see create_ucdsprecond) in place of the Jacobi one: after the
+// updates of x and r, z = M^-1 r is found with apply_ucdsprecond, and
+// r.z with ddotprod. The two solves cost about as much as one more
+// multiplication by ucdsa, in return for fewer iterations: for the 27
+// point stencil on a 40^3 grid, 43 with IC(0) and 53 with SSOR against 73
+// for dconjgrad, and on badly scaled matrices about a third of those of
+// dpconjgradws.
+// It returns NULL (as well as for the reasons of dconjgradws) if ourprec 
+// is NULL or of a different size to ucdsa.
+*/
+
+FLPT * dprecconjgradws(cgworkspace * ourws, const ucdsprecond * ourprec, 
+    const ucds * ucdsa, const FLPT * dvectb, const FLPT *dvectx0, 
+    FLPT * dvectx, fpmult fpucdsmult, fpnorm fpdnorm, INTG imode, 
+    const FLPT derror, INTG * inoiter);
+
 #endif /* UCDS_H */    